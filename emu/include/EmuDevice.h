@@ -0,0 +1,241 @@
+/* Shared state of the CPU emulation of the CUDA runtime and NPP.
+ *
+ * The emulated "device memory" is ordinary host memory, but every allocation
+ * is registered with the device that made it, so copies can check that their
+ * pointers really are on the side their cudaMemcpyKind claims and can be
+ * charged to a device.  Each device keeps a running account of the bytes
+ * uploaded, downloaded and copied on the device, which is what a benchmark
+ * on a machine without a GPU can actually compare between runs.
+ *
+ * The number of devices is 1 unless NPP_EMU_DEVICES says otherwise or the
+ * program calls emu::setDeviceCount().  As in CUDA, the current device is a
+ * property of the calling host thread.
+ */
+
+#ifndef NPP_EMU_DEVICE_H
+#define NPP_EMU_DEVICE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace emu
+{
+
+// Allocations start, and nppiMalloc rows are padded, to this many bytes.
+static const size_t kPitchAlignment = 512;
+static const int kMaxDevices = 64;
+// Byte that fresh allocations are filled with.
+static const unsigned char kUninitialized = 0xCD;
+
+struct Traffic
+{
+    size_t nBytesToDevice;   // host to device copies
+    size_t nBytesToHost;     // device to host copies
+    size_t nBytesOnDevice;   // device to device copies
+    size_t nBytesAllocated;  // currently allocated
+    size_t nPeakAllocated;   // high water mark of nBytesAllocated
+    unsigned int nAllocations;
+
+    Traffic()
+        : nBytesToDevice(0), nBytesToHost(0), nBytesOnDevice(0),
+          nBytesAllocated(0), nPeakAllocated(0), nAllocations(0)
+    {
+    }
+};
+
+class Devices
+{
+public:
+    static Devices &instance()
+    {
+        static Devices oDevices;
+        return oDevices;
+    }
+
+    int count()
+    {
+        std::lock_guard<std::mutex> oLock(oMutex_);
+        return (int)aTraffic_.size();
+    }
+
+    // Devices holding live allocations are kept.
+    void setCount(int nDevices)
+    {
+        std::lock_guard<std::mutex> oLock(oMutex_);
+
+        if (!aAllocations_.empty())
+        {
+            nDevices = std::max(nDevices, (int)aTraffic_.size());
+        }
+
+        aTraffic_.resize(std::max(1, std::min(kMaxDevices, nDevices)));
+    }
+
+    // The calling thread's current device.
+    static int &current()
+    {
+        static thread_local int nDevice = 0;
+        return nDevice;
+    }
+
+    // Filled with kUninitialized, not zero: cudaMalloc does not clear memory,
+    // and reads of pixels no kernel or copy wrote should show.
+    void *allocate(size_t nBytes)
+    {
+        size_t nRounded = (std::max<size_t>(nBytes, 1) + kPitchAlignment - 1) /
+                          kPitchAlignment * kPitchAlignment;
+        void *pMemory = 0;
+
+        if (posix_memalign(&pMemory, kPitchAlignment, nRounded) != 0)
+        {
+            return 0;
+        }
+
+        std::fill((unsigned char *)pMemory, (unsigned char *)pMemory + nRounded,
+                  kUninitialized);
+
+        std::lock_guard<std::mutex> oLock(oMutex_);
+        int nDevice = std::min(current(), (int)aTraffic_.size() - 1);
+        Allocation oAllocation = {nBytes, nDevice};
+        aAllocations_[(uintptr_t)pMemory] = oAllocation;
+
+        Traffic &rTraffic = aTraffic_[nDevice];
+        rTraffic.nBytesAllocated += nBytes;
+        rTraffic.nPeakAllocated = std::max(rTraffic.nPeakAllocated,
+                                           rTraffic.nBytesAllocated);
+        ++rTraffic.nAllocations;
+        return pMemory;
+    }
+
+    // False when pMemory is not the start of a live allocation.
+    bool release(void *pMemory)
+    {
+        {
+            std::lock_guard<std::mutex> oLock(oMutex_);
+            std::map<uintptr_t, Allocation>::iterator it =
+                aAllocations_.find((uintptr_t)pMemory);
+
+            if (it == aAllocations_.end())
+            {
+                return false;
+            }
+
+            aTraffic_[it->second.nDevice].nBytesAllocated -= it->second.nBytes;
+            aAllocations_.erase(it);
+        }
+
+        free(pMemory);
+        return true;
+    }
+
+    // Device owning the nBytes at pMemory, -1 for host memory and -2 when the
+    // range starts in an allocation but runs past its end.
+    int deviceOf(const void *pMemory, size_t nBytes)
+    {
+        std::lock_guard<std::mutex> oLock(oMutex_);
+        uintptr_t nAddress = (uintptr_t)pMemory;
+        std::map<uintptr_t, Allocation>::iterator it =
+            aAllocations_.upper_bound(nAddress);
+
+        if (it == aAllocations_.begin())
+        {
+            return -1;
+        }
+
+        --it;
+
+        if (nAddress >= it->first + std::max<size_t>(it->second.nBytes, 1))
+        {
+            return -1;
+        }
+
+        return nAddress + nBytes <= it->first + it->second.nBytes
+                   ? it->second.nDevice
+                   : -2;
+    }
+
+    void addToDevice(int nDevice, size_t nBytes)
+    {
+        std::lock_guard<std::mutex> oLock(oMutex_);
+        aTraffic_[nDevice].nBytesToDevice += nBytes;
+    }
+
+    void addToHost(int nDevice, size_t nBytes)
+    {
+        std::lock_guard<std::mutex> oLock(oMutex_);
+        aTraffic_[nDevice].nBytesToHost += nBytes;
+    }
+
+    void addOnDevice(int nDevice, size_t nBytes)
+    {
+        std::lock_guard<std::mutex> oLock(oMutex_);
+        aTraffic_[nDevice].nBytesOnDevice += nBytes;
+    }
+
+    Traffic traffic(int nDevice)
+    {
+        std::lock_guard<std::mutex> oLock(oMutex_);
+        return nDevice >= 0 && nDevice < (int)aTraffic_.size() ? aTraffic_[nDevice]
+                                                               : Traffic();
+    }
+
+    // Clears the copy counters, keeping the allocation counts.
+    void resetTraffic()
+    {
+        std::lock_guard<std::mutex> oLock(oMutex_);
+
+        for (size_t i = 0; i < aTraffic_.size(); ++i)
+        {
+            aTraffic_[i].nBytesToDevice = 0;
+            aTraffic_[i].nBytesToHost = 0;
+            aTraffic_[i].nBytesOnDevice = 0;
+        }
+    }
+
+private:
+    struct Allocation
+    {
+        size_t nBytes;
+        int nDevice;
+    };
+
+    Devices()
+    {
+        const char *pCount = getenv("NPP_EMU_DEVICES");
+        int nDevices = pCount ? atoi(pCount) : 1;
+        aTraffic_.resize(std::max(1, std::min(kMaxDevices, nDevices)));
+    }
+
+    std::mutex oMutex_;
+    std::map<uintptr_t, Allocation> aAllocations_;
+    std::vector<Traffic> aTraffic_;
+};
+
+inline int deviceCount()
+{
+    return Devices::instance().count();
+}
+
+inline void setDeviceCount(int nDevices)
+{
+    Devices::instance().setCount(nDevices);
+}
+
+inline Traffic traffic(int nDevice)
+{
+    return Devices::instance().traffic(nDevice);
+}
+
+inline void resetTraffic()
+{
+    Devices::instance().resetTraffic();
+}
+
+} // namespace emu
+
+#endif // NPP_EMU_DEVICE_H
@@ -0,0 +1,425 @@
+/* CPU emulation of the part of the CUDA runtime API this project uses.
+ *
+ * Device memory is host memory owned by emu::Devices (EmuDevice.h).  Copies
+ * check their pointers against cudaMemcpyKind, which is stricter than the
+ * real runtime with unified addressing but catches swapped arguments.
+ * Streams exist so code written for overlap compiles and runs, but every
+ * operation completes before the call returns.
+ */
+
+#ifndef NPP_EMU_CUDA_RUNTIME_H
+#define NPP_EMU_CUDA_RUNTIME_H
+
+#include "EmuDevice.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#define CUDART_VERSION 12040
+
+enum cudaError
+{
+    cudaSuccess = 0,
+    cudaErrorInvalidValue = 1,
+    cudaErrorMemoryAllocation = 2,
+    cudaErrorInvalidPitchValue = 12,
+    cudaErrorInvalidDevicePointer = 17,
+    cudaErrorInvalidMemcpyDirection = 21,
+    cudaErrorInvalidDevice = 101
+};
+typedef enum cudaError cudaError_t;
+
+enum cudaMemcpyKind
+{
+    cudaMemcpyHostToHost = 0,
+    cudaMemcpyHostToDevice = 1,
+    cudaMemcpyDeviceToHost = 2,
+    cudaMemcpyDeviceToDevice = 3,
+    cudaMemcpyDefault = 4
+};
+
+struct CUstream_st
+{
+    int nDevice;
+};
+typedef struct CUstream_st *cudaStream_t;
+
+struct cudaDeviceProp
+{
+    char name[256];
+    size_t totalGlobalMem;
+    size_t sharedMemPerBlock;
+    int regsPerBlock;
+    int warpSize;
+    int maxThreadsPerBlock;
+    int clockRate;
+    int major;
+    int minor;
+    int multiProcessorCount;
+    int l2CacheSize;
+    int integrated;
+    int computeMode;
+};
+
+namespace emu
+{
+namespace detail
+{
+
+inline cudaError_t lastError(cudaError_t eError, bool bReset = false)
+{
+    static thread_local cudaError_t eLast = cudaSuccess;
+    cudaError_t eResult = eLast;
+
+    if (bReset)
+    {
+        eLast = cudaSuccess;
+    }
+    else if (eError != cudaSuccess)
+    {
+        eLast = eError;
+    }
+
+    return bReset ? eResult : eError;
+}
+
+// Resolves cudaMemcpyDefault and checks both sides of a nBytes x nRows copy
+// whose rows are nDstPitch and nSrcPitch apart.
+inline cudaError_t checkCopy(void *pDst, size_t nDstPitch, const void *pSrc,
+                             size_t nSrcPitch, size_t nBytes, size_t nRows,
+                             cudaMemcpyKind &rKind, int &rDevice)
+{
+    if (nRows == 0 || nBytes == 0)
+    {
+        rDevice = -1;
+        return cudaSuccess;
+    }
+
+    if (pDst == 0 || pSrc == 0)
+    {
+        return cudaErrorInvalidValue;
+    }
+
+    if (nDstPitch < nBytes || nSrcPitch < nBytes)
+    {
+        return cudaErrorInvalidPitchValue;
+    }
+
+    Devices &rDevices = Devices::instance();
+    int nDstDevice = rDevices.deviceOf(pDst, nDstPitch * (nRows - 1) + nBytes);
+    int nSrcDevice = rDevices.deviceOf(pSrc, nSrcPitch * (nRows - 1) + nBytes);
+
+    if (nDstDevice == -2 || nSrcDevice == -2)
+    {
+        return cudaErrorInvalidValue;
+    }
+
+    if (rKind == cudaMemcpyDefault)
+    {
+        rKind = nDstDevice >= 0 ? (nSrcDevice >= 0 ? cudaMemcpyDeviceToDevice
+                                                   : cudaMemcpyHostToDevice)
+                                : (nSrcDevice >= 0 ? cudaMemcpyDeviceToHost
+                                                   : cudaMemcpyHostToHost);
+    }
+
+    bool bDstOnDevice = rKind == cudaMemcpyHostToDevice ||
+                        rKind == cudaMemcpyDeviceToDevice;
+    bool bSrcOnDevice = rKind == cudaMemcpyDeviceToHost ||
+                        rKind == cudaMemcpyDeviceToDevice;
+
+    if ((nDstDevice >= 0) != bDstOnDevice || (nSrcDevice >= 0) != bSrcOnDevice)
+    {
+        return cudaErrorInvalidMemcpyDirection;
+    }
+
+    rDevice = bDstOnDevice ? nDstDevice : nSrcDevice;
+    return cudaSuccess;
+}
+
+inline cudaError_t copy2D(void *pDst, size_t nDstPitch, const void *pSrc,
+                          size_t nSrcPitch, size_t nBytes, size_t nRows,
+                          cudaMemcpyKind eKind)
+{
+    int nDevice = -1;
+    cudaError_t eResult = checkCopy(pDst, nDstPitch, pSrc, nSrcPitch, nBytes,
+                                    nRows, eKind, nDevice);
+
+    if (eResult != cudaSuccess)
+    {
+        return lastError(eResult);
+    }
+
+    for (size_t y = 0; y < nRows; ++y)
+    {
+        memcpy(static_cast<char *>(pDst) + y * nDstPitch,
+               static_cast<const char *>(pSrc) + y * nSrcPitch, nBytes);
+    }
+
+    if (nDevice >= 0)
+    {
+        size_t nTotal = nBytes * nRows;
+
+        if (eKind == cudaMemcpyHostToDevice)
+        {
+            Devices::instance().addToDevice(nDevice, nTotal);
+        }
+        else if (eKind == cudaMemcpyDeviceToHost)
+        {
+            Devices::instance().addToHost(nDevice, nTotal);
+        }
+        else
+        {
+            Devices::instance().addOnDevice(nDevice, nTotal);
+        }
+    }
+
+    return cudaSuccess;
+}
+
+} // namespace detail
+} // namespace emu
+
+inline cudaError_t cudaGetDeviceCount(int *pCount)
+{
+    if (pCount == 0)
+    {
+        return emu::detail::lastError(cudaErrorInvalidValue);
+    }
+
+    *pCount = emu::deviceCount();
+    return cudaSuccess;
+}
+
+inline cudaError_t cudaSetDevice(int nDevice)
+{
+    if (nDevice < 0 || nDevice >= emu::deviceCount())
+    {
+        return emu::detail::lastError(cudaErrorInvalidDevice);
+    }
+
+    emu::Devices::current() = nDevice;
+    return cudaSuccess;
+}
+
+inline cudaError_t cudaGetDevice(int *pDevice)
+{
+    if (pDevice == 0)
+    {
+        return emu::detail::lastError(cudaErrorInvalidValue);
+    }
+
+    *pDevice = emu::Devices::current();
+    return cudaSuccess;
+}
+
+// The emulated devices share the host: the cores are split between them and
+// the memory is reported as unlimited.  There is no compute capability.
+inline cudaError_t cudaGetDeviceProperties(cudaDeviceProp *pProp, int nDevice)
+{
+    if (pProp == 0)
+    {
+        return emu::detail::lastError(cudaErrorInvalidValue);
+    }
+
+    if (nDevice < 0 || nDevice >= emu::deviceCount())
+    {
+        return emu::detail::lastError(cudaErrorInvalidDevice);
+    }
+
+    unsigned int nCores = std::thread::hardware_concurrency();
+    memset(pProp, 0, sizeof(*pProp));
+    snprintf(pProp->name, sizeof(pProp->name), "NPP CPU emulation #%d", nDevice);
+    pProp->totalGlobalMem = (size_t)-1;
+    pProp->sharedMemPerBlock = 48 * 1024;
+    pProp->regsPerBlock = 65536;
+    pProp->warpSize = 32;
+    pProp->maxThreadsPerBlock = 1024;
+    pProp->multiProcessorCount =
+        (int)std::max(1u, (nCores > 0 ? nCores : 1) / emu::deviceCount());
+    pProp->integrated = 1;
+    return cudaSuccess;
+}
+
+inline cudaError_t cudaDriverGetVersion(int *pVersion)
+{
+    if (pVersion == 0)
+    {
+        return emu::detail::lastError(cudaErrorInvalidValue);
+    }
+
+    *pVersion = CUDART_VERSION;
+    return cudaSuccess;
+}
+
+inline cudaError_t cudaRuntimeGetVersion(int *pVersion)
+{
+    return cudaDriverGetVersion(pVersion);
+}
+
+inline cudaError_t cudaMalloc(void **ppMemory, size_t nBytes)
+{
+    if (ppMemory == 0)
+    {
+        return emu::detail::lastError(cudaErrorInvalidValue);
+    }
+
+    *ppMemory = emu::Devices::instance().allocate(nBytes);
+    return *ppMemory ? cudaSuccess
+                     : emu::detail::lastError(cudaErrorMemoryAllocation);
+}
+
+inline cudaError_t cudaMallocPitch(void **ppMemory, size_t *pPitch,
+                                   size_t nWidthBytes, size_t nHeight)
+{
+    if (pPitch == 0)
+    {
+        return emu::detail::lastError(cudaErrorInvalidValue);
+    }
+
+    *pPitch = (nWidthBytes + emu::kPitchAlignment - 1) / emu::kPitchAlignment *
+              emu::kPitchAlignment;
+    return cudaMalloc(ppMemory, *pPitch * nHeight);
+}
+
+inline cudaError_t cudaFree(void *pMemory)
+{
+    if (pMemory == 0 || emu::Devices::instance().release(pMemory))
+    {
+        return cudaSuccess;
+    }
+
+    return emu::detail::lastError(cudaErrorInvalidDevicePointer);
+}
+
+inline cudaError_t cudaMemcpy(void *pDst, const void *pSrc, size_t nBytes,
+                              cudaMemcpyKind eKind)
+{
+    return emu::detail::copy2D(pDst, nBytes, pSrc, nBytes, nBytes, 1, eKind);
+}
+
+inline cudaError_t cudaMemcpy2D(void *pDst, size_t nDstPitch, const void *pSrc,
+                                size_t nSrcPitch, size_t nWidthBytes,
+                                size_t nHeight, cudaMemcpyKind eKind)
+{
+    return emu::detail::copy2D(pDst, nDstPitch, pSrc, nSrcPitch, nWidthBytes,
+                               nHeight, eKind);
+}
+
+inline cudaError_t cudaMemcpyAsync(void *pDst, const void *pSrc, size_t nBytes,
+                                   cudaMemcpyKind eKind, cudaStream_t = 0)
+{
+    return cudaMemcpy(pDst, pSrc, nBytes, eKind);
+}
+
+inline cudaError_t cudaMemcpy2DAsync(void *pDst, size_t nDstPitch,
+                                     const void *pSrc, size_t nSrcPitch,
+                                     size_t nWidthBytes, size_t nHeight,
+                                     cudaMemcpyKind eKind, cudaStream_t = 0)
+{
+    return cudaMemcpy2D(pDst, nDstPitch, pSrc, nSrcPitch, nWidthBytes, nHeight,
+                        eKind);
+}
+
+inline cudaError_t cudaMemset2D(void *pMemory, size_t nPitch, int nValue,
+                                size_t nWidthBytes, size_t nHeight)
+{
+    if (nHeight == 0 || nWidthBytes == 0)
+    {
+        return cudaSuccess;
+    }
+
+    if (nPitch < nWidthBytes ||
+        emu::Devices::instance().deviceOf(pMemory, nPitch * (nHeight - 1) +
+                                                       nWidthBytes) < 0)
+    {
+        return emu::detail::lastError(cudaErrorInvalidValue);
+    }
+
+    for (size_t y = 0; y < nHeight; ++y)
+    {
+        memset(static_cast<char *>(pMemory) + y * nPitch, nValue, nWidthBytes);
+    }
+
+    return cudaSuccess;
+}
+
+inline cudaError_t cudaMemset(void *pMemory, int nValue, size_t nBytes)
+{
+    return cudaMemset2D(pMemory, nBytes, nValue, nBytes, 1);
+}
+
+inline cudaError_t cudaStreamCreate(cudaStream_t *pStream)
+{
+    if (pStream == 0)
+    {
+        return emu::detail::lastError(cudaErrorInvalidValue);
+    }
+
+    *pStream = new CUstream_st();
+    (*pStream)->nDevice = emu::Devices::current();
+    return cudaSuccess;
+}
+
+inline cudaError_t cudaStreamDestroy(cudaStream_t pStream)
+{
+    delete pStream;
+    return cudaSuccess;
+}
+
+inline cudaError_t cudaStreamSynchronize(cudaStream_t)
+{
+    return cudaSuccess;
+}
+
+inline cudaError_t cudaDeviceSynchronize()
+{
+    return cudaSuccess;
+}
+
+inline cudaError_t cudaDeviceReset()
+{
+    return cudaSuccess;
+}
+
+inline cudaError_t cudaGetLastError()
+{
+    return emu::detail::lastError(cudaSuccess, true);
+}
+
+inline cudaError_t cudaPeekAtLastError()
+{
+    cudaError_t eError = emu::detail::lastError(cudaSuccess, true);
+    return emu::detail::lastError(eError);
+}
+
+inline const char *cudaGetErrorName(cudaError_t eError)
+{
+    switch (eError)
+    {
+    case cudaSuccess:
+        return "cudaSuccess";
+    case cudaErrorInvalidValue:
+        return "cudaErrorInvalidValue";
+    case cudaErrorMemoryAllocation:
+        return "cudaErrorMemoryAllocation";
+    case cudaErrorInvalidPitchValue:
+        return "cudaErrorInvalidPitchValue";
+    case cudaErrorInvalidDevicePointer:
+        return "cudaErrorInvalidDevicePointer";
+    case cudaErrorInvalidMemcpyDirection:
+        return "cudaErrorInvalidMemcpyDirection";
+    case cudaErrorInvalidDevice:
+        return "cudaErrorInvalidDevice";
+    }
+
+    return "cudaErrorUnknown";
+}
+
+inline const char *cudaGetErrorString(cudaError_t eError)
+{
+    return cudaGetErrorName(eError);
+}
+
+#endif // NPP_EMU_CUDA_RUNTIME_H
@@ -0,0 +1,103 @@
+/* CPU emulation of the helper_cuda.h functions this project uses.
+ *
+ * Takes the place of the CUDA samples' helper_cuda.h when building against
+ * the emulated runtime (make emu).  The emulated devices satisfy every
+ * capability check.
+ */
+
+#ifndef NPP_EMU_HELPER_CUDA_H
+#define NPP_EMU_HELPER_CUDA_H
+
+#include "cuda_runtime.h"
+#include "npp.h"
+
+#include <helper_string.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+inline const char *_cudaGetErrorEnum(cudaError_t eError)
+{
+    return cudaGetErrorName(eError);
+}
+
+inline const char *_cudaGetErrorEnum(NppStatus eError)
+{
+    switch (eError)
+    {
+    case NPP_INTERPOLATION_ERROR:
+        return "NPP_INTERPOLATION_ERROR";
+    case NPP_STEP_ERROR:
+        return "NPP_STEP_ERROR";
+    case NPP_MEMORY_ALLOCATION_ERR:
+        return "NPP_MEMORY_ALLOCATION_ERR";
+    case NPP_NULL_POINTER_ERROR:
+        return "NPP_NULL_POINTER_ERROR";
+    case NPP_SIZE_ERROR:
+        return "NPP_SIZE_ERROR";
+    case NPP_BAD_ARGUMENT_ERROR:
+        return "NPP_BAD_ARGUMENT_ERROR";
+    case NPP_CUDA_KERNEL_EXECUTION_ERROR:
+        return "NPP_CUDA_KERNEL_EXECUTION_ERROR";
+    case NPP_NO_ERROR:
+        return "NPP_NO_ERROR";
+    }
+
+    return "<unknown>";
+}
+
+template <typename T>
+void check(T eResult, const char *pFunction, const char *pFile, int nLine)
+{
+    if (eResult)
+    {
+        fprintf(stderr, "CUDA error at %s:%d code=%d(%s) \"%s\" \n", pFile, nLine,
+                static_cast<int>(eResult), _cudaGetErrorEnum(eResult), pFunction);
+        exit(EXIT_FAILURE);
+    }
+}
+
+#define checkCudaErrors(val) check((val), #val, __FILE__, __LINE__)
+
+#define getLastCudaError(msg) __getLastCudaError(msg, __FILE__, __LINE__)
+
+inline void __getLastCudaError(const char *pMessage, const char *pFile, int nLine)
+{
+    cudaError_t eError = cudaGetLastError();
+
+    if (eError != cudaSuccess)
+    {
+        fprintf(stderr, "%s(%i) : getLastCudaError() CUDA error : %s : (%d) %s.\n",
+                pFile, nLine, pMessage, static_cast<int>(eError),
+                cudaGetErrorString(eError));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Selects --device=N, or device 0, and reports it.
+inline int findCudaDevice(int argc, const char **argv)
+{
+    int nDevice = 0;
+
+    if (checkCmdLineFlag(argc, argv, "device"))
+    {
+        nDevice = getCmdLineArgumentInt(argc, argv, "device=");
+    }
+
+    checkCudaErrors(cudaSetDevice(nDevice));
+
+    cudaDeviceProp oProp;
+    checkCudaErrors(cudaGetDeviceProperties(&oProp, nDevice));
+    printf("GPU Device %d: \"%s\" with %d host threads\n\n", nDevice, oProp.name,
+           oProp.multiProcessorCount);
+    return nDevice;
+}
+
+inline bool checkCudaCapabilities(int nMajor, int nMinor)
+{
+    (void)nMajor;
+    (void)nMinor;
+    return true;
+}
+
+#endif // NPP_EMU_HELPER_CUDA_H
@@ -0,0 +1,349 @@
+/* CPU emulation of the part of NPP this project uses.
+ *
+ * Images come from the emulated device heap (EmuDevice.h) with rows padded to
+ * emu::kPitchAlignment, so code that confuses width and pitch fails here as
+ * it would on a GPU.  nppiRotate_8u_C1R runs the host warp of RotateCPU.h on
+ * this device's share of the cores.  Like NPP it leaves the destination
+ * pixels that map outside the source untouched, and emulated allocations are
+ * not zeroed (EmuDevice.h), so a caller must set the background itself.
+ */
+
+#ifndef NPP_EMU_NPP_H
+#define NPP_EMU_NPP_H
+
+#include "cuda_runtime.h"
+
+#include <RotateCPU.h>
+#include <RotateGeometry.h>
+
+#include <algorithm>
+#include <thread>
+
+#define NV_NPPIDEFS_H
+
+typedef unsigned char Npp8u;
+typedef signed char Npp8s;
+typedef unsigned short Npp16u;
+typedef short Npp16s;
+typedef unsigned int Npp32u;
+typedef int Npp32s;
+typedef float Npp32f;
+typedef double Npp64f;
+
+enum NppStatus
+{
+    NPP_INTERPOLATION_ERROR = -22,
+    NPP_STEP_ERROR = -14,
+    NPP_MEMORY_ALLOCATION_ERR = -12,
+    NPP_NULL_POINTER_ERROR = -8,
+    NPP_SIZE_ERROR = -6,
+    NPP_BAD_ARGUMENT_ERROR = -5,
+    NPP_CUDA_KERNEL_EXECUTION_ERROR = -3,
+    NPP_NO_ERROR = 0,
+    NPP_SUCCESS = NPP_NO_ERROR
+};
+
+enum NppiInterpolationMode
+{
+    NPPI_INTER_UNDEFINED = 0,
+    NPPI_INTER_NN = 1,
+    NPPI_INTER_LINEAR = 2,
+    NPPI_INTER_CUBIC = 4,
+    NPPI_INTER_SUPER = 8,
+    NPPI_INTER_LANCZOS = 16
+};
+
+struct NppiSize
+{
+    int width;
+    int height;
+};
+
+struct NppiPoint
+{
+    int x;
+    int y;
+};
+
+struct NppiRect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+struct NppLibraryVersion
+{
+    int major;
+    int minor;
+    int build;
+};
+
+namespace emu
+{
+namespace detail
+{
+
+inline void *mallocImage(int nRowBytes, int nHeight, int *pStep)
+{
+    if (nRowBytes <= 0 || nHeight <= 0 || pStep == 0)
+    {
+        return 0;
+    }
+
+    size_t nPitch = 0;
+    void *pImage = 0;
+
+    if (cudaMallocPitch(&pImage, &nPitch, nRowBytes, nHeight) != cudaSuccess)
+    {
+        return 0;
+    }
+
+    *pStep = (int)nPitch;
+    return pImage;
+}
+
+template <typename T>
+NppStatus setImage(const T *pValue, unsigned int nChannels, T *pDst,
+                   int nDstStep, NppiSize oSizeROI)
+{
+    if (pValue == 0 || pDst == 0)
+    {
+        return NPP_NULL_POINTER_ERROR;
+    }
+
+    if (oSizeROI.width <= 0 || oSizeROI.height <= 0)
+    {
+        return NPP_SIZE_ERROR;
+    }
+
+    if (nDstStep < oSizeROI.width * (int)(nChannels * sizeof(T)))
+    {
+        return NPP_STEP_ERROR;
+    }
+
+    for (int y = 0; y < oSizeROI.height; ++y)
+    {
+        T *pRow = reinterpret_cast<T *>(reinterpret_cast<char *>(pDst) +
+                                        (std::ptrdiff_t)y * nDstStep);
+
+        for (int x = 0; x < oSizeROI.width; ++x)
+        {
+            std::copy(pValue, pValue + nChannels, pRow + x * nChannels);
+        }
+    }
+
+    return NPP_SUCCESS;
+}
+
+// The map nppiRotate applies, in NPP's pixel index coordinates where pixel
+// (x, y) is centred on the integer point.
+inline pipeline::AffineTransform rotateTransform(double nAngle, double nShiftX,
+                                                 double nShiftY)
+{
+    return pipeline::AffineTransform::translation(nShiftX, nShiftY) *
+           pipeline::AffineTransform::rotation(nAngle);
+}
+
+} // namespace detail
+} // namespace emu
+
+#define NPP_EMU_IMAGE_TYPE(TYPE, NAME, CHANNELS)                                 \
+    inline TYPE *nppiMalloc_##NAME##_C##CHANNELS(int nWidth, int nHeight,        \
+                                                 int *pStep)                     \
+    {                                                                            \
+        return static_cast<TYPE *>(emu::detail::mallocImage(                     \
+            nWidth * (int)sizeof(TYPE) * CHANNELS, nHeight, pStep));             \
+    }
+
+NPP_EMU_IMAGE_TYPE(Npp8u, 8u, 1)
+NPP_EMU_IMAGE_TYPE(Npp8u, 8u, 2)
+NPP_EMU_IMAGE_TYPE(Npp8u, 8u, 3)
+NPP_EMU_IMAGE_TYPE(Npp8u, 8u, 4)
+NPP_EMU_IMAGE_TYPE(Npp16u, 16u, 1)
+NPP_EMU_IMAGE_TYPE(Npp16u, 16u, 2)
+NPP_EMU_IMAGE_TYPE(Npp16u, 16u, 3)
+NPP_EMU_IMAGE_TYPE(Npp16u, 16u, 4)
+NPP_EMU_IMAGE_TYPE(Npp16s, 16s, 1)
+NPP_EMU_IMAGE_TYPE(Npp16s, 16s, 2)
+NPP_EMU_IMAGE_TYPE(Npp16s, 16s, 4)
+NPP_EMU_IMAGE_TYPE(Npp32s, 32s, 1)
+NPP_EMU_IMAGE_TYPE(Npp32s, 32s, 3)
+NPP_EMU_IMAGE_TYPE(Npp32s, 32s, 4)
+NPP_EMU_IMAGE_TYPE(Npp32f, 32f, 1)
+NPP_EMU_IMAGE_TYPE(Npp32f, 32f, 2)
+NPP_EMU_IMAGE_TYPE(Npp32f, 32f, 3)
+NPP_EMU_IMAGE_TYPE(Npp32f, 32f, 4)
+
+#undef NPP_EMU_IMAGE_TYPE
+
+#define NPP_EMU_SET(TYPE, NAME)                                                  \
+    inline NppStatus nppiSet_##NAME##_C1R(const TYPE nValue, TYPE *pDst,         \
+                                          int nDstStep, NppiSize oSizeROI)       \
+    {                                                                            \
+        return emu::detail::setImage(&nValue, 1, pDst, nDstStep, oSizeROI);      \
+    }                                                                            \
+    inline NppStatus nppiSet_##NAME##_C2R(const TYPE aValue[2], TYPE *pDst,      \
+                                          int nDstStep, NppiSize oSizeROI)       \
+    {                                                                            \
+        return emu::detail::setImage(aValue, 2, pDst, nDstStep, oSizeROI);       \
+    }                                                                            \
+    inline NppStatus nppiSet_##NAME##_C3R(const TYPE aValue[3], TYPE *pDst,      \
+                                          int nDstStep, NppiSize oSizeROI)       \
+    {                                                                            \
+        return emu::detail::setImage(aValue, 3, pDst, nDstStep, oSizeROI);       \
+    }                                                                            \
+    inline NppStatus nppiSet_##NAME##_C4R(const TYPE aValue[4], TYPE *pDst,      \
+                                          int nDstStep, NppiSize oSizeROI)       \
+    {                                                                            \
+        return emu::detail::setImage(aValue, 4, pDst, nDstStep, oSizeROI);       \
+    }
+
+NPP_EMU_SET(Npp8u, 8u)
+NPP_EMU_SET(Npp16u, 16u)
+NPP_EMU_SET(Npp16s, 16s)
+NPP_EMU_SET(Npp32s, 32s)
+NPP_EMU_SET(Npp32f, 32f)
+
+#undef NPP_EMU_SET
+
+inline void nppiFree(void *pData)
+{
+    cudaFree(pData);
+}
+
+inline const NppLibraryVersion *nppGetLibVersion()
+{
+    // the NPP release whose interface is emulated
+    static const NppLibraryVersion oVersion = {12, 2, 5};
+    return &oVersion;
+}
+
+// Bounding box [[min x, min y], [max x, max y]] of the pixel centres of
+// oSrcROI after the rotation of nppiRotate_8u_C1R.
+inline NppStatus nppiGetRotateBound(NppiRect oSrcROI, double aBoundingBox[2][2],
+                                    double nAngle, double nShiftX, double nShiftY)
+{
+    if (aBoundingBox == 0)
+    {
+        return NPP_NULL_POINTER_ERROR;
+    }
+
+    if (oSrcROI.width <= 0 || oSrcROI.height <= 0)
+    {
+        return NPP_SIZE_ERROR;
+    }
+
+    pipeline::transformedBounds(
+        emu::detail::rotateTransform(nAngle, nShiftX, nShiftY), oSrcROI.x,
+        oSrcROI.y, oSrcROI.x + oSrcROI.width - 1.0,
+        oSrcROI.y + oSrcROI.height - 1.0, aBoundingBox[0][0], aBoundingBox[0][1],
+        aBoundingBox[1][0], aBoundingBox[1][1]);
+    return NPP_SUCCESS;
+}
+
+// Rotates the oSrcROI part of the source by nAngle degrees about the origin,
+// shifts it by (nShiftX, nShiftY) and writes the oDstROI part of the result.
+inline NppStatus nppiRotate_8u_C1R(const Npp8u *pSrc, NppiSize oSrcSize,
+                                   int nSrcStep, NppiRect oSrcROI, Npp8u *pDst,
+                                   int nDstStep, NppiRect oDstROI, double nAngle,
+                                   double nShiftX, double nShiftY,
+                                   int eInterpolation)
+{
+    if (pSrc == 0 || pDst == 0)
+    {
+        return NPP_NULL_POINTER_ERROR;
+    }
+
+    // a kernel cannot dereference host memory
+    if (emu::Devices::instance().deviceOf(pSrc, 1) < 0 ||
+        emu::Devices::instance().deviceOf(pDst, 1) < 0)
+    {
+        return NPP_CUDA_KERNEL_EXECUTION_ERROR;
+    }
+
+    if (oSrcSize.width <= 0 || oSrcSize.height <= 0 || oDstROI.width <= 0 ||
+        oDstROI.height <= 0 || oDstROI.x < 0 || oDstROI.y < 0)
+    {
+        return NPP_SIZE_ERROR;
+    }
+
+    if (nSrcStep < oSrcSize.width || nDstStep < oDstROI.x + oDstROI.width)
+    {
+        return NPP_STEP_ERROR;
+    }
+
+    pipeline::RotateOptions oOptions;
+
+    switch (eInterpolation)
+    {
+    case NPPI_INTER_NN:
+        oOptions.eInterpolation = pipeline::INTER_NN;
+        break;
+    case NPPI_INTER_LINEAR:
+        oOptions.eInterpolation = pipeline::INTER_LINEAR;
+        break;
+    default:
+        return NPP_INTERPOLATION_ERROR;
+    }
+
+    // only the part of the source ROI inside the image is read
+    int nX0 = std::max(0, oSrcROI.x);
+    int nY0 = std::max(0, oSrcROI.y);
+    int nX1 = std::min(oSrcSize.width, oSrcROI.x + oSrcROI.width);
+    int nY1 = std::min(oSrcSize.height, oSrcROI.y + oSrcROI.height);
+
+    if (nX1 <= nX0 || nY1 <= nY0)
+    {
+        return NPP_SUCCESS;
+    }
+
+    pipeline::ImageConstView_8u_C1 oSrc =
+        pipeline::ImageConstView_8u_C1(pSrc, oSrcSize.width, oSrcSize.height,
+                                       nSrcStep)
+            .crop(nX0, nY0, nX1 - nX0, nY1 - nY0);
+    pipeline::ImageView_8u_C1 oDst(pDst + (std::ptrdiff_t)oDstROI.y * nDstStep +
+                                       oDstROI.x,
+                                   oDstROI.width, oDstROI.height, nDstStep);
+
+    // NPP centres pixels on integers, the host warp on half integers; map the
+    // ROI-relative destination back into ROI-relative source coordinates
+    using pipeline::AffineTransform;
+    AffineTransform oDstToSrc =
+        AffineTransform::translation(0.5 - nX0, 0.5 - nY0) *
+        emu::detail::rotateTransform(nAngle, nShiftX, nShiftY).inverse() *
+        AffineTransform::translation(oDstROI.x - 0.5, oDstROI.y - 0.5);
+
+    unsigned int nCores = std::thread::hardware_concurrency();
+    oOptions.nThreads = std::max(1u, (nCores > 0 ? nCores : 1) /
+                                         (unsigned int)emu::deviceCount());
+
+    // the host warp fills the pixels outside the source with the background;
+    // run it with two backgrounds and keep only the pixels both agree on
+    pipeline::ImageBuffer_8u_C1 oLow(oDst.width(), oDst.height());
+    pipeline::ImageBuffer_8u_C1 oHigh(oDst.width(), oDst.height());
+    oOptions.nBackground = 0;
+    pipeline::warpAffine(oSrc, oLow.view(), oDstToSrc, oOptions);
+    oOptions.nBackground = 255;
+    pipeline::warpAffine(oSrc, oHigh.view(), oDstToSrc, oOptions);
+
+    for (unsigned int y = 0; y < oDst.height(); ++y)
+    {
+        const Npp8u *pLow = oLow.view().row(y);
+        const Npp8u *pHigh = oHigh.view().row(y);
+        Npp8u *pOut = oDst.row(y);
+
+        for (unsigned int x = 0; x < oDst.width(); ++x)
+        {
+            if (pLow[x] == pHigh[x])
+            {
+                pOut[x] = pLow[x];
+            }
+        }
+    }
+
+    return NPP_SUCCESS;
+}
+
+#endif // NPP_EMU_NPP_H
@@ -0,0 +1,355 @@
+/* Binarization stage: global threshold, Otsu and Sauvola.
+ *
+ * The stage works on destination tiles and never needs the whole 8-bit image.
+ * Each tile, grown by the Sauvola window radius, is produced row by row into
+ * a per-worker scratch buffer by a row source -- the rotation kernel when the
+ * stage is fused with rotation, or a plain copy from an existing image.  The
+ * tile is then thresholded and packed straight into the 1bpp output.
+ *
+ * Sauvola's local mean and deviation come from an integral image of the
+ * scratch tile, so every pixel costs O(1) regardless of the window size.
+ * Otsu needs the global histogram before any pixel can be decided, so a fused
+ * Otsu run walks the tiles twice: once for the histogram, once to threshold.
+ */
+
+#ifndef PIPELINE_BINARIZE_H
+#define PIPELINE_BINARIZE_H
+
+#include <Exceptions.h>
+
+#include "BitImage.h"
+#include "ImageStats.h"
+#include "ImageView.h"
+#include "Parallel.h"
+#include "RotateCPU.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace pipeline
+{
+
+enum BinarizeMethod
+{
+    BINARIZE_GLOBAL,
+    BINARIZE_OTSU,
+    BINARIZE_SAUVOLA
+};
+
+struct BinarizeOptions
+{
+    BinarizeMethod eMethod;
+    // global: pixels <= nThreshold become black
+    int nThreshold;
+    // Sauvola: odd window size, sensitivity k and dynamic range R
+    unsigned int nWindow;
+    double nK;
+    double nR;
+    // tile edge in pixels, rounded up to a multiple of 8
+    unsigned int nTileSize;
+    unsigned int nThreads;
+
+    BinarizeOptions()
+        : eMethod(BINARIZE_GLOBAL), nThreshold(127), nWindow(25), nK(0.2),
+          nR(128.0), nTileSize(128), nThreads(0)
+    {
+    }
+};
+
+// Rows of an existing 8-bit image.
+struct ImageRowSource
+{
+    ImageConstView_8u_C1 oImage;
+
+    unsigned int width() const
+    {
+        return oImage.width();
+    }
+
+    unsigned int height() const
+    {
+        return oImage.height();
+    }
+
+    void operator()(unsigned int nX, unsigned int nY, unsigned int nCount,
+                    unsigned char *pDst) const
+    {
+        memcpy(pDst, oImage.row(nY) + nX, nCount);
+    }
+};
+
+// Rows of oSrc warped by the CPU rotation kernel, produced on demand.
+struct WarpRowSource
+{
+    ImageConstView_8u_C1 oSrc;
+    AffineTransform oDstToSrc;
+    RotateOptions oOptions;
+    unsigned int nWidth, nHeight;
+
+    unsigned int width() const
+    {
+        return nWidth;
+    }
+
+    unsigned int height() const
+    {
+        return nHeight;
+    }
+
+    void operator()(unsigned int nX, unsigned int nY, unsigned int nCount,
+                    unsigned char *pDst) const
+    {
+        warpRow(oSrc, oDstToSrc, oOptions, nX, nY, nCount, pDst);
+    }
+};
+
+// Threshold maximising the between-class variance; pixels <= the returned
+// value form the dark class.
+inline int otsuThreshold(const ImageStats &rStats)
+{
+    double nTotal = (double)rStats.count();
+    double nSumAll = 0.0;
+
+    for (int i = 0; i < 256; ++i)
+    {
+        nSumAll += (double)i * rStats.aHistogram[i];
+    }
+
+    double nWeight0 = 0.0, nSum0 = 0.0, nBest = -1.0;
+    int nThreshold = 0;
+
+    for (int t = 0; t < 255; ++t)
+    {
+        nWeight0 += (double)rStats.aHistogram[t];
+        nSum0 += (double)t * rStats.aHistogram[t];
+        double nWeight1 = nTotal - nWeight0;
+
+        if (nWeight0 == 0.0 || nWeight1 == 0.0)
+        {
+            continue;
+        }
+
+        double nMean0 = nSum0 / nWeight0;
+        double nMean1 = (nSumAll - nSum0) / nWeight1;
+        double nBetween = nWeight0 * nWeight1 * (nMean0 - nMean1) * (nMean0 - nMean1);
+
+        if (nBetween > nBest)
+        {
+            nBest = nBetween;
+            nThreshold = t;
+        }
+    }
+
+    return nThreshold;
+}
+
+namespace detail
+{
+
+// One destination tile and the scratch copy of its halo-grown region.
+struct BinarizeTile
+{
+    unsigned int nX, nY, nWidth, nHeight;
+    unsigned int nRegionX, nRegionY, nRegionWidth, nRegionHeight;
+    const unsigned char *pRegion;
+
+    const unsigned char *row(unsigned int nY) const
+    {
+        return pRegion + (size_t)(nY - nRegionY) * nRegionWidth +
+               (nX - nRegionX);
+    }
+};
+
+// Produces every tile of rSource (grown by nHalo pixels) into per-worker
+// scratch and hands it to rBody(nWorker, tile).
+template <class RowSource, class TileBody>
+void forEachTile(const RowSource &rSource, unsigned int nTileSize,
+                 unsigned int nHalo, unsigned int nThreads,
+                 std::vector<std::vector<unsigned char> > &rScratch,
+                 const TileBody &rBody)
+{
+    const unsigned int nWidth = rSource.width();
+    const unsigned int nHeight = rSource.height();
+    const unsigned int nTilesX = (nWidth + nTileSize - 1) / nTileSize;
+    const unsigned int nTilesY = (nHeight + nTileSize - 1) / nTileSize;
+    const size_t nTiles = (size_t)nTilesX * nTilesY;
+
+    rScratch.resize(workerCount(nTiles, nThreads));
+
+    parallelForWorkers(nTiles, [&](size_t iTile, unsigned int nWorker)
+    {
+        BinarizeTile oTile;
+        oTile.nX = (unsigned int)(iTile % nTilesX) * nTileSize;
+        oTile.nY = (unsigned int)(iTile / nTilesX) * nTileSize;
+        oTile.nWidth = std::min(nTileSize, nWidth - oTile.nX);
+        oTile.nHeight = std::min(nTileSize, nHeight - oTile.nY);
+        oTile.nRegionX = oTile.nX > nHalo ? oTile.nX - nHalo : 0;
+        oTile.nRegionY = oTile.nY > nHalo ? oTile.nY - nHalo : 0;
+        oTile.nRegionWidth = std::min(nWidth, oTile.nX + oTile.nWidth + nHalo) -
+                             oTile.nRegionX;
+        oTile.nRegionHeight = std::min(nHeight, oTile.nY + oTile.nHeight + nHalo) -
+                              oTile.nRegionY;
+
+        std::vector<unsigned char> &rRegion = rScratch[nWorker];
+        rRegion.resize((size_t)oTile.nRegionWidth * oTile.nRegionHeight);
+
+        for (unsigned int y = 0; y < oTile.nRegionHeight; ++y)
+        {
+            rSource(oTile.nRegionX, oTile.nRegionY + y, oTile.nRegionWidth,
+                    &rRegion[(size_t)y * oTile.nRegionWidth]);
+        }
+
+        oTile.pRegion = rRegion.data();
+        rBody(nWorker, oTile);
+    }, nThreads);
+}
+
+} // namespace detail
+
+// Binarizes the image produced by rSource into a new 1bpp image.
+template <class RowSource>
+BitImageBuffer binarizeSource(const RowSource &rSource,
+                              const BinarizeOptions &rOptions)
+{
+    const unsigned int nTileSize = std::max(8u, (rOptions.nTileSize + 7) / 8 * 8);
+    BitImageBuffer oResult(rSource.width(), rSource.height());
+    BitImageView_1u oOut = oResult.view();
+    std::vector<std::vector<unsigned char> > aScratch;
+
+    if (rOptions.eMethod == BINARIZE_SAUVOLA)
+    {
+        // the 32-bit tile integrals hold windows up to 2047 pixels
+        if (rOptions.nWindow % 2 == 0 || rOptions.nWindow > 2047)
+        {
+            throw npp::Exception("Sauvola window size must be odd and below 2048");
+        }
+
+        const unsigned int nRadius = rOptions.nWindow / 2;
+        std::vector<std::vector<uint32_t> > aSums;
+        std::vector<std::vector<uint64_t> > aSquares;
+        aSums.resize(workerCount((size_t)-1, rOptions.nThreads));
+        aSquares.resize(aSums.size());
+
+        detail::forEachTile(rSource, nTileSize, nRadius, rOptions.nThreads, aScratch,
+                            [&](unsigned int nWorker, const detail::BinarizeTile &rTile)
+        {
+            // integral images of the region, one extra leading row/column
+            const unsigned int nStride = rTile.nRegionWidth + 1;
+            std::vector<uint32_t> &rSum = aSums[nWorker];
+            std::vector<uint64_t> &rSquare = aSquares[nWorker];
+            rSum.assign((size_t)nStride * (rTile.nRegionHeight + 1), 0);
+            rSquare.assign(rSum.size(), 0);
+
+            for (unsigned int y = 0; y < rTile.nRegionHeight; ++y)
+            {
+                const unsigned char *pRow = rTile.pRegion + (size_t)y * rTile.nRegionWidth;
+                uint32_t nRowSum = 0;
+                uint64_t nRowSquare = 0;
+                size_t nAbove = (size_t)y * nStride;
+                size_t nHere = nAbove + nStride;
+
+                for (unsigned int x = 0; x < rTile.nRegionWidth; ++x)
+                {
+                    nRowSum += pRow[x];
+                    nRowSquare += (uint32_t)pRow[x] * pRow[x];
+                    rSum[nHere + x + 1] = rSum[nAbove + x + 1] + nRowSum;
+                    rSquare[nHere + x + 1] = rSquare[nAbove + x + 1] + nRowSquare;
+                }
+            }
+
+            for (unsigned int y = rTile.nY; y < rTile.nY + rTile.nHeight; ++y)
+            {
+                // window rows, clipped to the region (and so to the image)
+                unsigned int nLocalY = y - rTile.nRegionY;
+                unsigned int nTop = nLocalY > nRadius ? nLocalY - nRadius : 0;
+                unsigned int nBottom = std::min(rTile.nRegionHeight, nLocalY + nRadius + 1);
+                const uint32_t *pSumTop = &rSum[(size_t)nTop * nStride];
+                const uint32_t *pSumBottom = &rSum[(size_t)nBottom * nStride];
+                const uint64_t *pSqTop = &rSquare[(size_t)nTop * nStride];
+                const uint64_t *pSqBottom = &rSquare[(size_t)nBottom * nStride];
+                unsigned int nOffsetX = rTile.nX - rTile.nRegionX;
+
+                packBits(rTile.row(y), rTile.nWidth, oOut.row(y) + rTile.nX / 8,
+                         [&](unsigned char nValue, unsigned int i)
+                {
+                    unsigned int nLocalX = nOffsetX + i;
+                    unsigned int nLeft = nLocalX > nRadius ? nLocalX - nRadius : 0;
+                    unsigned int nRight = std::min(rTile.nRegionWidth, nLocalX + nRadius + 1);
+                    double nCount = (double)(nRight - nLeft) * (nBottom - nTop);
+                    double nSum = (double)(pSumBottom[nRight] - pSumBottom[nLeft] -
+                                           pSumTop[nRight] + pSumTop[nLeft]);
+                    double nSquare = (double)(pSqBottom[nRight] - pSqBottom[nLeft] -
+                                              pSqTop[nRight] + pSqTop[nLeft]);
+                    double nMean = nSum / nCount;
+                    double nDeviation = std::sqrt(std::max(0.0, nSquare / nCount - nMean * nMean));
+                    double nThreshold = nMean * (1.0 + rOptions.nK * (nDeviation / rOptions.nR - 1.0));
+                    return nValue <= nThreshold;
+                });
+            }
+        });
+
+        return oResult;
+    }
+
+    int nThreshold = rOptions.nThreshold;
+
+    if (rOptions.eMethod == BINARIZE_OTSU)
+    {
+        StatsEpilogue oStats;
+        oStats.prepare(workerCount((size_t)-1, rOptions.nThreads));
+
+        detail::forEachTile(rSource, nTileSize, 0, rOptions.nThreads, aScratch,
+                            [&](unsigned int nWorker, const detail::BinarizeTile &rTile)
+        {
+            for (unsigned int y = rTile.nY; y < rTile.nY + rTile.nHeight; ++y)
+            {
+                oStats.row(nWorker, rTile.nX, y, const_cast<unsigned char *>(rTile.row(y)),
+                           rTile.nWidth);
+            }
+        });
+
+        nThreshold = otsuThreshold(oStats.result());
+    }
+
+    detail::forEachTile(rSource, nTileSize, 0, rOptions.nThreads, aScratch,
+                        [&](unsigned int, const detail::BinarizeTile &rTile)
+    {
+        for (unsigned int y = rTile.nY; y < rTile.nY + rTile.nHeight; ++y)
+        {
+            packBits(rTile.row(y), rTile.nWidth, oOut.row(y) + rTile.nX / 8,
+                     [&](unsigned char nValue, unsigned int)
+            {
+                return (int)nValue <= nThreshold;
+            });
+        }
+    });
+
+    return oResult;
+}
+
+// Binarizes an existing 8-bit image.
+inline BitImageBuffer binarize(ImageConstView_8u_C1 oImage,
+                               const BinarizeOptions &rOptions)
+{
+    ImageRowSource oSource = {oImage};
+    return binarizeSource(oSource, rOptions);
+}
+
+// Rotates and binarizes in one tiled pass; the 8-bit rotated image only ever
+// exists one tile at a time.
+inline BitImageBuffer rotateBinarize(ImageConstView_8u_C1 oSrc,
+                                     const RotateGeometry &rGeometry,
+                                     const RotateOptions &rRotateOptions,
+                                     const BinarizeOptions &rOptions)
+{
+    WarpRowSource oSource = {oSrc, rGeometry.oInverse, rRotateOptions,
+                             rGeometry.nDstWidth, rGeometry.nDstHeight};
+    return binarizeSource(oSource, rOptions);
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_BINARIZE_H
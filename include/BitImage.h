@@ -0,0 +1,182 @@
+/* Packed 1 bit per pixel images.
+ *
+ * Pixels are stored as in PBM (P4): eight pixels per byte, most significant
+ * bit first, 1 meaning black.  Rows are padded to whole bytes; a
+ * BitImageBuffer pads them further to its cache line aligned pitch, so whole
+ * 64-bit words of a row can always be loaded and stored.  Padding bits past
+ * width() are kept at zero by the pipeline stages.
+ */
+
+#ifndef PIPELINE_BIT_IMAGE_H
+#define PIPELINE_BIT_IMAGE_H
+
+#include "ImageView.h"
+
+#include <cstddef>
+#include <cstring>
+
+namespace pipeline
+{
+
+template <typename D>
+class BitImageView
+{
+public:
+    BitImageView() : pData_(0), nWidth_(0), nHeight_(0), nPitch_(0)
+    {
+    }
+
+    BitImageView(D *pData, unsigned int nWidth, unsigned int nHeight,
+                 std::ptrdiff_t nPitch)
+        : pData_(pData), nWidth_(nWidth), nHeight_(nHeight), nPitch_(nPitch)
+    {
+    }
+
+    template <typename S>
+    BitImageView(const BitImageView<S> &rOther,
+                 typename std::enable_if<std::is_convertible<S *, D *>::value>::type * = 0)
+        : pData_(rOther.data()), nWidth_(rOther.width()),
+          nHeight_(rOther.height()), nPitch_(rOther.pitch())
+    {
+    }
+
+    D *data() const
+    {
+        return pData_;
+    }
+
+    // width in pixels
+    unsigned int width() const
+    {
+        return nWidth_;
+    }
+
+    unsigned int height() const
+    {
+        return nHeight_;
+    }
+
+    std::ptrdiff_t pitch() const
+    {
+        return nPitch_;
+    }
+
+    // bytes holding the pixels of one row
+    unsigned int rowBytes() const
+    {
+        return (nWidth_ + 7) / 8;
+    }
+
+    D *row(unsigned int nY) const
+    {
+        return pData_ + (std::ptrdiff_t)nY * nPitch_;
+    }
+
+    bool get(unsigned int nX, unsigned int nY) const
+    {
+        return (row(nY)[nX >> 3] >> (7 - (nX & 7))) & 1;
+    }
+
+    void set(unsigned int nX, unsigned int nY, bool bBlack) const
+    {
+        D *pByte = row(nY) + (nX >> 3);
+        unsigned char nMask = (unsigned char)(0x80 >> (nX & 7));
+        *pByte = bBlack ? (*pByte | nMask) : (*pByte & ~nMask);
+    }
+
+private:
+    D *pData_;
+    unsigned int nWidth_;
+    unsigned int nHeight_;
+    std::ptrdiff_t nPitch_;
+};
+
+typedef BitImageView<unsigned char> BitImageView_1u;
+typedef BitImageView<const unsigned char> BitImageConstView_1u;
+
+class BitImageBuffer
+{
+public:
+    BitImageBuffer() : nWidth_(0)
+    {
+    }
+
+    // All pixels start out white.
+    BitImageBuffer(unsigned int nWidth, unsigned int nHeight)
+        : oBytes_((nWidth + 7) / 8, nHeight), nWidth_(nWidth)
+    {
+        if (oBytes_.data() != 0)
+        {
+            memset(oBytes_.data(), 0, oBytes_.pitch() * nHeight);
+        }
+    }
+
+    unsigned int width() const
+    {
+        return nWidth_;
+    }
+
+    unsigned int height() const
+    {
+        return oBytes_.height();
+    }
+
+    size_t pitch() const
+    {
+        return oBytes_.pitch();
+    }
+
+    BitImageView_1u view()
+    {
+        return BitImageView_1u(oBytes_.data(), nWidth_, oBytes_.height(),
+                               (std::ptrdiff_t)oBytes_.pitch());
+    }
+
+    BitImageConstView_1u view() const
+    {
+        return BitImageConstView_1u(oBytes_.data(), nWidth_, oBytes_.height(),
+                                    (std::ptrdiff_t)oBytes_.pitch());
+    }
+
+private:
+    ImageBuffer_8u_C1 oBytes_;
+    unsigned int nWidth_;
+};
+
+// Packs nCount pixels starting at a multiple of 8 into pBits; pixels for
+// which bBlack(value, i) holds become 1.
+template <class Predicate>
+void packBits(const unsigned char *pPixels, unsigned int nCount,
+              unsigned char *pBits, const Predicate &bBlack)
+{
+    unsigned int i = 0;
+
+    for (; i + 8 <= nCount; i += 8)
+    {
+        unsigned int nByte = 0;
+
+        for (unsigned int b = 0; b < 8; ++b)
+        {
+            nByte = (nByte << 1) | (bBlack(pPixels[i + b], i + b) ? 1u : 0u);
+        }
+
+        pBits[i >> 3] = (unsigned char)nByte;
+    }
+
+    if (i < nCount)
+    {
+        unsigned int nByte = 0;
+
+        for (unsigned int b = 0; b < 8; ++b)
+        {
+            bool bSet = i + b < nCount && bBlack(pPixels[i + b], i + b);
+            nByte = (nByte << 1) | (bSet ? 1u : 0u);
+        }
+
+        pBits[i >> 3] = (unsigned char)nByte;
+    }
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_BIT_IMAGE_H
@@ -0,0 +1,58 @@
+/* Data cache sizes of the host, for benchmarks and size dependent kernel
+ * choices.  Queried once from the C library; the fallbacks are typical
+ * desktop values for systems that do not report them.
+ */
+
+#ifndef PIPELINE_CACHE_INFO_H
+#define PIPELINE_CACHE_INFO_H
+
+#include <cstddef>
+
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+namespace pipeline
+{
+
+namespace detail
+{
+
+inline size_t queryCache(int nName, size_t nFallback)
+{
+    long nBytes = -1;
+#if defined(__linux__)
+    nBytes = sysconf(nName);
+#else
+    (void)nName;
+#endif
+    return nBytes > 0 ? (size_t)nBytes : nFallback;
+}
+
+} // namespace detail
+
+inline size_t l2CacheBytes()
+{
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+    static const size_t nBytes = detail::queryCache(_SC_LEVEL2_CACHE_SIZE, 1 << 20);
+#else
+    static const size_t nBytes = 1 << 20;
+#endif
+    return nBytes;
+}
+
+// The last level cache: L3 where there is one, else L2.
+inline size_t llcBytes()
+{
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+    static const size_t nBytes =
+        detail::queryCache(_SC_LEVEL3_CACHE_SIZE, l2CacheBytes());
+#else
+    static const size_t nBytes = l2CacheBytes();
+#endif
+    return nBytes;
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_CACHE_INFO_H
@@ -0,0 +1,225 @@
+/* Partitioning of a rotation across several devices.
+ *
+ * The destination is cut into a grid of rectangles, one per device, along
+ * the 64 pixel tile boundaries of the host kernels.  A device allocates the
+ * bounding box of the source its rectangle reads but receives only the
+ * pixels in it that are read, as row bands narrowed to their columns
+ * (sourceBandBounds() in RotateGeometry.h, with a pixel of guard for the
+ * device's floating point sampling), so the upload stays close to the
+ * device's share of the source whatever the angle.  The rest of the box is
+ * set to the background rather than left uninitialised.  Among the
+ * factorizations of the device count the grid that uploads the fewest
+ * source pixels is chosen.
+ */
+
+#ifndef PIPELINE_DEVICE_SHARDS_H
+#define PIPELINE_DEVICE_SHARDS_H
+
+#include "RotateCPU.h"
+#include "RotateGeometry.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace pipeline
+{
+
+struct DeviceShard
+{
+    unsigned int nDevice;
+    PixelRect oDst; // destination pixels the device produces
+    PixelRect oSrc; // bounding box of the source pixels it reads, or empty
+    std::vector<PixelRect> aSrcBands; // the parts of oSrc it uploads
+};
+
+// Source taps read per destination pixel by the host warp and nppiRotate.
+inline unsigned int interpolationTaps(Interpolation eInterpolation)
+{
+    return eInterpolation == INTER_LINEAR ? 2 : 1;
+}
+
+namespace detail
+{
+
+// rRect grown by nGuard pixels on every side, within a nWidth x nHeight image.
+inline PixelRect guarded(const PixelRect &rRect, int nGuard, unsigned int nWidth,
+                         unsigned int nHeight)
+{
+    PixelRect oRect = rRect;
+
+    if (!oRect.empty())
+    {
+        int nX1 = std::min((int)nWidth, oRect.x + oRect.width + nGuard);
+        int nY1 = std::min((int)nHeight, oRect.y + oRect.height + nGuard);
+        oRect.x = std::max(0, oRect.x - nGuard);
+        oRect.y = std::max(0, oRect.y - nGuard);
+        oRect.width = nX1 - oRect.x;
+        oRect.height = nY1 - oRect.y;
+    }
+
+    return oRect;
+}
+
+// The source a device reads for rDst.  sourceBands() is exact for the host
+// kernels' fixed point walk; nppiRotate samples in floating point with its
+// own bounds test and may read a pixel next to those.  So the box gets a
+// pixel of guard all round, and each band of nBandRows rows takes the
+// columns of the samples reaching the rows on either side of it, plus a
+// column of guard.
+inline void deviceSource(const RotateGeometry &rGeometry, const PixelRect &rDst,
+                         unsigned int nTaps, unsigned int nBandRows,
+                         PixelRect &rBox, std::vector<PixelRect> &rBands)
+{
+    const unsigned int nWidth = rGeometry.nSrcWidth;
+    const unsigned int nHeight = rGeometry.nSrcHeight;
+    rBox = guarded(sourceBounds(rGeometry, rDst, nTaps), 1, nWidth, nHeight);
+    rBands.clear();
+    nBandRows = std::max(1u, nBandRows);
+
+    for (int y = rBox.y; y < rBox.y + rBox.height; y += nBandRows)
+    {
+        int nEnd = std::min<int>(y + nBandRows, rBox.y + rBox.height);
+        PixelRect oBand = guarded(
+            sourceBandBounds(rGeometry, rDst, nTaps, y > 0 ? y - 1 : 0,
+                             std::min<unsigned int>(nEnd + 1, nHeight)),
+            1, nWidth, nHeight);
+
+        if (!oBand.empty())
+        {
+            // keep the columns, but only this band's rows
+            int nY1 = std::min(nEnd, oBand.y + oBand.height);
+            oBand.y = std::max(y, oBand.y);
+            oBand.height = nY1 - oBand.y;
+
+            if (oBand.height > 0)
+            {
+                rBands.push_back(oBand);
+            }
+        }
+    }
+}
+
+// nParts + 1 cut positions over [0, nSize], on multiples of nAlign when every
+// part can still get at least one multiple.
+inline std::vector<unsigned int> splitRange(unsigned int nSize, unsigned int nParts,
+                                            unsigned int nAlign)
+{
+    if ((size_t)nAlign * nParts > nSize)
+    {
+        nAlign = 1;
+    }
+
+    std::vector<unsigned int> aCuts(nParts + 1, nSize);
+    aCuts[0] = 0;
+
+    for (unsigned int i = 1; i < nParts; ++i)
+    {
+        double nCut = (double)nSize * i / nParts / nAlign;
+        unsigned int nAligned = (unsigned int)std::floor(nCut + 0.5) * nAlign;
+        aCuts[i] = std::max(aCuts[i - 1], std::min(nAligned, nSize));
+    }
+
+    return aCuts;
+}
+
+inline std::vector<DeviceShard> gridShards(const RotateGeometry &rGeometry,
+                                           unsigned int nColumns,
+                                           unsigned int nRows,
+                                           Interpolation eInterpolation,
+                                           unsigned int nAlign,
+                                           unsigned int nBandRows)
+{
+    std::vector<unsigned int> aX = splitRange(rGeometry.nDstWidth, nColumns, nAlign);
+    std::vector<unsigned int> aY = splitRange(rGeometry.nDstHeight, nRows, nAlign);
+    std::vector<DeviceShard> aShards;
+
+    for (unsigned int j = 0; j < nRows; ++j)
+    {
+        for (unsigned int i = 0; i < nColumns; ++i)
+        {
+            DeviceShard oShard;
+            oShard.nDevice = (unsigned int)aShards.size();
+            oShard.oDst.x = aX[i];
+            oShard.oDst.y = aY[j];
+            oShard.oDst.width = aX[i + 1] - aX[i];
+            oShard.oDst.height = aY[j + 1] - aY[j];
+
+            if (!oShard.oDst.empty())
+            {
+                deviceSource(rGeometry, oShard.oDst, interpolationTaps(eInterpolation),
+                             nBandRows, oShard.oSrc, oShard.aSrcBands);
+                aShards.push_back(oShard);
+            }
+        }
+    }
+
+    return aShards;
+}
+
+} // namespace detail
+
+// Source pixels a shard uploads.
+inline size_t sourcePixels(const DeviceShard &rShard)
+{
+    size_t nPixels = 0;
+
+    for (size_t i = 0; i < rShard.aSrcBands.size(); ++i)
+    {
+        nPixels += (size_t)rShard.aSrcBands[i].width * rShard.aSrcBands[i].height;
+    }
+
+    return nPixels;
+}
+
+inline size_t sourcePixels(const std::vector<DeviceShard> &rShards)
+{
+    size_t nPixels = 0;
+
+    for (size_t i = 0; i < rShards.size(); ++i)
+    {
+        nPixels += sourcePixels(rShards[i]);
+    }
+
+    return nPixels;
+}
+
+// Splits the rotation described by rGeometry over nDevices devices, with
+// source uploads in bands of nBandRows rows.  Shards are numbered 0, 1, ...;
+// there are fewer than nDevices when the destination is too small to give
+// every device a pixel.
+inline std::vector<DeviceShard> planDeviceShards(const RotateGeometry &rGeometry,
+                                                 unsigned int nDevices,
+                                                 Interpolation eInterpolation,
+                                                 unsigned int nAlign = 64,
+                                                 unsigned int nBandRows = 16)
+{
+    nDevices = std::max(1u, nDevices);
+    std::vector<DeviceShard> aBest;
+    size_t nBestPixels = 0;
+
+    for (unsigned int nColumns = 1; nColumns <= nDevices; ++nColumns)
+    {
+        if (nDevices % nColumns != 0)
+        {
+            continue;
+        }
+
+        std::vector<DeviceShard> aShards = detail::gridShards(
+            rGeometry, nColumns, nDevices / nColumns, eInterpolation, nAlign,
+            nBandRows);
+        size_t nPixels = sourcePixels(aShards);
+
+        if (aBest.empty() || nPixels < nBestPixels)
+        {
+            aBest.swap(aShards);
+            nBestPixels = nPixels;
+        }
+    }
+
+    return aBest;
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_DEVICE_SHARDS_H
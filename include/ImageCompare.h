@@ -0,0 +1,338 @@
+/* Difference metrics between two 8-bit images of the same size.
+ *
+ * compareImages() produces, in one pass over both images, the maximum and
+ * mean absolute error, the number of differing pixels, the mean squared error
+ * and PSNR, and optionally the absolute difference image.  SSIM follows the
+ * x264 formulation: sums over 4x4 blocks (sum of a, of b, of a^2 + b^2 and of
+ * a b) are combined into 8x8 windows placed every 4 pixels, and the SSIM of
+ * all windows is averaged.
+ *
+ * The per-pixel loops use SSE2 when the compiler targets it (always on
+ * x86-64) and plain C++ otherwise; rows are spread over the worker threads.
+ */
+
+#ifndef PIPELINE_IMAGE_COMPARE_H
+#define PIPELINE_IMAGE_COMPARE_H
+
+#include <Exceptions.h>
+
+#include "ImageView.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PIPELINE_COMPARE_SSE2 1
+#endif
+
+namespace pipeline
+{
+
+struct CompareResult
+{
+    int nMaxError;
+    double nMeanAbsError;
+    double nMse;
+    double nPsnr;   // HUGE_VAL for identical images
+    double nSsim;   // 1 for identical images
+    uint64_t nDiffPixels;
+    uint64_t nPixels;
+};
+
+namespace detail
+{
+
+// Sums of one row segment; the counters of one worker.
+struct DiffSums
+{
+    uint64_t nAbs;
+    uint64_t nSquared;
+    uint64_t nDiffPixels;
+    int nMax;
+    char aPad[40];
+
+    DiffSums() : nAbs(0), nSquared(0), nDiffPixels(0), nMax(0)
+    {
+    }
+};
+
+inline void diffRow(const unsigned char *pA, const unsigned char *pB,
+                    unsigned char *pDiff, unsigned int nCount, DiffSums &rSums)
+{
+    unsigned int i = 0;
+
+#ifdef PIPELINE_COMPARE_SSE2
+    const __m128i vZero = _mm_setzero_si128();
+    __m128i vMax = vZero;
+    __m128i vAbs = vZero;       // two 64-bit SAD lanes
+    __m128i vDiffCount = vZero; // two 64-bit lanes
+
+    while (i + 16 <= nCount)
+    {
+        // at most 4096 pixels per block keep the 32-bit square sums exact
+        unsigned int nBlockEnd = std::min(nCount & ~15u, i + 4096);
+        __m128i vBlockSquared = vZero;
+
+        for (; i < nBlockEnd; i += 16)
+        {
+            __m128i vA = _mm_loadu_si128((const __m128i *)(pA + i));
+            __m128i vB = _mm_loadu_si128((const __m128i *)(pB + i));
+            __m128i vD = _mm_or_si128(_mm_subs_epu8(vA, vB),
+                                      _mm_subs_epu8(vB, vA));
+
+            if (pDiff)
+            {
+                _mm_storeu_si128((__m128i *)(pDiff + i), vD);
+            }
+
+            vMax = _mm_max_epu8(vMax, vD);
+            vAbs = _mm_add_epi64(vAbs, _mm_sad_epu8(vD, vZero));
+
+            __m128i vLo = _mm_unpacklo_epi8(vD, vZero);
+            __m128i vHi = _mm_unpackhi_epi8(vD, vZero);
+            vBlockSquared = _mm_add_epi32(vBlockSquared, _mm_madd_epi16(vLo, vLo));
+            vBlockSquared = _mm_add_epi32(vBlockSquared, _mm_madd_epi16(vHi, vHi));
+
+            // 1 for differing pixels, so their SAD against zero counts them
+            __m128i vNonZero = _mm_andnot_si128(_mm_cmpeq_epi8(vD, vZero),
+                                                _mm_set1_epi8(1));
+            vDiffCount = _mm_add_epi64(vDiffCount, _mm_sad_epu8(vNonZero, vZero));
+        }
+
+        uint32_t aSquared[4];
+        _mm_storeu_si128((__m128i *)aSquared, vBlockSquared);
+        rSums.nSquared +=
+            (uint64_t)aSquared[0] + aSquared[1] + aSquared[2] + aSquared[3];
+    }
+
+    uint64_t aAbs[2], aCount[2];
+    unsigned char aMax[16];
+    _mm_storeu_si128((__m128i *)aAbs, vAbs);
+    _mm_storeu_si128((__m128i *)aCount, vDiffCount);
+    _mm_storeu_si128((__m128i *)aMax, vMax);
+    rSums.nAbs += aAbs[0] + aAbs[1];
+    rSums.nDiffPixels += aCount[0] + aCount[1];
+
+    for (int k = 0; k < 16; ++k)
+    {
+        rSums.nMax = std::max(rSums.nMax, (int)aMax[k]);
+    }
+#endif
+
+    for (; i < nCount; ++i)
+    {
+        int nD = std::abs((int)pA[i] - (int)pB[i]);
+
+        if (pDiff)
+        {
+            pDiff[i] = (unsigned char)nD;
+        }
+
+        rSums.nMax = std::max(rSums.nMax, nD);
+        rSums.nAbs += nD;
+        rSums.nSquared += (uint64_t)(nD * nD);
+        rSums.nDiffPixels += nD != 0;
+    }
+}
+
+// Sums over one 4x4 block.
+struct SsimBlock
+{
+    uint32_t nSumA, nSumB, nSumSquares, nSumProducts;
+};
+
+// Block sums of the nBlocks blocks whose top rows start at pA and pB.
+inline void ssimBlockRow(const unsigned char *pA, std::ptrdiff_t nPitchA,
+                         const unsigned char *pB, std::ptrdiff_t nPitchB,
+                         unsigned int nBlocks, SsimBlock *pOut)
+{
+    unsigned int b = 0;
+
+#ifdef PIPELINE_COMPARE_SSE2
+    // two blocks (8 pixels) at a time; madd sums adjacent pixel pairs, so
+    // lanes 0-1 belong to the first block and lanes 2-3 to the second
+    const __m128i vZero = _mm_setzero_si128();
+    const __m128i vOnes = _mm_set1_epi16(1);
+
+    for (; b + 2 <= nBlocks; b += 2)
+    {
+        __m128i vSumA = vZero, vSumB = vZero, vSquares = vZero, vProducts = vZero;
+
+        for (int y = 0; y < 4; ++y)
+        {
+            __m128i vA = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *)(pA + y * nPitchA + b * 4)), vZero);
+            __m128i vB = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *)(pB + y * nPitchB + b * 4)), vZero);
+            vSumA = _mm_add_epi32(vSumA, _mm_madd_epi16(vA, vOnes));
+            vSumB = _mm_add_epi32(vSumB, _mm_madd_epi16(vB, vOnes));
+            vSquares = _mm_add_epi32(vSquares, _mm_madd_epi16(vA, vA));
+            vSquares = _mm_add_epi32(vSquares, _mm_madd_epi16(vB, vB));
+            vProducts = _mm_add_epi32(vProducts, _mm_madd_epi16(vA, vB));
+        }
+
+        uint32_t aA[4], aB[4], aSquares[4], aProducts[4];
+        _mm_storeu_si128((__m128i *)aA, vSumA);
+        _mm_storeu_si128((__m128i *)aB, vSumB);
+        _mm_storeu_si128((__m128i *)aSquares, vSquares);
+        _mm_storeu_si128((__m128i *)aProducts, vProducts);
+
+        for (int k = 0; k < 2; ++k)
+        {
+            SsimBlock &rBlock = pOut[b + k];
+            rBlock.nSumA = aA[2 * k] + aA[2 * k + 1];
+            rBlock.nSumB = aB[2 * k] + aB[2 * k + 1];
+            rBlock.nSumSquares = aSquares[2 * k] + aSquares[2 * k + 1];
+            rBlock.nSumProducts = aProducts[2 * k] + aProducts[2 * k + 1];
+        }
+    }
+#endif
+
+    for (; b < nBlocks; ++b)
+    {
+        SsimBlock oBlock = {0, 0, 0, 0};
+
+        for (int y = 0; y < 4; ++y)
+        {
+            for (int x = 0; x < 4; ++x)
+            {
+                uint32_t nA = pA[y * nPitchA + b * 4 + x];
+                uint32_t nB = pB[y * nPitchB + b * 4 + x];
+                oBlock.nSumA += nA;
+                oBlock.nSumB += nB;
+                oBlock.nSumSquares += nA * nA + nB * nB;
+                oBlock.nSumProducts += nA * nB;
+            }
+        }
+
+        pOut[b] = oBlock;
+    }
+}
+
+// SSIM of the 8x8 window made of four blocks.
+inline double ssimWindow(const SsimBlock &r00, const SsimBlock &r01,
+                         const SsimBlock &r10, const SsimBlock &r11)
+{
+    const double kC1 = 0.01 * 0.01 * 255.0 * 255.0 * 64.0 * 64.0;
+    const double kC2 = 0.03 * 0.03 * 255.0 * 255.0 * 64.0 * 63.0;
+    double nA = (double)r00.nSumA + r01.nSumA + r10.nSumA + r11.nSumA;
+    double nB = (double)r00.nSumB + r01.nSumB + r10.nSumB + r11.nSumB;
+    double nSquares = (double)r00.nSumSquares + r01.nSumSquares +
+                      r10.nSumSquares + r11.nSumSquares;
+    double nProducts = (double)r00.nSumProducts + r01.nSumProducts +
+                       r10.nSumProducts + r11.nSumProducts;
+    double nVariances = nSquares * 64.0 - nA * nA - nB * nB;
+    double nCovariance = nProducts * 64.0 - nA * nB;
+
+    return (2.0 * nA * nB + kC1) * (2.0 * nCovariance + kC2) /
+           ((nA * nA + nB * nB + kC1) * (nVariances + kC2));
+}
+
+inline double ssim(ImageConstView_8u_C1 oA, ImageConstView_8u_C1 oB,
+                   unsigned int nThreads)
+{
+    const unsigned int nBlocksX = oA.width() / 4;
+    const unsigned int nBlocksY = oA.height() / 4;
+
+    if (nBlocksX < 2 || nBlocksY < 2)
+    {
+        return 1.0; // too small for one window; only the error metrics apply
+    }
+
+    std::vector<SsimBlock> aBlocks((size_t)nBlocksX * nBlocksY);
+
+    parallelFor(nBlocksY, [&](size_t y)
+    {
+        ssimBlockRow(oA.row((unsigned int)y * 4), oA.pitch(),
+                     oB.row((unsigned int)y * 4), oB.pitch(), nBlocksX,
+                     &aBlocks[y * nBlocksX]);
+    }, nThreads);
+
+    const unsigned int nRows = nBlocksY - 1;
+    std::vector<double> aRowSums(nRows);
+
+    parallelFor(nRows, [&](size_t y)
+    {
+        const SsimBlock *pTop = &aBlocks[y * nBlocksX];
+        const SsimBlock *pBottom = pTop + nBlocksX;
+        double nSum = 0.0;
+
+        for (unsigned int x = 0; x + 1 < nBlocksX; ++x)
+        {
+            nSum += ssimWindow(pTop[x], pTop[x + 1], pBottom[x], pBottom[x + 1]);
+        }
+
+        aRowSums[y] = nSum;
+    }, nThreads);
+
+    double nTotal = 0.0;
+
+    for (unsigned int y = 0; y < nRows; ++y)
+    {
+        nTotal += aRowSums[y];
+    }
+
+    return nTotal / ((double)nRows * (nBlocksX - 1));
+}
+
+} // namespace detail
+
+// Compares oA with oB, which must have the same size.  When pDiff is given
+// it receives |a - b| per pixel and must have the same size as well.
+inline CompareResult compareImages(ImageConstView_8u_C1 oA,
+                                   ImageConstView_8u_C1 oB,
+                                   const ImageView_8u_C1 *pDiff = 0,
+                                   unsigned int nThreads = 0)
+{
+    if (oA.width() != oB.width() || oA.height() != oB.height())
+    {
+        throw npp::Exception("compareImages: the images differ in size");
+    }
+
+    if (pDiff && (pDiff->width() != oA.width() || pDiff->height() != oA.height()))
+    {
+        throw npp::Exception("compareImages: difference image has the wrong size");
+    }
+
+    const unsigned int nHeight = oA.height();
+    std::vector<detail::DiffSums> aSums(workerCount(nHeight, nThreads));
+
+    parallelForWorkers(nHeight, [&](size_t y, unsigned int nWorker)
+    {
+        unsigned int nY = (unsigned int)y;
+        detail::diffRow(oA.row(nY), oB.row(nY), pDiff ? pDiff->row(nY) : 0,
+                        oA.width(), aSums[nWorker]);
+    }, nThreads);
+
+    detail::DiffSums oTotal;
+
+    for (size_t i = 0; i < aSums.size(); ++i)
+    {
+        oTotal.nAbs += aSums[i].nAbs;
+        oTotal.nSquared += aSums[i].nSquared;
+        oTotal.nDiffPixels += aSums[i].nDiffPixels;
+        oTotal.nMax = std::max(oTotal.nMax, aSums[i].nMax);
+    }
+
+    CompareResult oResult;
+    oResult.nPixels = (uint64_t)oA.width() * nHeight;
+    oResult.nMaxError = oTotal.nMax;
+    oResult.nDiffPixels = oTotal.nDiffPixels;
+    oResult.nMeanAbsError =
+        oResult.nPixels ? (double)oTotal.nAbs / oResult.nPixels : 0.0;
+    oResult.nMse = oResult.nPixels ? (double)oTotal.nSquared / oResult.nPixels : 0.0;
+    oResult.nPsnr = oResult.nMse > 0.0
+                        ? 10.0 * std::log10(255.0 * 255.0 / oResult.nMse)
+                        : HUGE_VAL;
+    oResult.nSsim = detail::ssim(oA, oB, nThreads);
+    return oResult;
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_IMAGE_COMPARE_H
@@ -0,0 +1,863 @@
+/* Image file readers and writers used by the rotation pipeline.
+ *
+ * PGM (P5) is the plain interchange format; PPM (P6) input is reduced to
+ * luma.  TIFF is handled natively by TiffFile.h, JPEG decoding and EXIF
+ * orientation by JpegFile.h.  L4R is an intermediate
+ * format for handing images between pipeline stages: the raster is cut into
+ * row bands, each band is an independent LZ4 block, so both encoding and
+ * decoding run on all cores and the result is lossless.
+ *
+ * L4R layout (all integers little endian uint32):
+ *   "L4R1" width height channels bandRows bandCount
+ *   bandCount band sizes (bit 31 set: band stored uncompressed)
+ *   band payloads
+ */
+
+#ifndef PIPELINE_IMAGE_FILE_H
+#define PIPELINE_IMAGE_FILE_H
+
+#include <Exceptions.h>
+
+#include "BitImage.h"
+#include "ImageView.h"
+#include "JpegFile.h"
+#include "LZ4Block.h"
+#include "Parallel.h"
+#include "TiffFile.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if !(defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace pipeline
+{
+
+// Returns the lower-case extension of fileName including the dot, or "".
+inline std::string fileExtension(const std::string &fileName)
+{
+    std::string::size_type dot = fileName.rfind('.');
+
+    if (dot == std::string::npos)
+    {
+        return std::string();
+    }
+
+    std::string sExtension = fileName.substr(dot);
+    std::transform(sExtension.begin(), sExtension.end(), sExtension.begin(),
+                   ::tolower);
+    return sExtension;
+}
+
+namespace pnm
+{
+
+// Below this payload size a single sequential read is faster than threads.
+static const size_t kParallelThreshold = 8 * 1024 * 1024;
+// Each reader thread fetches bands of about this many bytes per request.
+static const size_t kBandBytes = 4 * 1024 * 1024;
+
+// Reads the next header token, skipping whitespace and '#' comments.
+inline bool readToken(std::istream &rStream, std::string &rToken)
+{
+    rToken.clear();
+    int c = rStream.get();
+
+    for (;;)
+    {
+        if (c == '#')
+        {
+            while (c != EOF && c != '\n')
+            {
+                c = rStream.get();
+            }
+        }
+        else if (c != EOF && isspace(c))
+        {
+            c = rStream.get();
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    while (c != EOF && !isspace(c) && c != '#')
+    {
+        rToken += (char)c;
+        c = rStream.get();
+    }
+
+    // the single whitespace character after the max value ends the header
+    return !rToken.empty();
+}
+
+// Parses a header token as a decimal number up to INT_MAX; false for
+// anything else (signs, trailing characters, overflow).
+inline bool parseNumber(const std::string &sToken, int &rValue)
+{
+    if (sToken.empty() || !isdigit((unsigned char)sToken[0]))
+    {
+        return false;
+    }
+
+    char *pEnd = 0;
+    errno = 0;
+    unsigned long nValue = strtoul(sToken.c_str(), &pEnd, 10);
+
+    if (errno != 0 || *pEnd != 0 || nValue > (unsigned long)INT_MAX)
+    {
+        return false;
+    }
+
+    rValue = (int)nValue;
+    return true;
+}
+
+// Converts one interleaved RGB row to 8-bit luma (BT.601 weights).
+inline void rgbToGray(const uint8_t *pRgb, uint8_t *pGray, unsigned int nWidth)
+{
+    for (unsigned int x = 0; x < nWidth; ++x)
+    {
+        pGray[x] = (uint8_t)((77 * pRgb[3 * x] + 150 * pRgb[3 * x + 1] +
+                              29 * pRgb[3 * x + 2] + 128) >> 8);
+    }
+}
+
+#if !(defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64))
+// Reads nBytes at nOffset into pDst, retrying short reads.
+inline void preadFully(int fd, void *pDst, size_t nBytes, off_t nOffset)
+{
+    uint8_t *p = static_cast<uint8_t *>(pDst);
+
+    while (nBytes > 0)
+    {
+        ssize_t nRead = pread(fd, p, nBytes, nOffset);
+
+        if (nRead <= 0)
+        {
+            throw npp::Exception("PNM: pixel data is truncated");
+        }
+
+        p += nRead;
+        nBytes -= nRead;
+        nOffset += nRead;
+    }
+}
+
+// Reads nRows consecutive file rows of nRowBytes starting at nOffset into
+// the pitched rows of oDst with vectored reads, i.e. without staging.
+inline void preadRows(int fd, ImageView_8u_C1 oDst, size_t nRowBytes, off_t nOffset)
+{
+    const unsigned int kMaxVectors = 512;
+    struct iovec aVectors[kMaxVectors];
+    unsigned int nY = 0;
+
+    while (nY < oDst.height())
+    {
+        unsigned int nCount = std::min(kMaxVectors, oDst.height() - nY);
+
+        for (unsigned int i = 0; i < nCount; ++i)
+        {
+            aVectors[i].iov_base = oDst.row(nY + i);
+            aVectors[i].iov_len = nRowBytes;
+        }
+
+        ssize_t nRead = preadv(fd, aVectors, (int)nCount, nOffset);
+
+        if (nRead <= 0)
+        {
+            throw npp::Exception("PNM: pixel data is truncated");
+        }
+
+        // a short read ends mid-row; finish that row and carry on
+        unsigned int nFullRows = (unsigned int)((size_t)nRead / nRowBytes);
+        size_t nPartial = (size_t)nRead % nRowBytes;
+
+        if (nPartial != 0)
+        {
+            preadFully(fd, oDst.row(nY + nFullRows) + nPartial,
+                       nRowBytes - nPartial, nOffset + nRead);
+            ++nFullRows;
+        }
+
+        nY += nFullRows;
+        nOffset += (off_t)nFullRows * nRowBytes;
+    }
+}
+#endif
+
+} // namespace pnm
+
+// Load a binary PGM (P5) or PPM (P6) image; colour is reduced to luma.
+// Large payloads are split into row bands read concurrently with pread
+// straight into the destination rows.
+inline bool loadImagePNM(const std::string &fileName, ImageBuffer_8u_C1 &rImage,
+                         unsigned int nThreads = 0)
+{
+    std::ifstream file(fileName.c_str(), std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Could not open file: " << fileName << std::endl;
+        return false;
+    }
+
+    std::string sMagic, sWidth, sHeight, sMaxVal;
+
+    if (!pnm::readToken(file, sMagic) || (sMagic != "P5" && sMagic != "P6")) {
+        std::cerr << "Unsupported PGM format: " << sMagic << std::endl;
+        return false;
+    }
+
+    if (!pnm::readToken(file, sWidth) || !pnm::readToken(file, sHeight) ||
+        !pnm::readToken(file, sMaxVal)) {
+        std::cerr << "Truncated PNM header: " << fileName << std::endl;
+        return false;
+    }
+
+    int width = 0, height = 0, maxVal = 0;
+
+    if (!pnm::parseNumber(sWidth, width) || !pnm::parseNumber(sHeight, height) ||
+        !pnm::parseNumber(sMaxVal, maxVal) || width <= 0 || height <= 0 ||
+        maxVal <= 0 || maxVal > 255) {
+        std::cerr << "Unsupported PNM geometry or depth in " << fileName << std::endl;
+        return false;
+    }
+
+    const unsigned int nChannels = sMagic == "P6" ? 3 : 1;
+    const size_t nRowBytes = (size_t)width * nChannels;
+    const size_t nPayloadOffset = (size_t)file.tellg();
+
+    std::cout << "Loading image: " << width << "x" << height << " (max: " << maxVal << ")" << std::endl;
+
+    // Create image; the buffer is moved into rImage, not copied
+    rImage = ImageBuffer_8u_C1(width, height);
+    ImageView_8u_C1 oView = rImage.view();
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    (void)nThreads;
+    std::vector<uint8_t> aRow(nRowBytes);
+    for (int y = 0; y < height; ++y) {
+        uint8_t *pRow = nChannels == 1 ? oView.row(y) : aRow.data();
+        file.read(reinterpret_cast<char*>(pRow), nRowBytes);
+        if (nChannels == 3) {
+            pnm::rgbToGray(pRow, oView.row(y), width);
+        }
+    }
+
+    if (!file) {
+        throw npp::Exception("PNM: pixel data is truncated");
+    }
+#else
+    file.close();
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Could not open file: " << fileName << std::endl;
+        return false;
+    }
+
+    const unsigned int nBandRows = (unsigned int)std::max<size_t>(1, pnm::kBandBytes / nRowBytes);
+    const size_t nBands = (height + nBandRows - 1) / nBandRows;
+
+    if (nRowBytes * height < pnm::kParallelThreshold) {
+        nThreads = 1;
+    }
+
+    try {
+        parallelFor(nBands, [&](size_t iBand)
+        {
+            unsigned int nY0 = (unsigned int)iBand * nBandRows;
+            unsigned int nRows = std::min<unsigned int>(nBandRows, height - nY0);
+            off_t nOffset = (off_t)(nPayloadOffset + nY0 * nRowBytes);
+            ImageView_8u_C1 oBand = oView.rows(nY0, nRows);
+
+            if (nChannels == 1) {
+                pnm::preadRows(fd, oBand, nRowBytes, nOffset);
+            } else {
+                std::vector<uint8_t> aRgb(nRows * nRowBytes);
+                pnm::preadFully(fd, aRgb.data(), aRgb.size(), nOffset);
+                for (unsigned int y = 0; y < nRows; ++y) {
+                    pnm::rgbToGray(&aRgb[y * nRowBytes], oBand.row(y), width);
+                }
+            }
+        }, nThreads);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+#endif
+
+    return true;
+}
+
+// Writes a binary PGM front to back, a band of rows at a time, so it can be
+// fed while the rest of the image is still being produced.
+class PgmWriter
+{
+public:
+    PgmWriter(const std::string &fileName, unsigned int nWidth, unsigned int nHeight)
+        : file_(fileName.c_str(), std::ios::binary), nWidth_(nWidth),
+          nHeight_(nHeight), nRows_(0)
+    {
+        if (!file_.is_open())
+        {
+            throw npp::Exception("Could not open file for writing");
+        }
+
+        file_ << "P5\n" << nWidth << " " << nHeight << "\n255\n";
+    }
+
+    // Appends the rows of oRows, which continue the image.
+    void write(ImageConstView_8u_C1 oRows)
+    {
+        if (oRows.width() != nWidth_ || nRows_ + oRows.height() > nHeight_)
+        {
+            throw npp::Exception("PgmWriter: rows do not fit the image");
+        }
+
+        for (unsigned int y = 0; y < oRows.height(); ++y)
+        {
+            file_.write(reinterpret_cast<const char *>(oRows.row(y)), nWidth_);
+        }
+
+        nRows_ += oRows.height();
+    }
+
+    void close()
+    {
+        file_.close();
+
+        if (nRows_ != nHeight_ || file_.fail())
+        {
+            throw npp::Exception("PgmWriter: incomplete image written");
+        }
+    }
+
+private:
+    std::ofstream file_;
+    unsigned int nWidth_, nHeight_;
+    unsigned int nRows_;
+};
+
+// A binary PGM created at its final size and mapped into memory: view() is
+// the raster inside the file, so kernels writing it write the file, with no
+// separate write pass.  close() (or the destructor) unmaps it.
+class MappedPgmFile
+{
+public:
+    MappedPgmFile(const std::string &fileName, unsigned int nWidth, unsigned int nHeight)
+        : pMap_(0), nMapBytes_(0), nHeaderBytes_(0), nWidth_(nWidth),
+          nHeight_(nHeight), fd_(-1)
+    {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+        (void)fileName;
+        throw npp::Exception("MappedPgmFile: not supported on this platform");
+#else
+        std::ostringstream oHeader;
+        oHeader << "P5\n" << nWidth << " " << nHeight << "\n255\n";
+        const std::string sHeader = oHeader.str();
+        nHeaderBytes_ = sHeader.size();
+        nMapBytes_ = nHeaderBytes_ + (size_t)nWidth * nHeight;
+
+        fd_ = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+        if (fd_ < 0)
+        {
+            throw npp::Exception("Could not open file for writing");
+        }
+
+        if (ftruncate(fd_, (off_t)nMapBytes_) != 0)
+        {
+            ::close(fd_);
+            throw npp::Exception("MappedPgmFile: could not size the file");
+        }
+
+        void *pMap = mmap(0, nMapBytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+
+        if (pMap == MAP_FAILED)
+        {
+            ::close(fd_);
+            throw npp::Exception("MappedPgmFile: could not map the file");
+        }
+
+        pMap_ = static_cast<unsigned char *>(pMap);
+        memcpy(pMap_, sHeader.data(), nHeaderBytes_);
+#endif
+    }
+
+    ~MappedPgmFile()
+    {
+        try
+        {
+            close();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    ImageView_8u_C1 view() const
+    {
+        return ImageView_8u_C1(pMap_ + nHeaderBytes_, nWidth_, nHeight_, nWidth_);
+    }
+
+    void close()
+    {
+#if !(defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64))
+        if (pMap_ == 0)
+        {
+            return;
+        }
+
+        bool bFailed = munmap(pMap_, nMapBytes_) != 0;
+        bFailed |= ::close(fd_) != 0;
+        pMap_ = 0;
+        fd_ = -1;
+
+        if (bFailed)
+        {
+            throw npp::Exception("MappedPgmFile: could not close the file");
+        }
+#endif
+    }
+
+private:
+    MappedPgmFile(const MappedPgmFile &);
+    MappedPgmFile &operator=(const MappedPgmFile &);
+
+    unsigned char *pMap_;
+    size_t nMapBytes_;
+    size_t nHeaderBytes_;
+    unsigned int nWidth_, nHeight_;
+    int fd_;
+};
+
+// Simple PGM format saver
+inline void saveImagePGM(const std::string &fileName, ImageConstView_8u_C1 oImage)
+{
+    PgmWriter oWriter(fileName, oImage.width(), oImage.height());
+    oWriter.write(oImage);
+    oWriter.close();
+}
+
+// Binary PPM saver; the gray value is replicated into all three channels.
+inline void saveImagePPM(const std::string &fileName, ImageConstView_8u_C1 oImage)
+{
+    std::ofstream file(fileName.c_str(), std::ios::binary);
+    if (!file.is_open()) {
+        throw npp::Exception("Could not open file for writing");
+    }
+
+    file << "P6\n";
+    file << oImage.width() << " " << oImage.height() << "\n";
+    file << "255\n";
+
+    std::vector<uint8_t> aRgb(oImage.width() * 3);
+    for (unsigned int y = 0; y < oImage.height(); ++y) {
+        const uint8_t *pRow = oImage.row(y);
+        for (unsigned int x = 0; x < oImage.width(); ++x) {
+            aRgb[3 * x] = aRgb[3 * x + 1] = aRgb[3 * x + 2] = pRow[x];
+        }
+        file.write(reinterpret_cast<const char*>(aRgb.data()), aRgb.size());
+    }
+
+    file.close();
+}
+
+// Load a binary PBM (P4) image into a packed 1bpp buffer.
+inline bool loadImagePBM(const std::string &fileName, BitImageBuffer &rImage)
+{
+    std::ifstream file(fileName.c_str(), std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Could not open file: " << fileName << std::endl;
+        return false;
+    }
+
+    std::string sMagic, sWidth, sHeight;
+
+    if (!pnm::readToken(file, sMagic) || sMagic != "P4") {
+        std::cerr << "Unsupported PBM format: " << sMagic << std::endl;
+        return false;
+    }
+
+    if (!pnm::readToken(file, sWidth) || !pnm::readToken(file, sHeight)) {
+        std::cerr << "Truncated PBM header: " << fileName << std::endl;
+        return false;
+    }
+
+    int width = 0, height = 0;
+
+    if (!pnm::parseNumber(sWidth, width) || !pnm::parseNumber(sHeight, height) ||
+        width <= 0 || height <= 0) {
+        std::cerr << "Unsupported PBM geometry in " << fileName << std::endl;
+        return false;
+    }
+
+    std::cout << "Loading image: " << width << "x" << height << " (1bpp)" << std::endl;
+
+    rImage = BitImageBuffer(width, height);
+    BitImageView_1u oView = rImage.view();
+    unsigned int nPadBits = oView.rowBytes() * 8 - width;
+
+    for (int y = 0; y < height; ++y) {
+        unsigned char *pRow = oView.row(y);
+        file.read(reinterpret_cast<char*>(pRow), oView.rowBytes());
+        // keep the padding bits clear, the bit kernels rely on it
+        pRow[oView.rowBytes() - 1] &= (unsigned char)(0xff << nPadBits);
+    }
+
+    if (!file) {
+        throw npp::Exception("PBM: pixel data is truncated");
+    }
+
+    return true;
+}
+
+// Binary PBM (P4) saver for 1bpp images.
+inline void saveImagePBM(const std::string &fileName, BitImageConstView_1u oImage)
+{
+    std::ofstream file(fileName.c_str(), std::ios::binary);
+    if (!file.is_open()) {
+        throw npp::Exception("Could not open file for writing");
+    }
+
+    file << "P4\n";
+    file << oImage.width() << " " << oImage.height() << "\n";
+
+    for (unsigned int y = 0; y < oImage.height(); ++y) {
+        file.write(reinterpret_cast<const char*>(oImage.row(y)), oImage.rowBytes());
+    }
+
+    file.close();
+}
+
+namespace l4r
+{
+
+static const char kMagic[4] = {'L', '4', 'R', '1'};
+static const uint32_t kStoredFlag = 0x80000000u;
+// Bands of about this many bytes keep the per-thread working set in L2.
+static const size_t kBandBytes = 256 * 1024;
+
+inline void put32(std::vector<uint8_t> &rOut, uint32_t nValue)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        rOut.push_back((uint8_t)(nValue >> (8 * i)));
+    }
+}
+
+inline uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+} // namespace l4r
+
+// Lossless LZ4 band-compressed saver, see the file comment for the layout.
+inline void saveImageL4R(const std::string &fileName, ImageConstView_8u_C1 oImage)
+{
+    const size_t nRowBytes = oImage.width();
+    const unsigned int nBandRows = (unsigned int)std::max<size_t>(
+        1, l4r::kBandBytes / std::max<size_t>(nRowBytes, 1));
+    const unsigned int nBands = (oImage.height() + nBandRows - 1) / nBandRows;
+
+    std::vector<std::vector<uint8_t> > aPayloads(nBands);
+    std::vector<uint32_t> aSizes(nBands);
+
+    parallelFor(nBands, [&](size_t iBand)
+    {
+        unsigned int nY0 = (unsigned int)iBand * nBandRows;
+        unsigned int nRows = std::min(nBandRows, oImage.height() - nY0);
+        size_t nBytes = nRowBytes * nRows;
+        ImageConstView_8u_C1 oBand = oImage.rows(nY0, nRows);
+
+        // gather pitched rows into one run for the block encoder
+        std::vector<uint8_t> aRaw;
+        const uint8_t *pRaw = oBand.data();
+
+        if (!oBand.isContiguous())
+        {
+            aRaw.resize(nBytes);
+
+            for (unsigned int y = 0; y < nRows; ++y)
+            {
+                memcpy(&aRaw[y * nRowBytes], oBand.row(y), nRowBytes);
+            }
+
+            pRaw = aRaw.data();
+        }
+
+        std::vector<uint8_t> &rPayload = aPayloads[iBand];
+        rPayload.resize(lz4::compressBound(nBytes));
+        size_t nPacked = lz4::compress(pRaw, nBytes, rPayload.data());
+
+        if (nPacked < nBytes)
+        {
+            rPayload.resize(nPacked);
+            aSizes[iBand] = (uint32_t)nPacked;
+        }
+        else
+        {
+            rPayload.assign(pRaw, pRaw + nBytes);
+            aSizes[iBand] = (uint32_t)nBytes | l4r::kStoredFlag;
+        }
+    });
+
+    std::vector<uint8_t> aHeader(l4r::kMagic, l4r::kMagic + 4);
+    l4r::put32(aHeader, oImage.width());
+    l4r::put32(aHeader, oImage.height());
+    l4r::put32(aHeader, 1);
+    l4r::put32(aHeader, nBandRows);
+    l4r::put32(aHeader, nBands);
+
+    for (unsigned int i = 0; i < nBands; ++i)
+    {
+        l4r::put32(aHeader, aSizes[i]);
+    }
+
+    std::ofstream file(fileName.c_str(), std::ios::binary);
+
+    if (!file.is_open())
+    {
+        throw npp::Exception("Could not open file for writing");
+    }
+
+    file.write(reinterpret_cast<const char *>(aHeader.data()), aHeader.size());
+
+    for (unsigned int i = 0; i < nBands; ++i)
+    {
+        file.write(reinterpret_cast<const char *>(aPayloads[i].data()),
+                   aPayloads[i].size());
+    }
+
+    if (!file)
+    {
+        throw npp::Exception("Could not write file: " + fileName);
+    }
+}
+
+// Load an L4R image written by saveImageL4R.
+inline bool loadImageL4R(const std::string &fileName, ImageBuffer_8u_C1 &rImage)
+{
+    std::ifstream file(fileName.c_str(), std::ios::binary);
+
+    if (!file.is_open())
+    {
+        std::cerr << "Could not open file: " << fileName << std::endl;
+        return false;
+    }
+
+    uint8_t aFixed[24];
+    file.read(reinterpret_cast<char *>(aFixed), sizeof(aFixed));
+
+    if (!file || memcmp(aFixed, l4r::kMagic, 4) != 0)
+    {
+        std::cerr << "Not an L4R file: " << fileName << std::endl;
+        return false;
+    }
+
+    uint32_t nWidth = l4r::get32(aFixed + 4);
+    uint32_t nHeight = l4r::get32(aFixed + 8);
+    uint32_t nChannels = l4r::get32(aFixed + 12);
+    uint32_t nBandRows = l4r::get32(aFixed + 16);
+    uint32_t nBands = l4r::get32(aFixed + 20);
+
+    // in 64 bits, so a crafted header cannot wrap the band count or the
+    // size of the table
+    if (nChannels != 1 || nWidth == 0 || nHeight == 0 || nBandRows == 0 ||
+        nBands != ((uint64_t)nHeight + nBandRows - 1) / nBandRows)
+    {
+        std::cerr << "Unsupported L4R layout in " << fileName << std::endl;
+        return false;
+    }
+
+    // the size table and the payload must fit in the file before anything
+    // of their size is allocated
+    file.seekg(0, std::ios::end);
+    const uint64_t nFileSize = (uint64_t)file.tellg();
+    const uint64_t nTableEnd = sizeof(aFixed) + 4 * (uint64_t)nBands;
+    file.seekg(sizeof(aFixed), std::ios::beg);
+
+    if (!file || nTableEnd > nFileSize)
+    {
+        std::cerr << "Truncated L4R file: " << fileName << std::endl;
+        return false;
+    }
+
+    std::vector<uint8_t> aSizeTable((size_t)nBands * 4);
+    file.read(reinterpret_cast<char *>(aSizeTable.data()), aSizeTable.size());
+
+    std::vector<uint32_t> aSizes(nBands);
+    std::vector<size_t> aOffsets((size_t)nBands + 1, 0);
+
+    for (size_t i = 0; i < nBands; ++i)
+    {
+        aSizes[i] = l4r::get32(&aSizeTable[i * 4]);
+        aOffsets[i + 1] = aOffsets[i] + (aSizes[i] & ~l4r::kStoredFlag);
+    }
+
+    if (!file || nTableEnd + aOffsets[nBands] > nFileSize)
+    {
+        std::cerr << "Truncated L4R file: " << fileName << std::endl;
+        return false;
+    }
+
+    std::vector<uint8_t> aPayload(aOffsets[nBands]);
+    file.read(reinterpret_cast<char *>(aPayload.data()), aPayload.size());
+
+    if (!file)
+    {
+        std::cerr << "Truncated L4R file: " << fileName << std::endl;
+        return false;
+    }
+
+    std::cout << "Loading image: " << nWidth << "x" << nHeight << " (L4R, "
+              << nBands << " bands)" << std::endl;
+
+    rImage = ImageBuffer_8u_C1(nWidth, nHeight);
+    ImageView_8u_C1 oImage = rImage.view();
+
+    parallelFor(nBands, [&](size_t iBand)
+    {
+        unsigned int nY0 = (unsigned int)iBand * nBandRows;
+        unsigned int nRows = std::min<unsigned int>(nBandRows, nHeight - nY0);
+        size_t nBytes = (size_t)nWidth * nRows;
+        const uint8_t *pIn = &aPayload[aOffsets[iBand]];
+        size_t nInBytes = aOffsets[iBand + 1] - aOffsets[iBand];
+        ImageView_8u_C1 oBand = oImage.rows(nY0, nRows);
+        bool bStored = (aSizes[iBand] & l4r::kStoredFlag) != 0;
+
+        if (bStored && nInBytes != nBytes)
+        {
+            throw npp::Exception("L4R: stored band has the wrong size");
+        }
+
+        // decode straight into the destination when its rows are packed
+        std::vector<uint8_t> aRaw;
+        uint8_t *pRaw = oBand.data();
+
+        if (!oBand.isContiguous())
+        {
+            aRaw.resize(nBytes);
+            pRaw = aRaw.data();
+        }
+
+        if (bStored)
+        {
+            memcpy(pRaw, pIn, nBytes);
+        }
+        else
+        {
+            lz4::decompress(pIn, nInBytes, pRaw, nBytes);
+        }
+
+        if (!oBand.isContiguous())
+        {
+            for (unsigned int y = 0; y < nRows; ++y)
+            {
+                memcpy(oBand.row(y), &aRaw[y * (size_t)nWidth], nWidth);
+            }
+        }
+    });
+
+    return true;
+}
+
+// True for the formats handled by this header rather than FreeImage.
+inline bool isPipelineImageFile(const std::string &fileName)
+{
+    std::string sExtension = fileExtension(fileName);
+    return sExtension == ".pgm" || sExtension == ".ppm" || sExtension == ".l4r" ||
+           sExtension == ".tif" || sExtension == ".tiff";
+}
+
+// True for JPEG file extensions.
+inline bool isJpegFile(const std::string &fileName)
+{
+    std::string sExtension = fileExtension(fileName);
+    return sExtension == ".jpg" || sExtension == ".jpeg";
+}
+
+// The orientation tag of a JPEG (EXIF) or TIFF file, numbered 1 to 8 as in
+// Orientation::exif(); 1 for other formats and files without one.
+inline unsigned int readImageOrientation(const std::string &fileName)
+{
+    std::string sExtension = fileExtension(fileName);
+
+    if (isJpegFile(fileName))
+    {
+        return readJpegOrientation(fileName);
+    }
+
+    if (sExtension == ".tif" || sExtension == ".tiff")
+    {
+        return readTiffOrientation(fileName);
+    }
+
+    return 1;
+}
+
+// Loads a pipeline format image, picking the reader from the extension.
+inline bool loadImageFile(const std::string &fileName, ImageBuffer_8u_C1 &rImage)
+{
+    std::string sExtension = fileExtension(fileName);
+
+    if (sExtension == ".l4r")
+    {
+        return loadImageL4R(fileName, rImage);
+    }
+
+    if (sExtension == ".tif" || sExtension == ".tiff")
+    {
+        return loadImageTIFF(fileName, rImage);
+    }
+
+    return loadImagePNM(fileName, rImage);
+}
+
+// Saves a pipeline format image, picking the writer from the extension;
+// rTiffOptions only applies to TIFF files.
+inline void saveImageFile(const std::string &fileName, ImageConstView_8u_C1 oImage,
+                          const TiffOptions &rTiffOptions = TiffOptions())
+{
+    std::string sExtension = fileExtension(fileName);
+
+    if (sExtension == ".tif" || sExtension == ".tiff")
+    {
+        saveImageTIFF(fileName, oImage, rTiffOptions);
+    }
+    else if (sExtension == ".l4r")
+    {
+        saveImageL4R(fileName, oImage);
+    }
+    else if (sExtension == ".ppm")
+    {
+        saveImagePPM(fileName, oImage);
+    }
+    else
+    {
+        saveImagePGM(fileName, oImage);
+    }
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_IMAGE_FILE_H
@@ -0,0 +1,178 @@
+/* Histogram and moments of 8-bit images.
+ *
+ * Only the 256-bin histogram is accumulated per pixel; count, minimum,
+ * maximum, mean and standard deviation all follow from it exactly.
+ * StatsEpilogue plugs into the CPU rotation kernels and fills one histogram
+ * per worker from the rows as they are written, so the statistics of the
+ * rotated image cost no extra pass over memory.
+ */
+
+#ifndef PIPELINE_IMAGE_STATS_H
+#define PIPELINE_IMAGE_STATS_H
+
+#include "ImageView.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace pipeline
+{
+
+struct ImageStats
+{
+    uint64_t aHistogram[256];
+
+    ImageStats()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        memset(aHistogram, 0, sizeof(aHistogram));
+    }
+
+    void add(const unsigned char *pPixels, unsigned int nCount)
+    {
+        for (unsigned int i = 0; i < nCount; ++i)
+        {
+            ++aHistogram[pPixels[i]];
+        }
+    }
+
+    void merge(const ImageStats &rOther)
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            aHistogram[i] += rOther.aHistogram[i];
+        }
+    }
+
+    uint64_t count() const
+    {
+        uint64_t nCount = 0;
+
+        for (int i = 0; i < 256; ++i)
+        {
+            nCount += aHistogram[i];
+        }
+
+        return nCount;
+    }
+
+    int minimum() const
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            if (aHistogram[i] != 0)
+            {
+                return i;
+            }
+        }
+
+        return 0;
+    }
+
+    int maximum() const
+    {
+        for (int i = 255; i >= 0; --i)
+        {
+            if (aHistogram[i] != 0)
+            {
+                return i;
+            }
+        }
+
+        return 0;
+    }
+
+    double mean() const
+    {
+        uint64_t nCount = count();
+        uint64_t nSum = 0;
+
+        for (int i = 0; i < 256; ++i)
+        {
+            nSum += aHistogram[i] * (uint64_t)i;
+        }
+
+        return nCount ? (double)nSum / nCount : 0.0;
+    }
+
+    double stddev() const
+    {
+        uint64_t nCount = count();
+
+        if (nCount == 0)
+        {
+            return 0.0;
+        }
+
+        double nMean = mean();
+        double nVariance = 0.0;
+
+        for (int i = 0; i < 256; ++i)
+        {
+            nVariance += aHistogram[i] * (i - nMean) * (i - nMean);
+        }
+
+        return std::sqrt(nVariance / nCount);
+    }
+};
+
+class StatsEpilogue
+{
+public:
+    void prepare(unsigned int nWorkers)
+    {
+        aWorkers_.assign(nWorkers, Slot());
+    }
+
+    void row(unsigned int nWorker, unsigned int, unsigned int,
+             unsigned char *pRow, unsigned int nCount)
+    {
+        aWorkers_[nWorker].oStats.add(pRow, nCount);
+    }
+
+    // Merged statistics of everything the kernel wrote.
+    ImageStats result() const
+    {
+        ImageStats oTotal;
+
+        for (size_t i = 0; i < aWorkers_.size(); ++i)
+        {
+            oTotal.merge(aWorkers_[i].oStats);
+        }
+
+        return oTotal;
+    }
+
+private:
+    // padded so neighbouring workers never share a cache line
+    struct Slot
+    {
+        ImageStats oStats;
+        char aPad[64];
+    };
+
+    std::vector<Slot> aWorkers_;
+};
+
+// Single pass statistics of an existing image.
+inline ImageStats computeStats(ImageConstView_8u_C1 oImage)
+{
+    ImageStats oStats;
+
+    for (unsigned int y = 0; y < oImage.height(); ++y)
+    {
+        oStats.add(oImage.row(y), oImage.width());
+    }
+
+    return oStats;
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_IMAGE_STATS_H
@@ -0,0 +1,271 @@
+/* Host image types for the rotation pipeline.
+ *
+ * ImageBuffer owns a pitched host allocation and can only be moved, never
+ * copied.  ImageView is a non-owning (pointer, size, pitch) window onto any
+ * pitched storage -- an ImageBuffer, an npp::ImageCPU or a mapped file -- and
+ * is what every pipeline stage takes and returns.  Passing views by value is
+ * cheap and can never duplicate pixel data.  Crops and vertical flips are
+ * views too; the pitch is signed, so a flipped view walks its rows upwards.
+ */
+
+#ifndef PIPELINE_IMAGE_VIEW_H
+#define PIPELINE_IMAGE_VIEW_H
+
+#include <Exceptions.h>
+
+#include <cstddef>
+#include <cstdlib>
+#include <type_traits>
+#include <utility>
+
+namespace pipeline
+{
+
+template <typename D>
+class ImageView
+{
+public:
+    typedef D value_type;
+
+    ImageView() : pData_(0), nWidth_(0), nHeight_(0), nPitch_(0)
+    {
+    }
+
+    // nPitch is the distance in bytes between the starts of two rows.
+    ImageView(D *pData, unsigned int nWidth, unsigned int nHeight,
+              std::ptrdiff_t nPitch)
+        : pData_(pData), nWidth_(nWidth), nHeight_(nHeight), nPitch_(nPitch)
+    {
+    }
+
+    // A view of mutable pixels converts implicitly to a view of const pixels.
+    template <typename S>
+    ImageView(const ImageView<S> &rOther,
+              typename std::enable_if<std::is_convertible<S *, D *>::value>::type * = 0)
+        : pData_(rOther.data()), nWidth_(rOther.width()),
+          nHeight_(rOther.height()), nPitch_(rOther.pitch())
+    {
+    }
+
+    D *data() const
+    {
+        return pData_;
+    }
+
+    unsigned int width() const
+    {
+        return nWidth_;
+    }
+
+    unsigned int height() const
+    {
+        return nHeight_;
+    }
+
+    std::ptrdiff_t pitch() const
+    {
+        return nPitch_;
+    }
+
+    bool empty() const
+    {
+        return pData_ == 0 || nWidth_ == 0 || nHeight_ == 0;
+    }
+
+    // True when the rows are packed back to back, i.e. the whole image can be
+    // treated as one width * height run of pixels.
+    bool isContiguous() const
+    {
+        return nPitch_ == (std::ptrdiff_t)(nWidth_ * sizeof(D));
+    }
+
+    D *row(unsigned int nY) const
+    {
+        return reinterpret_cast<D *>(reinterpret_cast<Byte *>(pData_) +
+                                     (std::ptrdiff_t)nY * nPitch_);
+    }
+
+    // Sub-view of nRows rows starting at row nY.
+    ImageView rows(unsigned int nY, unsigned int nRows) const
+    {
+        return ImageView(row(nY), nWidth_, nRows, nPitch_);
+    }
+
+    // Sub-view of the nWidth x nHeight rectangle at (nX, nY), which must not
+    // be empty.
+    ImageView crop(unsigned int nX, unsigned int nY, unsigned int nWidth,
+                   unsigned int nHeight) const
+    {
+        if (nWidth == 0 || nHeight == 0)
+        {
+            throw npp::Exception("ImageView: crop rectangle is empty");
+        }
+
+        if (nX > nWidth_ || nWidth > nWidth_ - nX || nY > nHeight_ ||
+            nHeight > nHeight_ - nY)
+        {
+            throw npp::Exception("ImageView: crop rectangle exceeds the image");
+        }
+
+        return ImageView(row(nY) + nX, nWidth, nHeight, nPitch_);
+    }
+
+    // The same pixels upside down: starts at the last row with negated pitch.
+    ImageView flipVertical() const
+    {
+        return ImageView(nHeight_ ? row(nHeight_ - 1) : pData_, nWidth_,
+                         nHeight_, -nPitch_);
+    }
+
+private:
+    typedef typename std::conditional<std::is_const<D>::value,
+                                      const unsigned char,
+                                      unsigned char>::type Byte;
+
+    D *pData_;
+    unsigned int nWidth_;
+    unsigned int nHeight_;
+    std::ptrdiff_t nPitch_;
+};
+
+// Wraps anything exposing data()/width()/height()/pitch(), e.g. npp::ImageCPU,
+// in a view without touching its pixels.
+template <class I>
+ImageView<typename std::remove_pointer<decltype(std::declval<I &>().data())>::type>
+viewOf(I &rImage)
+{
+    typedef typename std::remove_pointer<decltype(rImage.data())>::type D;
+    return ImageView<D>(rImage.data(), rImage.width(), rImage.height(),
+                        (std::ptrdiff_t)rImage.pitch());
+}
+
+template <typename D>
+class ImageBuffer
+{
+public:
+    // Rows start on cache line boundaries.
+    static const unsigned int kRowAlignment = 64;
+
+    ImageBuffer() : pData_(0), nWidth_(0), nHeight_(0), nPitch_(0)
+    {
+    }
+
+    ImageBuffer(unsigned int nWidth, unsigned int nHeight)
+        : pData_(0), nWidth_(nWidth), nHeight_(nHeight), nPitch_(0)
+    {
+        nPitch_ = (nWidth * sizeof(D) + kRowAlignment - 1) / kRowAlignment *
+                  kRowAlignment;
+        size_t nBytes = nPitch_ * (size_t)nHeight;
+
+        if (nBytes > 0)
+        {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+            pData_ = static_cast<D *>(_aligned_malloc(nBytes, kRowAlignment));
+#else
+            void *pMemory = 0;
+            if (posix_memalign(&pMemory, kRowAlignment, nBytes) == 0)
+            {
+                pData_ = static_cast<D *>(pMemory);
+            }
+#endif
+            if (pData_ == 0)
+            {
+                throw npp::Exception("ImageBuffer: host allocation failed");
+            }
+        }
+    }
+
+    ImageBuffer(ImageBuffer &&rOther) noexcept
+        : pData_(rOther.pData_), nWidth_(rOther.nWidth_),
+          nHeight_(rOther.nHeight_), nPitch_(rOther.nPitch_)
+    {
+        rOther.pData_ = 0;
+        rOther.nWidth_ = rOther.nHeight_ = 0;
+        rOther.nPitch_ = 0;
+    }
+
+    ImageBuffer &operator=(ImageBuffer &&rOther) noexcept
+    {
+        if (this != &rOther)
+        {
+            release();
+            std::swap(pData_, rOther.pData_);
+            std::swap(nWidth_, rOther.nWidth_);
+            std::swap(nHeight_, rOther.nHeight_);
+            std::swap(nPitch_, rOther.nPitch_);
+        }
+
+        return *this;
+    }
+
+    ImageBuffer(const ImageBuffer &) = delete;
+    ImageBuffer &operator=(const ImageBuffer &) = delete;
+
+    ~ImageBuffer()
+    {
+        release();
+    }
+
+    D *data()
+    {
+        return pData_;
+    }
+
+    const D *data() const
+    {
+        return pData_;
+    }
+
+    unsigned int width() const
+    {
+        return nWidth_;
+    }
+
+    unsigned int height() const
+    {
+        return nHeight_;
+    }
+
+    size_t pitch() const
+    {
+        return nPitch_;
+    }
+
+    ImageView<D> view()
+    {
+        return ImageView<D>(pData_, nWidth_, nHeight_, (std::ptrdiff_t)nPitch_);
+    }
+
+    ImageView<const D> view() const
+    {
+        return ImageView<const D>(pData_, nWidth_, nHeight_,
+                                  (std::ptrdiff_t)nPitch_);
+    }
+
+private:
+    void release()
+    {
+        if (pData_ != 0)
+        {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+            _aligned_free(pData_);
+#else
+            free(pData_);
+#endif
+            pData_ = 0;
+        }
+    }
+
+    D *pData_;
+    unsigned int nWidth_;
+    unsigned int nHeight_;
+    size_t nPitch_;
+};
+
+typedef ImageView<unsigned char> ImageView_8u_C1;
+typedef ImageView<const unsigned char> ImageConstView_8u_C1;
+typedef ImageBuffer<unsigned char> ImageBuffer_8u_C1;
+
+} // namespace pipeline
+
+#endif // PIPELINE_IMAGE_VIEW_H
@@ -0,0 +1,310 @@
+/* JPEG decoding through libjpeg for the rotation pipeline.
+ *
+ * The decoder is asked for gray output, so only the luma component goes
+ * through the IDCT and there is no chroma upsampling or colour conversion.
+ * It can also scale by 1/2, 1/4 or 1/8 inside the IDCT, computing just the
+ * low frequencies of every 8x8 block: a thumbnail job decodes a fraction of
+ * the pixels instead of decoding them all and throwing most away in the
+ * resize.
+ *
+ * The EXIF orientation of a camera image is read from its APP1 marker, in
+ * the TIFF numbering of TiffFile.h, for the caller to fold into the
+ * rotation; the decoded pixels always keep the stored orientation.
+ */
+
+#ifndef PIPELINE_JPEG_FILE_H
+#define PIPELINE_JPEG_FILE_H
+
+#include <Exceptions.h>
+
+#include "ImageView.h"
+#include "TiffFile.h"
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <stdint.h>
+
+#include <jpeglib.h>
+
+namespace pipeline
+{
+
+namespace jpeg
+{
+
+struct ErrorManager
+{
+    jpeg_error_mgr oPublic;
+    jmp_buf aJump;
+    char aMessage[JMSG_LENGTH_MAX];
+};
+
+// libjpeg's fatal error hook; unwinds to the setjmp() of the caller's C
+// style frame, never through C++ frames.
+inline void errorExit(j_common_ptr pInfo)
+{
+    ErrorManager *pError = reinterpret_cast<ErrorManager *>(pInfo->err);
+    (*pInfo->err->format_message)(pInfo, pError->aMessage);
+    longjmp(pError->aJump, 1);
+}
+
+// Offset of the orientation value (tag 0x0112 of IFD0) in the payload of
+// an EXIF APP1 marker, or 0 when there is none.
+inline size_t exifOrientationOffset(const uint8_t *pData, size_t nSize,
+                                    bool &rBigEndian)
+{
+    const size_t nBase = 6; // "Exif\0\0", then a TIFF header
+
+    if (nSize < nBase + 8 || memcmp(pData, "Exif\0\0", 6) != 0)
+    {
+        return 0;
+    }
+
+    const uint8_t *pTiff = pData + nBase;
+    const size_t nTiffSize = nSize - nBase;
+    rBigEndian = pTiff[0] == 'M';
+
+    if (pTiff[0] != pTiff[1] || (pTiff[0] != 'I' && pTiff[0] != 'M'))
+    {
+        return 0;
+    }
+
+    size_t nIfd = (size_t)tiff::getValue(pTiff + 4, 4, rBigEndian);
+
+    if (nIfd + 2 > nTiffSize)
+    {
+        return 0;
+    }
+
+    size_t nEntries = (size_t)tiff::getValue(pTiff + nIfd, 2, rBigEndian);
+
+    for (size_t i = 0; i < nEntries && nIfd + 2 + 12 * (i + 1) <= nTiffSize; ++i)
+    {
+        const uint8_t *pEntry = pTiff + nIfd + 2 + 12 * i;
+
+        if (tiff::getValue(pEntry, 2, rBigEndian) == tiff::TAG_ORIENTATION &&
+            tiff::getValue(pEntry + 2, 2, rBigEndian) == tiff::TYPE_SHORT)
+        {
+            return nBase + nIfd + 2 + 12 * i + 8;
+        }
+    }
+
+    return 0;
+}
+
+// The orientation (1 to 8) recorded in the saved EXIF marker of rInfo, 1
+// when there is none.
+inline unsigned int exifOrientation(const jpeg_decompress_struct &rInfo)
+{
+    for (jpeg_saved_marker_ptr pMarker = rInfo.marker_list; pMarker;
+         pMarker = pMarker->next)
+    {
+        bool bBigEndian = false;
+        size_t nOffset = pMarker->marker == JPEG_APP0 + 1 ?
+                             exifOrientationOffset(pMarker->data, pMarker->data_length,
+                                                   bBigEndian) :
+                             0;
+
+        if (nOffset != 0)
+        {
+            unsigned int nValue =
+                (unsigned int)tiff::getValue(pMarker->data + nOffset, 2, bBigEndian);
+            return nValue >= 1 && nValue <= 8 ? nValue : 1;
+        }
+    }
+
+    return 1;
+}
+
+struct Header
+{
+    unsigned int nWidth;
+    unsigned int nHeight;
+    unsigned int nOrientation;
+};
+
+// A decompressor and its file, released on scope exit.
+struct Decoder
+{
+    ErrorManager oError;
+    jpeg_decompress_struct oInfo;
+    bool bCreated;
+    FILE *pIn;
+
+    Decoder() : bCreated(false), pIn(0)
+    {
+        oError.aMessage[0] = 0;
+    }
+
+    ~Decoder()
+    {
+        if (bCreated)
+        {
+            jpeg_destroy_decompress(&oInfo);
+        }
+
+        if (pIn)
+        {
+            fclose(pIn);
+        }
+    }
+
+private:
+    Decoder(const Decoder &);
+    Decoder &operator=(const Decoder &);
+};
+
+// Reads the header only, or with pImage also decodes into it at 1/nScale
+// size.  Returns false on a libjpeg error; no object with a destructor may
+// live in this frame, libjpeg errors longjmp here.
+inline bool decode(Decoder &rDecoder, unsigned int nScale, ImageBuffer_8u_C1 *pImage,
+                   Header &rHeader)
+{
+    jpeg_decompress_struct &rInfo = rDecoder.oInfo;
+    rInfo.err = jpeg_std_error(&rDecoder.oError.oPublic);
+    rDecoder.oError.oPublic.error_exit = errorExit;
+
+    if (setjmp(rDecoder.oError.aJump))
+    {
+        return false;
+    }
+
+    jpeg_create_decompress(&rInfo);
+    rDecoder.bCreated = true;
+    jpeg_stdio_src(&rInfo, rDecoder.pIn);
+    jpeg_save_markers(&rInfo, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_read_header(&rInfo, TRUE);
+
+    rHeader.nWidth = rInfo.image_width;
+    rHeader.nHeight = rInfo.image_height;
+    rHeader.nOrientation = exifOrientation(rInfo);
+
+    if (!pImage)
+    {
+        return true;
+    }
+
+    rInfo.out_color_space = JCS_GRAYSCALE;
+    rInfo.scale_num = 1;
+    rInfo.scale_denom = nScale;
+    jpeg_start_decompress(&rInfo);
+
+    rHeader.nWidth = rInfo.output_width;
+    rHeader.nHeight = rInfo.output_height;
+    *pImage = ImageBuffer_8u_C1(rHeader.nWidth, rHeader.nHeight);
+
+    JSAMPROW aRows[16];
+
+    while (rInfo.output_scanline < rInfo.output_height)
+    {
+        unsigned int nRows = std::min<unsigned int>(
+            16, rInfo.output_height - rInfo.output_scanline);
+
+        for (unsigned int i = 0; i < nRows; ++i)
+        {
+            aRows[i] = pImage->view().row(rInfo.output_scanline + i);
+        }
+
+        jpeg_read_scanlines(&rInfo, aRows, nRows);
+    }
+
+    jpeg_finish_decompress(&rInfo);
+    return true;
+}
+
+// False when the file cannot be opened; throws on a libjpeg error.
+inline bool decodeFile(const std::string &fileName, unsigned int nScale,
+                       ImageBuffer_8u_C1 *pImage, Header &rHeader)
+{
+    Decoder oDecoder;
+    oDecoder.pIn = fopen(fileName.c_str(), "rb");
+
+    if (!oDecoder.pIn)
+    {
+        return false;
+    }
+
+    if (!decode(oDecoder, nScale, pImage, rHeader))
+    {
+        throw npp::Exception("JPEG: " + std::string(oDecoder.oError.aMessage));
+    }
+
+    return true;
+}
+
+} // namespace jpeg
+
+// Reads the pixel size of a JPEG file from its header.
+inline bool readJpegSize(const std::string &fileName, unsigned int &rWidth,
+                         unsigned int &rHeight)
+{
+    jpeg::Header oHeader;
+
+    if (!jpeg::decodeFile(fileName, 1, 0, oHeader))
+    {
+        std::cerr << "Could not open file: " << fileName << std::endl;
+        return false;
+    }
+
+    rWidth = oHeader.nWidth;
+    rHeight = oHeader.nHeight;
+    return true;
+}
+
+// The EXIF orientation (1 to 8) of a JPEG file, 1 when it has none or
+// cannot be opened.
+inline unsigned int readJpegOrientation(const std::string &fileName)
+{
+    jpeg::Header oHeader;
+    return jpeg::decodeFile(fileName, 1, 0, oHeader) ? oHeader.nOrientation : 1;
+}
+
+// Decodes a JPEG as 8-bit gray at 1/nScale of its size (nScale 1, 2, 4 or
+// 8); sizes round up.  The pixels are left as stored, whatever the EXIF
+// orientation.
+inline bool loadImageJPEG(const std::string &fileName, ImageBuffer_8u_C1 &rImage,
+                          unsigned int nScale = 1)
+{
+    jpeg::Header oHeader;
+
+    if (!jpeg::decodeFile(fileName, nScale, &rImage, oHeader))
+    {
+        std::cerr << "Could not open file: " << fileName << std::endl;
+        return false;
+    }
+
+    std::cout << "Loading image: " << oHeader.nWidth << "x" << oHeader.nHeight
+              << " (JPEG";
+
+    if (nScale > 1)
+    {
+        std::cout << ", decoded at 1/" << nScale;
+    }
+
+    std::cout << ")" << std::endl;
+    return true;
+}
+
+// The largest JPEG decoder scale (8, 4, 2 or 1) that keeps a result of
+// nWidth x nHeight at full scale at least nMinWidth x nMinHeight.
+inline unsigned int jpegScaleFor(unsigned int nWidth, unsigned int nHeight,
+                                 unsigned int nMinWidth, unsigned int nMinHeight)
+{
+    unsigned int nScale = 8;
+
+    while (nScale > 1 && ((uint64_t)nMinWidth * nScale > nWidth ||
+                          (uint64_t)nMinHeight * nScale > nHeight))
+    {
+        nScale /= 2;
+    }
+
+    return nScale;
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_JPEG_FILE_H
@@ -0,0 +1,377 @@
+/* Lossless right angle rotations and flips of JPEG files in the DCT domain.
+ *
+ * Every symmetry of the pixel grid maps each 8x8 block onto a block of the
+ * result and acts on its DCT coefficients without mixing them: a transpose
+ * swaps the horizontal and vertical frequencies (and the quantization
+ * tables and sampling factors along with them), a mirror negates the odd
+ * frequencies along its axis.  libjpeg only entropy decodes the source to
+ * coefficients and entropy codes the result, so no IDCT, colour conversion,
+ * requantization or generation loss is involved.
+ *
+ * A mirrored axis must cover whole MCUs, since partial edge blocks would
+ * otherwise land inside the image; like jpegtran -trim, the incomplete MCU
+ * row or column on such an axis is dropped.
+ *
+ * When the EXIF orientation was folded into the transformation, the copied
+ * EXIF marker is marked upright so viewers do not apply it a second time.
+ */
+
+#ifndef PIPELINE_JPEG_TRANSFORM_H
+#define PIPELINE_JPEG_TRANSFORM_H
+
+#include <Exceptions.h>
+
+#include "ImageFile.h"
+#include "JpegFile.h"
+#include "RotateGeometry.h"
+
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <jpeglib.h>
+
+namespace pipeline
+{
+
+namespace jpeg
+{
+
+// The libjpeg objects and files of one transformation, released on scope
+// exit whether or not it succeeded.
+struct Session
+{
+    ErrorManager oError;
+    jpeg_decompress_struct oSrc;
+    jpeg_compress_struct oDst;
+    bool bSrcCreated, bDstCreated;
+    FILE *pIn, *pOut;
+    JDIMENSION nTrimmedColumns, nTrimmedRows; // of the source, see transcode
+
+    Session()
+        : bSrcCreated(false), bDstCreated(false), pIn(0), pOut(0),
+          nTrimmedColumns(0), nTrimmedRows(0)
+    {
+        oError.aMessage[0] = 0;
+    }
+
+    ~Session()
+    {
+        if (bDstCreated)
+        {
+            jpeg_destroy_compress(&oDst);
+        }
+
+        if (bSrcCreated)
+        {
+            jpeg_destroy_decompress(&oSrc);
+        }
+
+        if (pIn)
+        {
+            fclose(pIn);
+        }
+
+        if (pOut)
+        {
+            fclose(pOut);
+        }
+    }
+
+private:
+    Session(const Session &);
+    Session &operator=(const Session &);
+};
+
+inline JDIMENSION roundUp(JDIMENSION nValue, JDIMENSION nMultiple)
+{
+    return (nValue + nMultiple - 1) / nMultiple * nMultiple;
+}
+
+// Where each coefficient of a transformed block comes from, and whether it
+// changes sign: a transpose swaps the frequencies u and v, a mirror negates
+// the odd frequencies along its axis.
+struct BlockMap
+{
+    int aSource[DCTSIZE2];
+    bool aNegate[DCTSIZE2];
+
+    explicit BlockMap(const Orientation &rOrientation)
+    {
+        for (int v = 0; v < DCTSIZE; ++v)
+        {
+            for (int u = 0; u < DCTSIZE; ++u)
+            {
+                int i = v * DCTSIZE + u;
+                aSource[i] = rOrientation.bTranspose ? u * DCTSIZE + v : i;
+                aNegate[i] = (rOrientation.bFlipX && (u & 1)) !=
+                             (rOrientation.bFlipY && (v & 1));
+            }
+        }
+    }
+
+    void apply(const JCOEF *pSrc, JCOEF *pDst) const
+    {
+        for (int i = 0; i < DCTSIZE2; ++i)
+        {
+            JCOEF nValue = pSrc[aSource[i]];
+            pDst[i] = aNegate[i] ? (JCOEF)-nValue : nValue;
+        }
+    }
+};
+
+// Reads rSession.pIn, writes the transformed file to rSession.pOut, with
+// the EXIF orientation reset to 1 if bResetExif, and records the source
+// columns and rows dropped to whole MCUs.  Returns false on a libjpeg
+// error, with the message in rSession.oError.  No object with a destructor
+// may live in this frame, libjpeg errors longjmp here.
+inline bool transcode(Session &rSession, const Orientation &rOrientation,
+                      bool bResetExif)
+{
+    jpeg_decompress_struct &rSrc = rSession.oSrc;
+    jpeg_compress_struct &rDst = rSession.oDst;
+
+    rSrc.err = jpeg_std_error(&rSession.oError.oPublic);
+    rDst.err = &rSession.oError.oPublic;
+    rSession.oError.oPublic.error_exit = errorExit;
+
+    if (setjmp(rSession.oError.aJump))
+    {
+        return false;
+    }
+
+    jpeg_create_decompress(&rSrc);
+    rSession.bSrcCreated = true;
+    jpeg_create_compress(&rDst);
+    rSession.bDstCreated = true;
+
+    jpeg_stdio_src(&rSrc, rSession.pIn);
+    jpeg_save_markers(&rSrc, JPEG_COM, 0xFFFF);
+
+    for (int i = 0; i < 16; ++i)
+    {
+        jpeg_save_markers(&rSrc, JPEG_APP0 + i, 0xFFFF);
+    }
+
+    jpeg_read_header(&rSrc, TRUE);
+
+    // the source axes that end up mirrored must hold whole MCUs
+    const bool bTranspose = rOrientation.bTranspose;
+    const bool bMirrorX = bTranspose ? rOrientation.bFlipY : rOrientation.bFlipX;
+    const bool bMirrorY = bTranspose ? rOrientation.bFlipX : rOrientation.bFlipY;
+    const JDIMENSION nMcuWidth = rSrc.max_h_samp_factor * DCTSIZE;
+    const JDIMENSION nMcuHeight = rSrc.max_v_samp_factor * DCTSIZE;
+    JDIMENSION nWidth = rSrc.image_width;
+    JDIMENSION nHeight = rSrc.image_height;
+
+    if (bMirrorX)
+    {
+        nWidth -= nWidth % nMcuWidth;
+    }
+
+    if (bMirrorY)
+    {
+        nHeight -= nHeight % nMcuHeight;
+    }
+
+    if (nWidth == 0 || nHeight == 0)
+    {
+        strcpy(rSession.oError.aMessage, "image is smaller than one MCU");
+        return false;
+    }
+
+    rSession.nTrimmedColumns = rSrc.image_width - nWidth;
+    rSession.nTrimmedRows = rSrc.image_height - nHeight;
+
+    // source block extents of every component after trimming, and the
+    // destination coefficient arrays, requested before the source is read
+    JDIMENSION aBlocksX[MAX_COMPONENTS], aBlocksY[MAX_COMPONENTS];
+    JDIMENSION aDstRows[MAX_COMPONENTS];
+    jvirt_barray_ptr aDstArrays[MAX_COMPONENTS];
+
+    for (int c = 0; c < rSrc.num_components; ++c)
+    {
+        const jpeg_component_info &rComponent = rSrc.comp_info[c];
+        aBlocksX[c] =
+            (nWidth * rComponent.h_samp_factor + nMcuWidth - 1) / nMcuWidth;
+        aBlocksY[c] =
+            (nHeight * rComponent.v_samp_factor + nMcuHeight - 1) / nMcuHeight;
+
+        JDIMENSION nDstX = bTranspose ? aBlocksY[c] : aBlocksX[c];
+        JDIMENSION nDstY = bTranspose ? aBlocksX[c] : aBlocksY[c];
+        int nDstH = bTranspose ? rComponent.v_samp_factor : rComponent.h_samp_factor;
+        int nDstV = bTranspose ? rComponent.h_samp_factor : rComponent.v_samp_factor;
+        aDstRows[c] = roundUp(nDstY, nDstV);
+
+        // the whole destination stays accessible, the scatter hits any row;
+        // no pre-zeroing, the encoder never reads the MCU padding blocks
+        aDstArrays[c] = (*rSrc.mem->request_virt_barray)(
+            (j_common_ptr)&rSrc, JPOOL_IMAGE, FALSE, roundUp(nDstX, nDstH),
+            aDstRows[c], aDstRows[c]);
+    }
+
+    jvirt_barray_ptr *pSrcArrays = jpeg_read_coefficients(&rSrc);
+    const BlockMap oMap(rOrientation);
+
+    // walk the source in file order and scatter its blocks
+    for (int c = 0; c < rSrc.num_components; ++c)
+    {
+        const JDIMENSION nDstX = bTranspose ? aBlocksY[c] : aBlocksX[c];
+        const JDIMENSION nDstY = bTranspose ? aBlocksX[c] : aBlocksY[c];
+        JBLOCKARRAY pDst = (*rSrc.mem->access_virt_barray)(
+            (j_common_ptr)&rSrc, aDstArrays[c], 0, aDstRows[c], TRUE);
+
+        for (JDIMENSION nY = 0; nY < aBlocksY[c]; ++nY)
+        {
+            JBLOCKROW pSrcRow = (*rSrc.mem->access_virt_barray)(
+                (j_common_ptr)&rSrc, pSrcArrays[c], nY, 1, FALSE)[0];
+
+            for (JDIMENSION nX = 0; nX < aBlocksX[c]; ++nX)
+            {
+                JDIMENSION nTX = bTranspose ? nY : nX;
+                JDIMENSION nTY = bTranspose ? nX : nY;
+                JDIMENSION nOutX = rOrientation.bFlipX ? nDstX - 1 - nTX : nTX;
+                JDIMENSION nOutY = rOrientation.bFlipY ? nDstY - 1 - nTY : nTY;
+                oMap.apply(pSrcRow[nX], pDst[nOutY][nOutX]);
+            }
+        }
+    }
+
+    jpeg_copy_critical_parameters(&rSrc, &rDst);
+    rDst.image_width = bTranspose ? nHeight : nWidth;
+    rDst.image_height = bTranspose ? nWidth : nHeight;
+
+    if (bTranspose)
+    {
+        for (int c = 0; c < rDst.num_components; ++c)
+        {
+            jpeg_component_info &rComponent = rDst.comp_info[c];
+            int nH = rComponent.h_samp_factor;
+            rComponent.h_samp_factor = rComponent.v_samp_factor;
+            rComponent.v_samp_factor = nH;
+        }
+
+        for (int i = 0; i < NUM_QUANT_TBLS; ++i)
+        {
+            JQUANT_TBL *pTable = rDst.quant_tbl_ptrs[i];
+
+            for (int v = 0; pTable && v < DCTSIZE; ++v)
+            {
+                for (int u = v + 1; u < DCTSIZE; ++u)
+                {
+                    UINT16 *pValues = pTable->quantval;
+                    UINT16 nValue = pValues[v * DCTSIZE + u];
+                    pValues[v * DCTSIZE + u] = pValues[u * DCTSIZE + v];
+                    pValues[u * DCTSIZE + v] = nValue;
+                }
+            }
+        }
+    }
+
+    if (rSrc.progressive_mode)
+    {
+        jpeg_simple_progression(&rDst);
+    }
+
+    jpeg_stdio_dest(&rDst, rSession.pOut);
+    jpeg_write_coefficients(&rDst, aDstArrays);
+
+    // carry comments and application markers over, except the JFIF and
+    // Adobe markers libjpeg writes itself
+    for (jpeg_saved_marker_ptr pMarker = rSrc.marker_list; pMarker;
+         pMarker = pMarker->next)
+    {
+        bool bJfif = pMarker->marker == JPEG_APP0 && pMarker->data_length >= 5 &&
+                     memcmp(pMarker->data, "JFIF", 5) == 0;
+        bool bAdobe = pMarker->marker == JPEG_APP0 + 14 && pMarker->data_length >= 5 &&
+                      memcmp(pMarker->data, "Adobe", 5) == 0;
+
+        if ((bJfif && rDst.write_JFIF_header) || (bAdobe && rDst.write_Adobe_marker))
+        {
+            continue;
+        }
+
+        bool bBigEndian = false;
+        size_t nOffset = bResetExif && pMarker->marker == JPEG_APP0 + 1 ?
+                             exifOrientationOffset(pMarker->data, pMarker->data_length,
+                                                   bBigEndian) :
+                             0;
+
+        if (nOffset != 0)
+        {
+            pMarker->data[nOffset + (bBigEndian ? 0 : 1)] = 0;
+            pMarker->data[nOffset + (bBigEndian ? 1 : 0)] = 1;
+        }
+
+        jpeg_write_marker(&rDst, pMarker->marker, pMarker->data, pMarker->data_length);
+    }
+
+    jpeg_finish_compress(&rDst);
+    jpeg_finish_decompress(&rSrc);
+    return true;
+}
+
+} // namespace jpeg
+
+// Source columns and rows a lossless transformation dropped, see the file
+// comment.
+struct JpegTrim
+{
+    unsigned int nColumns;
+    unsigned int nRows;
+};
+
+// Writes inputName reoriented by rOrientation to outputName without
+// decoding the pixels, see the file comment.  bResetExif marks the result
+// upright when rOrientation already includes the EXIF orientation.
+inline JpegTrim transformJpeg(const std::string &inputName,
+                              const std::string &outputName,
+                              const Orientation &rOrientation, bool bResetExif = false)
+{
+    bool bDone = false;
+    JpegTrim oTrim = {0, 0};
+
+    {
+        jpeg::Session oSession;
+        oSession.pIn = fopen(inputName.c_str(), "rb");
+
+        if (!oSession.pIn)
+        {
+            throw npp::Exception("Could not open file: " + inputName);
+        }
+
+        oSession.pOut = fopen(outputName.c_str(), "wb");
+
+        if (!oSession.pOut)
+        {
+            throw npp::Exception("Could not open file for writing");
+        }
+
+        bDone = jpeg::transcode(oSession, rOrientation, bResetExif);
+
+        if (!bDone)
+        {
+            std::string sMessage = oSession.oError.aMessage;
+            fclose(oSession.pOut);
+            oSession.pOut = 0;
+            remove(outputName.c_str());
+            throw npp::Exception("JPEG: " + sMessage);
+        }
+
+        bDone = fflush(oSession.pOut) == 0 && !ferror(oSession.pOut);
+        oTrim.nColumns = oSession.nTrimmedColumns;
+        oTrim.nRows = oSession.nTrimmedRows;
+    }
+
+    if (!bDone)
+    {
+        throw npp::Exception("Could not write file: " + outputName);
+    }
+
+    return oTrim;
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_JPEG_TRANSFORM_H
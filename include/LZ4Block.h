@@ -0,0 +1,276 @@
+/* LZ4 block format encoder and decoder.
+ *
+ * Produces and consumes standard LZ4 blocks (no frame header), so payloads can
+ * be inspected with any LZ4 implementation.  The encoder is the single-probe
+ * hash variant with literal-run acceleration; it trades a little ratio for
+ * speed, which is what an intermediate hand-off format wants.
+ */
+
+#ifndef PIPELINE_LZ4_BLOCK_H
+#define PIPELINE_LZ4_BLOCK_H
+
+#include <Exceptions.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace pipeline
+{
+namespace lz4
+{
+
+static const size_t kMinMatch = 4;
+static const size_t kLastLiterals = 5;
+static const size_t kMatchFindLimit = 12;
+static const size_t kMaxOffset = 65535;
+static const unsigned int kHashLog = 14;
+
+inline size_t compressBound(size_t nSize)
+{
+    return nSize + nSize / 255 + 16;
+}
+
+inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t hash(uint32_t nSequence)
+{
+    return (nSequence * 2654435761u) >> (32 - kHashLog);
+}
+
+inline uint8_t *writeLength(uint8_t *pOut, size_t nLength)
+{
+    while (nLength >= 255)
+    {
+        *pOut++ = 255;
+        nLength -= 255;
+    }
+
+    *pOut++ = (uint8_t)nLength;
+    return pOut;
+}
+
+inline uint8_t *writeSequence(uint8_t *pOut, const uint8_t *pLiterals,
+                              size_t nLiterals, size_t nOffset, size_t nMatch)
+{
+    uint8_t *pToken = pOut++;
+    uint8_t nToken = 0;
+
+    if (nLiterals >= 15)
+    {
+        nToken = 15 << 4;
+        pOut = writeLength(pOut, nLiterals - 15);
+    }
+    else
+    {
+        nToken = (uint8_t)(nLiterals << 4);
+    }
+
+    memcpy(pOut, pLiterals, nLiterals);
+    pOut += nLiterals;
+
+    if (nMatch > 0)
+    {
+        *pOut++ = (uint8_t)(nOffset & 0xff);
+        *pOut++ = (uint8_t)(nOffset >> 8);
+
+        size_t nCode = nMatch - kMinMatch;
+
+        if (nCode >= 15)
+        {
+            nToken |= 15;
+            pOut = writeLength(pOut, nCode - 15);
+        }
+        else
+        {
+            nToken |= (uint8_t)nCode;
+        }
+    }
+
+    *pToken = nToken;
+    return pOut;
+}
+
+// Compresses nSize bytes into pDst, which must hold compressBound(nSize)
+// bytes.  Returns the compressed size.
+inline size_t compress(const uint8_t *pSrc, size_t nSize, uint8_t *pDst)
+{
+    uint8_t *pOut = pDst;
+    size_t nAnchor = 0;
+
+    if (nSize > kMatchFindLimit)
+    {
+        std::vector<uint32_t> aTable(1u << kHashLog, 0);
+        const size_t nLimit = nSize - kMatchFindLimit;
+        const size_t nMatchLimit = nSize - kLastLiterals;
+        size_t nPos = 0;
+
+        while (nPos < nLimit)
+        {
+            uint32_t nSequence = read32(pSrc + nPos);
+            uint32_t &rSlot = aTable[hash(nSequence)];
+            size_t nRef = rSlot;
+            rSlot = (uint32_t)nPos;
+
+            if (nRef < nPos && nPos - nRef <= kMaxOffset &&
+                read32(pSrc + nRef) == nSequence)
+            {
+                // extend the match backwards over pending literals
+                while (nPos > nAnchor && nRef > 0 &&
+                       pSrc[nPos - 1] == pSrc[nRef - 1])
+                {
+                    --nPos;
+                    --nRef;
+                }
+
+                size_t nLength = kMinMatch;
+
+                while (nPos + nLength < nMatchLimit &&
+                       pSrc[nRef + nLength] == pSrc[nPos + nLength])
+                {
+                    ++nLength;
+                }
+
+                pOut = writeSequence(pOut, pSrc + nAnchor, nPos - nAnchor,
+                                     nPos - nRef, nLength);
+                nPos += nLength;
+                nAnchor = nPos;
+
+                if (nPos - 2 < nLimit)
+                {
+                    aTable[hash(read32(pSrc + nPos - 2))] = (uint32_t)(nPos - 2);
+                }
+            }
+            else
+            {
+                // skip faster through incompressible data
+                nPos += 1 + ((nPos - nAnchor) >> 6);
+            }
+        }
+    }
+
+    pOut = writeSequence(pOut, pSrc + nAnchor, nSize - nAnchor, 0, 0);
+    return (size_t)(pOut - pDst);
+}
+
+// Decompresses a block that must expand to exactly nDstSize bytes.
+inline void decompress(const uint8_t *pSrc, size_t nSrcSize, uint8_t *pDst,
+                       size_t nDstSize)
+{
+    const uint8_t *pIn = pSrc;
+    const uint8_t *pInEnd = pSrc + nSrcSize;
+    uint8_t *pOut = pDst;
+    uint8_t *pOutEnd = pDst + nDstSize;
+
+    for (;;)
+    {
+        if (pIn >= pInEnd)
+        {
+            throw npp::Exception("LZ4: truncated block");
+        }
+
+        unsigned int nToken = *pIn++;
+        size_t nLiterals = nToken >> 4;
+
+        if (nLiterals == 15)
+        {
+            unsigned int nByte;
+
+            do
+            {
+                if (pIn >= pInEnd)
+                {
+                    throw npp::Exception("LZ4: truncated literal length");
+                }
+
+                nByte = *pIn++;
+                nLiterals += nByte;
+            } while (nByte == 255);
+        }
+
+        if ((size_t)(pInEnd - pIn) < nLiterals ||
+            (size_t)(pOutEnd - pOut) < nLiterals)
+        {
+            throw npp::Exception("LZ4: literal run out of bounds");
+        }
+
+        memcpy(pOut, pIn, nLiterals);
+        pIn += nLiterals;
+        pOut += nLiterals;
+
+        if (pIn == pInEnd)
+        {
+            break;
+        }
+
+        if (pInEnd - pIn < 2)
+        {
+            throw npp::Exception("LZ4: truncated match offset");
+        }
+
+        size_t nOffset = pIn[0] | ((size_t)pIn[1] << 8);
+        pIn += 2;
+
+        if (nOffset == 0 || nOffset > (size_t)(pOut - pDst))
+        {
+            throw npp::Exception("LZ4: invalid match offset");
+        }
+
+        size_t nMatch = nToken & 15;
+
+        if (nMatch == 15)
+        {
+            unsigned int nByte;
+
+            do
+            {
+                if (pIn >= pInEnd)
+                {
+                    throw npp::Exception("LZ4: truncated match length");
+                }
+
+                nByte = *pIn++;
+                nMatch += nByte;
+            } while (nByte == 255);
+        }
+
+        nMatch += kMinMatch;
+
+        if ((size_t)(pOutEnd - pOut) < nMatch)
+        {
+            throw npp::Exception("LZ4: match out of bounds");
+        }
+
+        const uint8_t *pRef = pOut - nOffset;
+
+        if (nOffset >= nMatch)
+        {
+            memcpy(pOut, pRef, nMatch);
+            pOut += nMatch;
+        }
+        else
+        {
+            // overlapping copy replicates the last nOffset bytes
+            for (size_t i = 0; i < nMatch; ++i)
+            {
+                *pOut++ = *pRef++;
+            }
+        }
+    }
+
+    if (pOut != pOutEnd)
+    {
+        throw npp::Exception("LZ4: block decoded to the wrong size");
+    }
+}
+
+} // namespace lz4
+} // namespace pipeline
+
+#endif // PIPELINE_LZ4_BLOCK_H
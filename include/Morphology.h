@@ -0,0 +1,261 @@
+/* Grayscale morphology with rectangular structuring elements.
+ *
+ * Erosion is the minimum and dilation the maximum over a k_w x k_h window;
+ * opening and closing chain the two.  Rectangles are separable, and each 1D
+ * pass uses the van Herk/Gil-Werman scheme: the padded line is cut into
+ * blocks of k samples, running prefix (g) and suffix (h) extrema are taken
+ * inside every block, and the extremum over any window is op(h[i],
+ * g[i + k - 1]).  That is three operations per sample whatever the size of k.
+ *
+ * The vertical pass treats whole rows as the samples, so its inner loops run
+ * along x over contiguous bytes and vectorize.  It works on column strips
+ * and emits each output row as soon as the block holding the end of its
+ * window is done, so only g of one block and h of two, 3k strip rows, are
+ * live whatever the image height.  Pixels outside the image act as the neutral
+ * value (255 for erosion, 0 for dilation).
+ */
+
+#ifndef PIPELINE_MORPHOLOGY_H
+#define PIPELINE_MORPHOLOGY_H
+
+#include <Exceptions.h>
+
+#include "ImageView.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace pipeline
+{
+
+enum MorphOperation
+{
+    MORPH_ERODE,
+    MORPH_DILATE,
+    MORPH_OPEN,
+    MORPH_CLOSE
+};
+
+namespace detail
+{
+
+struct MinOp
+{
+    static unsigned char neutral()
+    {
+        return 255;
+    }
+
+    static unsigned char apply(unsigned char a, unsigned char b)
+    {
+        return a < b ? a : b;
+    }
+};
+
+struct MaxOp
+{
+    static unsigned char neutral()
+    {
+        return 0;
+    }
+
+    static unsigned char apply(unsigned char a, unsigned char b)
+    {
+        return a > b ? a : b;
+    }
+};
+
+// Column strip width of the vertical pass.
+static const unsigned int kMorphStrip = 512;
+
+// Window [i - nK / 2, i - nK / 2 + nK) along every row, or its reflection
+// [i - (nK - 1) / 2, ...) when bReflect.
+template <class Op>
+void vhgwHorizontal(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                    unsigned int nK, bool bReflect, unsigned int nThreads)
+{
+    const unsigned int nWidth = oSrc.width();
+    const unsigned int nBefore = bReflect ? (nK - 1) / 2 : nK / 2;
+    const size_t nPadded = (nWidth + nK - 1 + nK - 1) / nK * nK;
+
+    // per worker: padded line, g and h; the padding stays neutral
+    std::vector<std::vector<unsigned char> > aScratch(
+        workerCount(oSrc.height(), nThreads),
+        std::vector<unsigned char>(3 * nPadded, Op::neutral()));
+
+    parallelForWorkers(oSrc.height(), [&](size_t y, unsigned int nWorker)
+    {
+        unsigned char *aLine = aScratch[nWorker].data();
+        unsigned char *aG = aLine + nPadded;
+        unsigned char *aH = aG + nPadded;
+        memcpy(aLine + nBefore, oSrc.row((unsigned int)y), nWidth);
+
+        for (size_t b = 0; b < nPadded; b += nK)
+        {
+            aG[b] = aLine[b];
+
+            for (size_t j = b + 1; j < b + nK; ++j)
+            {
+                aG[j] = Op::apply(aG[j - 1], aLine[j]);
+            }
+
+            aH[b + nK - 1] = aLine[b + nK - 1];
+
+            for (size_t j = b + nK - 1; j-- > b;)
+            {
+                aH[j] = Op::apply(aH[j + 1], aLine[j]);
+            }
+        }
+
+        unsigned char *pOut = oDst.row((unsigned int)y);
+
+        for (unsigned int i = 0; i < nWidth; ++i)
+        {
+            pOut[i] = Op::apply(aH[i], aG[i + nK - 1]);
+        }
+    }, nThreads);
+}
+
+// Window [y - nK / 2, y - nK / 2 + nK) along every column, or its
+// reflection [y - (nK - 1) / 2, ...) when bReflect.
+template <class Op>
+void vhgwVertical(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                  unsigned int nK, bool bReflect, unsigned int nThreads)
+{
+    const unsigned int nHeight = oSrc.height();
+    const unsigned int nBefore = bReflect ? (nK - 1) / 2 : nK / 2;
+    const size_t nPadded = (nHeight + nK - 1 + nK - 1) / nK * nK;
+    const unsigned int nStrips = (oSrc.width() + kMorphStrip - 1) / kMorphStrip;
+
+    parallelFor(nStrips, [&](size_t iStrip)
+    {
+        const unsigned int nX0 = (unsigned int)iStrip * kMorphStrip;
+        const unsigned int nW = std::min(kMorphStrip, oSrc.width() - nX0);
+        std::vector<unsigned char> aNeutral(nW, Op::neutral());
+        // g of the current block, h of the current and the previous one (by
+        // block parity): the output rows that end in this block need no more
+        std::vector<unsigned char> aG(nK * nW), aH(2 * nK * nW);
+
+        // padded line j is source row j - nBefore, or neutral outside
+        auto line = [&](size_t j) -> const unsigned char *
+        {
+            return (j < nBefore || j >= nBefore + nHeight)
+                       ? aNeutral.data()
+                       : oSrc.row((unsigned int)(j - nBefore)) + nX0;
+        };
+
+        auto hRow = [&](size_t j) -> unsigned char *
+        {
+            return &aH[((j / nK) & 1) * nK * nW + (j % nK) * nW];
+        };
+
+        for (size_t b = 0; b < nPadded; b += nK)
+        {
+            memcpy(&aG[0], line(b), nW);
+
+            for (size_t j = b + 1; j < b + nK; ++j)
+            {
+                const unsigned char *pIn = line(j);
+                const unsigned char *pPrev = &aG[(j - 1 - b) * nW];
+                unsigned char *pOut = &aG[(j - b) * nW];
+
+                for (unsigned int x = 0; x < nW; ++x)
+                {
+                    pOut[x] = Op::apply(pPrev[x], pIn[x]);
+                }
+            }
+
+            memcpy(hRow(b + nK - 1), line(b + nK - 1), nW);
+
+            for (size_t j = b + nK - 1; j-- > b;)
+            {
+                const unsigned char *pIn = line(j);
+                const unsigned char *pNext = hRow(j + 1);
+                unsigned char *pOut = hRow(j);
+
+                for (unsigned int x = 0; x < nW; ++x)
+                {
+                    pOut[x] = Op::apply(pNext[x], pIn[x]);
+                }
+            }
+
+            // rows y whose window ends in this block, at y + nK - 1
+            for (size_t y = b + 1 < nK ? 0 : b + 1 - nK; y <= b && y < nHeight; ++y)
+            {
+                const unsigned char *pH = hRow(y);
+                const unsigned char *pG = &aG[(y + nK - 1 - b) * nW];
+                unsigned char *pOut = oDst.row((unsigned int)y) + nX0;
+
+                for (unsigned int x = 0; x < nW; ++x)
+                {
+                    pOut[x] = Op::apply(pH[x], pG[x]);
+                }
+            }
+        }
+    }, nThreads);
+}
+
+template <class Op>
+void rectFilter(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                unsigned int nWidth, unsigned int nHeight, bool bReflect,
+                unsigned int nThreads)
+{
+    ImageBuffer_8u_C1 oTemp(oSrc.width(), oSrc.height());
+    vhgwHorizontal<Op>(oSrc, oTemp.view(), nWidth, bReflect, nThreads);
+    vhgwVertical<Op>(oTemp.view(), oDst, nHeight, bReflect, nThreads);
+}
+
+} // namespace detail
+
+// Applies eOperation with a nWidth x nHeight rectangle centred on each pixel
+// (for even sizes the extra row/column lies before it).  The second pass of
+// an opening or closing uses the reflected rectangle, so that opening stays
+// anti-extensive and closing extensive for even sizes too.  oDst may alias
+// oSrc.
+inline void morphology(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                       MorphOperation eOperation, unsigned int nWidth,
+                       unsigned int nHeight, unsigned int nThreads = 0)
+{
+    if (nWidth == 0 || nHeight == 0)
+    {
+        throw npp::Exception("Morphology: structuring element is empty");
+    }
+
+    if (oDst.width() != oSrc.width() || oDst.height() != oSrc.height())
+    {
+        throw npp::Exception("Morphology: source and destination sizes differ");
+    }
+
+    switch (eOperation)
+    {
+    case MORPH_ERODE:
+        detail::rectFilter<detail::MinOp>(oSrc, oDst, nWidth, nHeight, false,
+                                          nThreads);
+        break;
+
+    case MORPH_DILATE:
+        detail::rectFilter<detail::MaxOp>(oSrc, oDst, nWidth, nHeight, false,
+                                          nThreads);
+        break;
+
+    case MORPH_OPEN:
+        detail::rectFilter<detail::MinOp>(oSrc, oDst, nWidth, nHeight, false,
+                                          nThreads);
+        detail::rectFilter<detail::MaxOp>(oDst, oDst, nWidth, nHeight, true,
+                                          nThreads);
+        break;
+
+    case MORPH_CLOSE:
+        detail::rectFilter<detail::MaxOp>(oSrc, oDst, nWidth, nHeight, false,
+                                          nThreads);
+        detail::rectFilter<detail::MinOp>(oDst, oDst, nWidth, nHeight, true,
+                                          nThreads);
+        break;
+    }
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_MORPHOLOGY_H
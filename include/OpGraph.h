@@ -0,0 +1,651 @@
+/* Lazy chains of image operations, fused before anything is executed.
+ *
+ * Operations are only recorded.  Geometric ones (crop, rotate, flip,
+ * transpose, scale) are composed into the affine map of the current stage,
+ * together with the canvas they leave behind; point operations (invert,
+ * gamma, levels, threshold) are composed into the stage's 256-entry lookup
+ * table.  execute() then runs every stage as a single tiled warp whose
+ * epilogue applies the table to each row while it is still in L1, so a whole
+ * chain of geometric and point operations reads the source once and writes
+ * the result once.
+ *
+ * Point operations commute with nearest neighbour sampling but not with
+ * interpolation, and a geometric operation must not push the background it
+ * uncovers through an earlier table.  So a geometric operation that follows a
+ * table opens a new stage unless sampling is nearest neighbour and the table
+ * keeps the background value.  Morphology needs neighbourhoods and always runs
+ * as a stage of its own.  A crop limits what the stage's warp samples to the
+ * cropped input rectangle, so later geometry sees background, not the pixels
+ * cut away; a crop after a rotation or scale cuts no input rectangle and
+ * ends the stage instead.  explain() describes the stages that will run.
+ */
+
+#ifndef PIPELINE_OP_GRAPH_H
+#define PIPELINE_OP_GRAPH_H
+
+#include <Exceptions.h>
+
+#include "ImageStats.h"
+#include "ImageView.h"
+#include "Morphology.h"
+#include "Parallel.h"
+#include "RotateCPU.h"
+#include "RotateGeometry.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace pipeline
+{
+
+class OpGraph
+{
+public:
+    // rOptions selects interpolation, tiling and threads of every warp.
+    explicit OpGraph(ImageConstView_8u_C1 oSrc,
+                     const RotateOptions &rOptions = RotateOptions())
+        : oSrc_(oSrc), oOptions_(rOptions)
+    {
+        aStages_.push_back(Stage(oSrc.width(), oSrc.height()));
+    }
+
+    // Output rectangle nWidth x nHeight at (nX, nY) of the current canvas.
+    OpGraph &crop(int nX, int nY, unsigned int nWidth, unsigned int nHeight)
+    {
+        Stage &rStage = geometricStage();
+        clip(rStage, nX, nY, nWidth, nHeight);
+        rStage.oTransform = AffineTransform::translation(-nX, -nY) *
+                            rStage.oTransform;
+        rStage.nWidth = nWidth;
+        rStage.nHeight = nHeight;
+        return note(rStage, "crop", describe(nX, nY, nWidth, nHeight));
+    }
+
+    OpGraph &rotate(double nAngle)
+    {
+        Stage &rStage = geometricStage();
+        RotateGeometry oGeometry =
+            makeRotateGeometry(rStage.nWidth, rStage.nHeight, nAngle);
+        rStage.oTransform = oGeometry.oForward * rStage.oTransform;
+        rStage.nWidth = oGeometry.nDstWidth;
+        rStage.nHeight = oGeometry.nDstHeight;
+        return note(rStage, "rotate", describe(nAngle));
+    }
+
+    OpGraph &orient(const Orientation &rOrientation)
+    {
+        Stage &rStage = geometricStage();
+        unsigned int nWidth = rStage.nWidth;
+        unsigned int nHeight = rStage.nHeight;
+        rStage.oTransform = rOrientation.transform(nWidth, nHeight) *
+                            rStage.oTransform;
+        rStage.nWidth = rOrientation.width(nWidth, nHeight);
+        rStage.nHeight = rOrientation.height(nWidth, nHeight);
+
+        std::string sFlip = std::string(rOrientation.bFlipX ? "h" : "") +
+                            (rOrientation.bFlipY ? "v" : "");
+
+        if (rOrientation.bTranspose)
+        {
+            note(rStage, "transpose", "");
+        }
+
+        return sFlip.empty() ? *this : note(rStage, "flip", sFlip);
+    }
+
+    // Scales the canvas by (nX, nY), rounded to whole pixels.
+    OpGraph &scale(double nX, double nY)
+    {
+        Stage &rStage = geometricStage();
+        double nWidth = std::max(1.0, std::floor(rStage.nWidth * nX + 0.5));
+        double nHeight = std::max(1.0, std::floor(rStage.nHeight * nY + 0.5));
+        rStage.oTransform = AffineTransform::scale(nWidth / rStage.nWidth,
+                                                   nHeight / rStage.nHeight) *
+                            rStage.oTransform;
+        rStage.nWidth = (unsigned int)nWidth;
+        rStage.nHeight = (unsigned int)nHeight;
+        return note(rStage, "scale", describe(nX, nY));
+    }
+
+    OpGraph &invert()
+    {
+        return point("invert", "", [](double v) { return 255.0 - v; });
+    }
+
+    OpGraph &gamma(double nGamma)
+    {
+        return point("gamma", describe(nGamma), [nGamma](double v)
+                     { return 255.0 * std::pow(v / 255.0, 1.0 / nGamma); });
+    }
+
+    // v -> nGain * v + nOffset
+    OpGraph &levels(double nGain, double nOffset)
+    {
+        return point("levels", describe(nGain, nOffset),
+                     [nGain, nOffset](double v) { return nGain * v + nOffset; });
+    }
+
+    // Pixels <= nLevel become 0, all others 255.
+    OpGraph &threshold(int nLevel)
+    {
+        return point("threshold", describe(nLevel), [nLevel](double v)
+                     { return v <= nLevel ? 0.0 : 255.0; });
+    }
+
+    OpGraph &morphology(MorphOperation eOperation, unsigned int nWidth,
+                        unsigned int nHeight)
+    {
+        static const char *aNames[] = {"erode", "dilate", "open", "close"};
+        const Stage &rLast = aStages_.back();
+        Stage oStage(rLast.nWidth, rLast.nHeight);
+        oStage.bMorph = true;
+        oStage.eMorph = eOperation;
+        oStage.nElementWidth = nWidth;
+        oStage.nElementHeight = nHeight;
+        aStages_.push_back(oStage);
+        return note(aStages_.back(), std::string("morph:") + aNames[eOperation],
+                    describe(nWidth) + "x" + describe(nHeight));
+    }
+
+    // Appends operations written as "op:args;op:args;...", e.g.
+    // "crop:0,0,640,480;rotate:30;flip:h;scale:0.5;gamma:2.2".
+    OpGraph &parse(const std::string &sOps)
+    {
+        std::stringstream oStream(sOps);
+        std::string sOp;
+
+        while (std::getline(oStream, sOp, ';'))
+        {
+            if (!sOp.empty())
+            {
+                parseOne(sOp);
+            }
+        }
+
+        return *this;
+    }
+
+    unsigned int width() const
+    {
+        return aStages_.back().nWidth;
+    }
+
+    unsigned int height() const
+    {
+        return aStages_.back().nHeight;
+    }
+
+    // Human readable plan of the stages execute() will run.
+    std::string explain() const
+    {
+        std::ostringstream oOut;
+        std::vector<size_t> aActive = activeStages();
+        unsigned int nWidth = oSrc_.width();
+        unsigned int nHeight = oSrc_.height();
+
+        oOut << "source " << nWidth << "x" << nHeight << "\n";
+
+        for (size_t i = 0; i < aActive.size(); ++i)
+        {
+            const Stage &rStage = aStages_[aActive[i]];
+            oOut << "stage " << i + 1 << ": ";
+
+            if (rStage.bMorph)
+            {
+                oOut << "morphology " << nWidth << "x" << nHeight;
+            }
+            else if (rStage.isIdentity(nWidth, nHeight))
+            {
+                oOut << "lookup table " << nWidth << "x" << nHeight;
+            }
+            else
+            {
+                const AffineTransform &rT = rStage.oTransform;
+                oOut << "warp " << nWidth << "x" << nHeight << " -> " << rStage.nWidth
+                     << "x" << rStage.nHeight << ", "
+                     << (oOptions_.eInterpolation == INTER_LINEAR ? "bilinear"
+                                                                  : "nearest")
+                     << (rStage.bHasTable ? ", lookup table in the epilogue" : "");
+
+                if (rStage.bClip)
+                {
+                    oOut << ", source clip " << rStage.nClipX << "," << rStage.nClipY
+                         << " " << rStage.nClipWidth << "x" << rStage.nClipHeight;
+                }
+
+                oOut
+                     << "\n  affine [" << describe(rT.a) << " " << describe(rT.b) << " "
+                     << describe(rT.c) << "; " << describe(rT.d) << " "
+                     << describe(rT.e) << " " << describe(rT.f) << "]";
+            }
+
+            oOut << "\n  fuses";
+
+            for (size_t k = 0; k < rStage.aNotes.size(); ++k)
+            {
+                oOut << " " << rStage.aNotes[k];
+            }
+
+            oOut << "\n";
+            nWidth = rStage.nWidth;
+            nHeight = rStage.nHeight;
+        }
+
+        if (aActive.empty())
+        {
+            oOut << "no stages, the result is a copy of the source\n";
+        }
+
+        return oOut.str();
+    }
+
+    // Runs the plan.  With pStats the statistics of the result are gathered
+    // by the last stage's epilogue.
+    ImageBuffer_8u_C1 execute(ImageStats *pStats = 0) const
+    {
+        std::vector<size_t> aActive = activeStages();
+        ImageBuffer_8u_C1 oResult;
+        ImageConstView_8u_C1 oInput = oSrc_;
+        StatsEpilogue oStats;
+
+        if (aActive.empty())
+        {
+            // nothing fused: copy, still through the epilogue for --stats
+            oResult = ImageBuffer_8u_C1(oSrc_.width(), oSrc_.height());
+            TableEpilogue oEpilogue(0, pStats ? &oStats : 0);
+            applyTable(oSrc_, oResult.view(), oEpilogue);
+        }
+
+        for (size_t i = 0; i < aActive.size(); ++i)
+        {
+            const Stage &rStage = aStages_[aActive[i]];
+            bool bLast = i + 1 == aActive.size();
+            ImageBuffer_8u_C1 oOutput(rStage.nWidth, rStage.nHeight);
+            TableEpilogue oEpilogue(rStage.bHasTable ? rStage.aTable : 0,
+                                    bLast && pStats ? &oStats : 0);
+
+            if (rStage.bMorph)
+            {
+                pipeline::morphology(oInput, oOutput.view(), rStage.eMorph,
+                                     rStage.nElementWidth, rStage.nElementHeight,
+                                     oOptions_.nThreads);
+            }
+            else if (rStage.isIdentity(oInput.width(), oInput.height()))
+            {
+                applyTable(oInput, oOutput.view(), oEpilogue);
+            }
+            else if (rStage.bClip)
+            {
+                AffineTransform oTransform =
+                    rStage.oTransform *
+                    AffineTransform::translation(rStage.nClipX, rStage.nClipY);
+                warpAffine(oInput.crop(rStage.nClipX, rStage.nClipY, rStage.nClipWidth,
+                                       rStage.nClipHeight),
+                           oOutput.view(), oTransform.inverse(), oOptions_, oEpilogue);
+            }
+            else
+            {
+                warpAffine(oInput, oOutput.view(), rStage.oTransform.inverse(),
+                           oOptions_, oEpilogue);
+            }
+
+            oResult = std::move(oOutput);
+            oInput = oResult.view();
+        }
+
+        if (pStats)
+        {
+            bool bMorphLast = !aActive.empty() && aStages_[aActive.back()].bMorph;
+            *pStats = bMorphLast ? computeStats(oResult.view()) : oStats.result();
+        }
+
+        return oResult;
+    }
+
+private:
+    struct Stage
+    {
+        AffineTransform oTransform; // input to output pixel coordinates
+        unsigned int nWidth, nHeight;
+        // the input rectangle the warp samples when a crop narrowed it
+        bool bClip;
+        unsigned int nClipX, nClipY, nClipWidth, nClipHeight;
+        // a crop that is no input rectangle ends the stage's geometry
+        bool bClosed;
+        bool bHasTable;
+        unsigned char aTable[256];
+        bool bMorph;
+        MorphOperation eMorph;
+        unsigned int nElementWidth, nElementHeight;
+        std::vector<std::string> aNotes;
+
+        Stage(unsigned int nCanvasWidth, unsigned int nCanvasHeight)
+            : oTransform(AffineTransform::identity()), nWidth(nCanvasWidth),
+              nHeight(nCanvasHeight), bClip(false), nClipX(0), nClipY(0),
+              nClipWidth(0), nClipHeight(0), bClosed(false), bHasTable(false),
+              bMorph(false),
+              eMorph(MORPH_ERODE), nElementWidth(0), nElementHeight(0)
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                aTable[i] = (unsigned char)i;
+            }
+        }
+
+        // no geometric change relative to an nInputWidth x nInputHeight input
+        bool isIdentity(unsigned int nInputWidth, unsigned int nInputHeight) const
+        {
+            const AffineTransform &rT = oTransform;
+            return !bClip && rT.a == 1.0 && rT.b == 0.0 && rT.c == 0.0 &&
+                   rT.d == 0.0 && rT.e == 1.0 && rT.f == 0.0 &&
+                   nWidth == nInputWidth && nHeight == nInputHeight;
+        }
+
+        bool isPassThrough(unsigned int nInputWidth,
+                           unsigned int nInputHeight) const
+        {
+            return !bHasTable && isIdentity(nInputWidth, nInputHeight);
+        }
+    };
+
+    // Applies the stage's table (if any) to each finished row and feeds the
+    // statistics of the result.
+    class TableEpilogue
+    {
+    public:
+        TableEpilogue(const unsigned char *pTable, StatsEpilogue *pStats)
+            : pTable_(pTable), pStats_(pStats)
+        {
+        }
+
+        void prepare(unsigned int nWorkers)
+        {
+            if (pStats_)
+            {
+                pStats_->prepare(nWorkers);
+            }
+        }
+
+        void row(unsigned int nWorker, unsigned int nX, unsigned int nY,
+                 unsigned char *pRow, unsigned int nCount)
+        {
+            if (pTable_)
+            {
+                for (unsigned int i = 0; i < nCount; ++i)
+                {
+                    pRow[i] = pTable_[pRow[i]];
+                }
+            }
+
+            if (pStats_)
+            {
+                pStats_->row(nWorker, nX, nY, pRow, nCount);
+            }
+        }
+
+    private:
+        const unsigned char *pTable_;
+        StatsEpilogue *pStats_;
+    };
+
+    void applyTable(ImageConstView_8u_C1 oInput, ImageView_8u_C1 oOutput,
+                    TableEpilogue &rEpilogue) const
+    {
+        const unsigned int nBand = 64;
+        const size_t nBands = (oInput.height() + nBand - 1) / nBand;
+        rEpilogue.prepare(workerCount(nBands, oOptions_.nThreads));
+
+        parallelForWorkers(nBands, [&](size_t iBand, unsigned int nWorker)
+        {
+            unsigned int nY0 = (unsigned int)iBand * nBand;
+            unsigned int nY1 = std::min(oInput.height(), nY0 + nBand);
+
+            for (unsigned int y = nY0; y < nY1; ++y)
+            {
+                memcpy(oOutput.row(y), oInput.row(y), oInput.width());
+                rEpilogue.row(nWorker, 0, y, oOutput.row(y), oInput.width());
+            }
+        }, oOptions_.nThreads);
+    }
+
+    // Stages that change anything; the others are skipped.
+    std::vector<size_t> activeStages() const
+    {
+        std::vector<size_t> aActive;
+        unsigned int nWidth = oSrc_.width();
+        unsigned int nHeight = oSrc_.height();
+
+        for (size_t i = 0; i < aStages_.size(); ++i)
+        {
+            if (aStages_[i].bMorph || !aStages_[i].isPassThrough(nWidth, nHeight))
+            {
+                aActive.push_back(i);
+            }
+
+            nWidth = aStages_[i].nWidth;
+            nHeight = aStages_[i].nHeight;
+        }
+
+        return aActive;
+    }
+
+    // The stage a geometric operation joins: the current one, unless it is a
+    // morphology stage, or its table would be sampled through by interpolation
+    // or change the background the new operation uncovers.
+    Stage &geometricStage()
+    {
+        const Stage &rLast = aStages_.back();
+        const unsigned char nBackground = oOptions_.nBackground;
+        bool bTableCommutes = oOptions_.eInterpolation == INTER_NN &&
+                              rLast.aTable[nBackground] == nBackground;
+
+        if (rLast.bMorph || rLast.bClosed || (rLast.bHasTable && !bTableCommutes))
+        {
+            aStages_.push_back(Stage(rLast.nWidth, rLast.nHeight));
+        }
+
+        return aStages_.back();
+    }
+
+    // Makes the warp of rStage sample only the input pixels under the crop
+    // rectangle of its canvas, as a warp of the cropped image would.  That
+    // rectangle is a rectangle of whole input pixels while the stage only
+    // translates, mirrors and transposes; otherwise the stage's geometry
+    // ends with the crop and further geometry goes to a new stage.
+    void clip(Stage &rStage, int nX, int nY, unsigned int nWidth, unsigned int nHeight)
+    {
+        const AffineTransform &rT = rStage.oTransform;
+        bool bPixelExact = std::fabs(rT.a) + std::fabs(rT.b) == 1.0 &&
+                           std::fabs(rT.d) + std::fabs(rT.e) == 1.0 &&
+                           std::fabs(rT.a) + std::fabs(rT.d) == 1.0 &&
+                           rT.c == std::floor(rT.c) && rT.f == std::floor(rT.f);
+
+        // the stage's input is the source or the previous stage's result
+        const size_t iStage = &rStage - &aStages_[0];
+        const unsigned int nInputWidth =
+            iStage == 0 ? oSrc_.width() : aStages_[iStage - 1].nWidth;
+        const unsigned int nInputHeight =
+            iStage == 0 ? oSrc_.height() : aStages_[iStage - 1].nHeight;
+
+        double nX0 = 0.0, nY0 = 0.0, nX1 = 0.0, nY1 = 0.0;
+        AffineTransform oInverse = rT.inverse();
+        oInverse.apply(nX, nY, nX0, nY0);
+        oInverse.apply((double)nX + nWidth, (double)nY + nHeight, nX1, nY1);
+
+        // intersected with the input and any earlier clip
+        double nLeft = std::max(0.0, std::min(nX0, nX1));
+        double nTop = std::max(0.0, std::min(nY0, nY1));
+        double nRight = std::min((double)nInputWidth, std::max(nX0, nX1));
+        double nBottom = std::min((double)nInputHeight, std::max(nY0, nY1));
+
+        if (rStage.bClip)
+        {
+            nLeft = std::max(nLeft, (double)rStage.nClipX);
+            nTop = std::max(nTop, (double)rStage.nClipY);
+            nRight = std::min(nRight, (double)rStage.nClipX + rStage.nClipWidth);
+            nBottom = std::min(nBottom, (double)rStage.nClipY + rStage.nClipHeight);
+        }
+
+        if (!bPixelExact || nLeft >= nRight || nTop >= nBottom)
+        {
+            rStage.bClosed = true;
+            return;
+        }
+
+        if (nLeft == 0.0 && nTop == 0.0 && nRight == nInputWidth &&
+            nBottom == nInputHeight)
+        {
+            return;
+        }
+
+        rStage.bClip = true;
+        rStage.nClipX = (unsigned int)nLeft;
+        rStage.nClipY = (unsigned int)nTop;
+        rStage.nClipWidth = (unsigned int)(nRight - nLeft);
+        rStage.nClipHeight = (unsigned int)(nBottom - nTop);
+    }
+
+    template <class F>
+    OpGraph &point(const std::string &sName, const std::string &sArgs,
+                   const F &rMap)
+    {
+        if (aStages_.back().bMorph)
+        {
+            const Stage &rLast = aStages_.back();
+            aStages_.push_back(Stage(rLast.nWidth, rLast.nHeight));
+        }
+
+        Stage &rStage = aStages_.back();
+
+        for (int i = 0; i < 256; ++i)
+        {
+            double nValue = std::floor(rMap((double)rStage.aTable[i]) + 0.5);
+            rStage.aTable[i] = (unsigned char)std::max(0.0, std::min(255.0, nValue));
+        }
+
+        rStage.bHasTable = true;
+        return note(rStage, sName, sArgs);
+    }
+
+    OpGraph &note(Stage &rStage, const std::string &sName, const std::string &sArgs)
+    {
+        rStage.aNotes.push_back(sArgs.empty() ? sName : sName + ":" + sArgs);
+        return *this;
+    }
+
+    static std::string describe(double nA)
+    {
+        std::ostringstream oOut;
+        oOut << nA + 0.0; // no "-0"
+        return oOut.str();
+    }
+
+    static std::string describe(double nA, double nB)
+    {
+        return describe(nA) + "," + describe(nB);
+    }
+
+    static std::string describe(double nA, double nB, double nC, double nD)
+    {
+        return describe(nA, nB) + "," + describe(nC, nD);
+    }
+
+    void parseOne(const std::string &sOp)
+    {
+        std::string::size_type nColon = sOp.find(':');
+        std::string sName = sOp.substr(0, nColon);
+        std::string sArgs = nColon == std::string::npos ? "" : sOp.substr(nColon + 1);
+        double a = 0.0, b = 0.0;
+        int aRect[4];
+        unsigned int nW = 0, nH = 0;
+
+        if (sName == "crop" && sscanf(sArgs.c_str(), "%d,%d,%d,%d", &aRect[0],
+                                      &aRect[1], &aRect[2], &aRect[3]) == 4 &&
+            aRect[2] > 0 && aRect[3] > 0)
+        {
+            crop(aRect[0], aRect[1], aRect[2], aRect[3]);
+        }
+        else if (sName == "rotate" && sscanf(sArgs.c_str(), "%lf", &a) == 1)
+        {
+            rotate(a);
+        }
+        else if (sName == "flip" && (sArgs == "h" || sArgs == "v" || sArgs == "hv"))
+        {
+            orient(Orientation(false, sArgs.find('h') != std::string::npos,
+                               sArgs.find('v') != std::string::npos));
+        }
+        else if (sName == "transpose")
+        {
+            orient(Orientation::transpose());
+        }
+        else if (sName == "scale" &&
+                 sscanf(sArgs.c_str(), "%lf,%lf", &a, &b) >= 1 && a > 0.0)
+        {
+            scale(a, b > 0.0 ? b : a);
+        }
+        else if (sName == "invert")
+        {
+            invert();
+        }
+        else if (sName == "gamma" && sscanf(sArgs.c_str(), "%lf", &a) == 1 &&
+                 a > 0.0)
+        {
+            gamma(a);
+        }
+        else if (sName == "levels" &&
+                 sscanf(sArgs.c_str(), "%lf,%lf", &a, &b) == 2)
+        {
+            levels(a, b);
+        }
+        else if (sName == "threshold" && sscanf(sArgs.c_str(), "%lf", &a) == 1)
+        {
+            threshold((int)a);
+        }
+        else if (sName == "morph" && parseMorph(sArgs, nW, nH))
+        {
+        }
+        else
+        {
+            throw npp::Exception("OpGraph: cannot parse operation '" + sOp + "'");
+        }
+    }
+
+    // "erode:3x3", "open:5" ...
+    bool parseMorph(const std::string &sArgs, unsigned int &rWidth,
+                    unsigned int &rHeight)
+    {
+        static const char *aNames[] = {"erode", "dilate", "open", "close"};
+        std::string::size_type nColon = sArgs.find(':');
+        std::string sName = sArgs.substr(0, nColon);
+        rWidth = rHeight = 3;
+
+        if (nColon != std::string::npos &&
+            sscanf(sArgs.c_str() + nColon + 1, "%ux%u", &rWidth, &rHeight) == 1)
+        {
+            rHeight = rWidth;
+        }
+
+        for (int i = 0; i < 4; ++i)
+        {
+            if (sName == aNames[i] && rWidth > 0 && rHeight > 0)
+            {
+                morphology((MorphOperation)i, rWidth, rHeight);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    ImageConstView_8u_C1 oSrc_;
+    RotateOptions oOptions_;
+    std::vector<Stage> aStages_;
+};
+
+} // namespace pipeline
+
+#endif // PIPELINE_OP_GRAPH_H
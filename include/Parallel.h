@@ -0,0 +1,123 @@
+/* Minimal host-side work distribution for the pipeline stages.
+ *
+ * parallelFor and parallelForWorkers hand out item indices [0, nCount)
+ * dynamically to a set of std::threads.  Exceptions thrown by the body are
+ * captured and the first one is rethrown on the calling thread once all
+ * workers have finished.
+ */
+
+#ifndef PIPELINE_PARALLEL_H
+#define PIPELINE_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pipeline
+{
+
+inline unsigned int hardwareThreads()
+{
+    unsigned int nThreads = std::thread::hardware_concurrency();
+    return nThreads > 0 ? nThreads : 1;
+}
+
+// Number of workers parallelFor will use for nCount items.
+inline unsigned int workerCount(size_t nCount, unsigned int nThreads = 0)
+{
+    if (nThreads == 0)
+    {
+        nThreads = hardwareThreads();
+    }
+
+    return (unsigned int)std::max<size_t>(1, std::min<size_t>(nThreads, nCount));
+}
+
+// Calls rBody(i, nWorker) for every i in [0, nCount), where nWorker is in
+// [0, workerCount(nCount, nThreads)) and identifies the calling thread, so
+// bodies can keep per-worker accumulators without locking.  nThreads == 0
+// selects one thread per hardware thread; the calling thread is worker 0.
+template <class F>
+void parallelForWorkers(size_t nCount, const F &rBody, unsigned int nThreads = 0)
+{
+    nThreads = workerCount(nCount, nThreads);
+
+    if (nThreads <= 1)
+    {
+        for (size_t i = 0; i < nCount; ++i)
+        {
+            rBody(i, 0u);
+        }
+
+        return;
+    }
+
+    std::atomic<size_t> nNext(0);
+    std::exception_ptr pError;
+    std::mutex oErrorMutex;
+
+    auto worker = [&](unsigned int nWorker)
+    {
+        for (;;)
+        {
+            size_t i = nNext.fetch_add(1);
+
+            if (i >= nCount)
+            {
+                break;
+            }
+
+            try
+            {
+                rBody(i, nWorker);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> oLock(oErrorMutex);
+
+                if (!pError)
+                {
+                    pError = std::current_exception();
+                }
+
+                nNext = nCount;
+            }
+        }
+    };
+
+    std::vector<std::thread> aWorkers;
+    aWorkers.reserve(nThreads - 1);
+
+    for (unsigned int t = 1; t < nThreads; ++t)
+    {
+        aWorkers.push_back(std::thread(worker, t));
+    }
+
+    worker(0);
+
+    for (size_t t = 0; t < aWorkers.size(); ++t)
+    {
+        aWorkers[t].join();
+    }
+
+    if (pError)
+    {
+        std::rethrow_exception(pError);
+    }
+}
+
+// Calls rBody(i) for every i in [0, nCount).
+template <class F>
+void parallelFor(size_t nCount, const F &rBody, unsigned int nThreads = 0)
+{
+    parallelForWorkers(nCount, [&](size_t i, unsigned int) { rBody(i); },
+                       nThreads);
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_PARALLEL_H
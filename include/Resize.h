@@ -0,0 +1,315 @@
+/* Separable resampling of 8-bit images on the host.
+ *
+ * Each axis gets a coefficient table computed once: destination sample i
+ * reads nTaps consecutive source samples starting at aFirst[i], weighted by
+ * 14-bit fixed point coefficients that sum to exactly 1.  Samples outside
+ * the image are folded onto the edge.  When shrinking, the kernel is
+ * stretched by the scale factor so every source pixel contributes (area
+ * averaging for RESIZE_AREA, antialiased filtering for the others).
+ *
+ * The horizontal pass runs over row bands into a 16-bit intermediate image of
+ * the destination width, kept with 6 fractional bits and unclamped so the
+ * overshoot of the cubic and Lanczos lobes survives into the second pass.
+ * The vertical pass then produces destination row bands, accumulating whole
+ * intermediate rows so its inner loop runs along x and vectorizes.  Both
+ * passes are spread over the cores by parallelFor, and the vertical pass
+ * feeds the same epilogues as the rotation kernels (see RotateCPU.h).
+ */
+
+#ifndef PIPELINE_RESIZE_H
+#define PIPELINE_RESIZE_H
+
+#include <Exceptions.h>
+
+#include "ImageView.h"
+#include "Parallel.h"
+#include "RotateCPU.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace pipeline
+{
+
+enum ResizeFilter
+{
+    RESIZE_AREA,
+    RESIZE_BILINEAR,
+    RESIZE_BICUBIC,
+    RESIZE_LANCZOS
+};
+
+struct ResizeOptions
+{
+    ResizeFilter eFilter;
+    unsigned int nBandRows; // destination rows per work item
+    unsigned int nThreads;  // 0: one per hardware thread
+
+    ResizeOptions() : eFilter(RESIZE_BICUBIC), nBandRows(16), nThreads(0)
+    {
+    }
+};
+
+namespace detail
+{
+
+static const int kWeightBits = 14;
+static const int kMidBits = 6; // fraction bits of the intermediate image
+
+struct ResizeTaps
+{
+    unsigned int nTaps;
+    std::vector<int> aFirst;       // per destination sample
+    std::vector<int16_t> aWeights; // nTaps per destination sample
+};
+
+inline double sinc(double x)
+{
+    if (x == 0.0)
+    {
+        return 1.0;
+    }
+
+    const double nPi = 3.14159265358979323846;
+    return std::sin(nPi * x) / (nPi * x);
+}
+
+// Kernel radius in source pixels at scale 1.
+inline double filterRadius(ResizeFilter eFilter)
+{
+    switch (eFilter)
+    {
+    case RESIZE_BILINEAR:
+        return 1.0;
+    case RESIZE_BICUBIC:
+        return 2.0;
+    case RESIZE_LANCZOS:
+        return 3.0;
+    default:
+        return 0.5;
+    }
+}
+
+inline double filterWeight(ResizeFilter eFilter, double x)
+{
+    x = std::fabs(x);
+
+    switch (eFilter)
+    {
+    case RESIZE_BILINEAR:
+        return x < 1.0 ? 1.0 - x : 0.0;
+
+    case RESIZE_BICUBIC:
+        // Keys, a = -0.5
+        if (x < 1.0)
+        {
+            return (1.5 * x - 2.5) * x * x + 1.0;
+        }
+
+        return x < 2.0 ? ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0 : 0.0;
+
+    case RESIZE_LANCZOS:
+        return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+
+    default:
+        return 0.0;
+    }
+}
+
+// Coefficients mapping nSrc samples onto nDst samples.
+inline ResizeTaps makeResizeTaps(unsigned int nSrc, unsigned int nDst,
+                                 ResizeFilter eFilter)
+{
+    const double nScale = (double)nSrc / nDst;
+    const double nStretch = std::max(1.0, nScale);
+    const double nSupport = eFilter == RESIZE_AREA
+                                ? 0.5 * nScale + 0.5
+                                : filterRadius(eFilter) * nStretch;
+
+    ResizeTaps oTaps;
+    oTaps.nTaps = std::min<unsigned int>(nSrc,
+                                         (unsigned int)std::ceil(2.0 * nSupport) + 1);
+    oTaps.aFirst.resize(nDst);
+    oTaps.aWeights.assign((size_t)nDst * oTaps.nTaps, 0);
+
+    std::vector<double> aWeights(oTaps.nTaps);
+
+    for (unsigned int i = 0; i < nDst; ++i)
+    {
+        const double nCenter = (i + 0.5) * nScale - 0.5;
+        const int nLo = (int)std::ceil(nCenter - nSupport);
+        const int nHi = (int)std::floor(nCenter + nSupport);
+        const int nFirst = std::max(0, std::min(nLo, (int)nSrc - (int)oTaps.nTaps));
+        double nSum = 0.0;
+
+        std::fill(aWeights.begin(), aWeights.end(), 0.0);
+
+        for (int j = nLo; j <= nHi; ++j)
+        {
+            double nWeight;
+
+            if (eFilter == RESIZE_AREA)
+            {
+                // overlap of source pixel [j, j + 1) with [i, i + 1) * nScale
+                double nA = i * nScale;
+                double nB = (i + 1) * nScale;
+                nWeight = std::max(0.0, std::min(j + 1.0, nB) - std::max((double)j, nA));
+            }
+            else
+            {
+                nWeight = filterWeight(eFilter, (j - nCenter) / nStretch);
+            }
+
+            int nClamped = std::max(0, std::min(j, (int)nSrc - 1));
+            aWeights[nClamped - nFirst] += nWeight;
+            nSum += nWeight;
+        }
+
+        // quantize, then give the rounding residue to the largest tap so the
+        // weights sum to exactly one
+        int16_t *pWeights = &oTaps.aWeights[(size_t)i * oTaps.nTaps];
+        int nTotal = 0;
+        unsigned int nLargest = 0;
+
+        for (unsigned int k = 0; k < oTaps.nTaps; ++k)
+        {
+            double nScaled = aWeights[k] / nSum * (1 << kWeightBits);
+            pWeights[k] = (int16_t)std::floor(nScaled + 0.5);
+            nTotal += pWeights[k];
+
+            if (pWeights[k] > pWeights[nLargest])
+            {
+                nLargest = k;
+            }
+        }
+
+        pWeights[nLargest] = (int16_t)(pWeights[nLargest] + (1 << kWeightBits) - nTotal);
+        oTaps.aFirst[i] = nFirst;
+    }
+
+    return oTaps;
+}
+
+inline void resizeRowHorizontal(const unsigned char *pSrc, int16_t *pDst,
+                                unsigned int nWidth, const ResizeTaps &rTaps)
+{
+    const int16_t *pWeights = rTaps.aWeights.data();
+
+    for (unsigned int x = 0; x < nWidth; ++x, pWeights += rTaps.nTaps)
+    {
+        const unsigned char *pIn = pSrc + rTaps.aFirst[x];
+        int32_t nSum = 0;
+
+        for (unsigned int k = 0; k < rTaps.nTaps; ++k)
+        {
+            nSum += pWeights[k] * pIn[k];
+        }
+
+        nSum = (nSum + (1 << (kWeightBits - kMidBits - 1))) >> (kWeightBits - kMidBits);
+        pDst[x] = (int16_t)std::max(-32768, std::min(32767, nSum));
+    }
+}
+
+inline unsigned char clampMid(int32_t nSum)
+{
+    const int nShift = kWeightBits + kMidBits;
+    nSum = (nSum + (1 << (nShift - 1))) >> nShift;
+    return (unsigned char)std::max(0, std::min(255, nSum));
+}
+
+} // namespace detail
+
+// Resamples oSrc to the size of oDst.
+template <class Epilogue>
+void resize(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+            const ResizeOptions &rOptions, Epilogue &rEpilogue)
+{
+    if (oSrc.empty() || oDst.empty())
+    {
+        throw npp::Exception("Resize: empty source or destination");
+    }
+
+    const unsigned int nDstWidth = oDst.width();
+    const unsigned int nDstHeight = oDst.height();
+    const unsigned int nBandRows = std::max(1u, rOptions.nBandRows);
+
+    // horizontal pass: every source row to the destination width
+    std::vector<int16_t> aMid((size_t)nDstWidth * oSrc.height());
+    {
+        detail::ResizeTaps oTaps = detail::makeResizeTaps(oSrc.width(), nDstWidth,
+                                                          rOptions.eFilter);
+
+        parallelFor((oSrc.height() + nBandRows - 1) / nBandRows, [&](size_t iBand)
+        {
+            unsigned int nY0 = (unsigned int)iBand * nBandRows;
+            unsigned int nY1 = std::min(oSrc.height(), nY0 + nBandRows);
+
+            for (unsigned int y = nY0; y < nY1; ++y)
+            {
+                detail::resizeRowHorizontal(oSrc.row(y), &aMid[(size_t)y * nDstWidth],
+                                            nDstWidth, oTaps);
+            }
+        }, rOptions.nThreads);
+    }
+
+    // vertical pass: weighted sums of whole intermediate rows
+    detail::ResizeTaps oTaps = detail::makeResizeTaps(oSrc.height(), nDstHeight,
+                                                      rOptions.eFilter);
+    const size_t nBands = (nDstHeight + nBandRows - 1) / nBandRows;
+    const unsigned int nWorkers = workerCount(nBands, rOptions.nThreads);
+    std::vector<std::vector<int32_t> > aAccumulators(nWorkers,
+                                                      std::vector<int32_t>(nDstWidth));
+
+    rEpilogue.prepare(nWorkers);
+
+    parallelForWorkers(nBands, [&](size_t iBand, unsigned int nWorker)
+    {
+        int32_t *pSum = aAccumulators[nWorker].data();
+        unsigned int nY0 = (unsigned int)iBand * nBandRows;
+        unsigned int nY1 = std::min(nDstHeight, nY0 + nBandRows);
+
+        for (unsigned int y = nY0; y < nY1; ++y)
+        {
+            const int16_t *pWeights = &oTaps.aWeights[(size_t)y * oTaps.nTaps];
+            std::fill(pSum, pSum + nDstWidth, 0);
+
+            for (unsigned int k = 0; k < oTaps.nTaps; ++k)
+            {
+                const int32_t nWeight = pWeights[k];
+                const int16_t *pIn = &aMid[(size_t)(oTaps.aFirst[y] + k) * nDstWidth];
+
+                if (nWeight == 0)
+                {
+                    continue;
+                }
+
+                for (unsigned int x = 0; x < nDstWidth; ++x)
+                {
+                    pSum[x] += nWeight * pIn[x];
+                }
+            }
+
+            unsigned char *pOut = oDst.row(y);
+
+            for (unsigned int x = 0; x < nDstWidth; ++x)
+            {
+                pOut[x] = detail::clampMid(pSum[x]);
+            }
+
+            rEpilogue.row(nWorker, 0, y, pOut, nDstWidth);
+        }
+    }, rOptions.nThreads);
+}
+
+inline void resize(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                   const ResizeOptions &rOptions)
+{
+    NoEpilogue oNone;
+    resize(oSrc, oDst, rOptions, oNone);
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_RESIZE_H
@@ -0,0 +1,271 @@
+/* Rotation of packed 1bpp (bitonal) images without unpacking to 8 bits.
+ *
+ * Quarter turns are exact permutations of the bits:
+ *  - 90 and 270 degrees move 8x8 bit blocks, each transposed in a 64-bit
+ *    register with three masked shift/xor steps;
+ *  - 180 degrees reverses every row with a byte lookup followed by a 64-bit
+ *    funnel shift that drops the row padding.
+ * Any other angle samples the source with the same fixed point line walk as
+ * the 8-bit nearest neighbour kernel and gathers 64 destination bits into a
+ * register before storing them, so bitonal and 8-bit rotations agree pixel for
+ * pixel.  Everything outside the source comes out white.
+ */
+
+#ifndef PIPELINE_ROTATE_BITS_H
+#define PIPELINE_ROTATE_BITS_H
+
+#include "BitImage.h"
+#include "Parallel.h"
+#include "RotateCPU.h"
+#include "RotateGeometry.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace pipeline
+{
+
+namespace bits
+{
+
+// Transposes the 8x8 bit matrix held MSB first, row 0 in the top byte.
+inline uint64_t transpose8x8(uint64_t x)
+{
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+    x = x ^ t ^ (t << 28);
+    return x;
+}
+
+inline unsigned char reverseByte(unsigned char b)
+{
+    static struct Table
+    {
+        unsigned char a[256];
+
+        Table()
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                unsigned char r = 0;
+
+                for (int k = 0; k < 8; ++k)
+                {
+                    r |= ((i >> k) & 1) << (7 - k);
+                }
+
+                a[i] = r;
+            }
+        }
+    } oTable;
+
+    return oTable.a[b];
+}
+
+inline uint64_t loadBigEndian(const unsigned char *p)
+{
+    uint64_t x = 0;
+
+    for (int i = 0; i < 8; ++i)
+    {
+        x = (x << 8) | p[i];
+    }
+
+    return x;
+}
+
+inline void storeBigEndian(unsigned char *p, uint64_t x, unsigned int nBytes)
+{
+    for (unsigned int i = 0; i < nBytes; ++i)
+    {
+        p[i] = (unsigned char)(x >> (56 - 8 * i));
+    }
+}
+
+// Writes the nWidth bits of pSrc to pDst in reverse order.  pScratch must
+// hold rowBytes + 8 bytes.
+inline void reverseRow(const unsigned char *pSrc, unsigned char *pDst,
+                       unsigned int nWidth, unsigned char *pScratch)
+{
+    const unsigned int nBytes = (nWidth + 7) / 8;
+    const unsigned int nPad = nBytes * 8 - nWidth;
+
+    for (unsigned int i = 0; i < nBytes; ++i)
+    {
+        pScratch[i] = reverseByte(pSrc[nBytes - 1 - i]);
+    }
+
+    memset(pScratch + nBytes, 0, 8);
+
+    if (nPad == 0)
+    {
+        memcpy(pDst, pScratch, nBytes);
+        return;
+    }
+
+    // the reversed row starts with nPad padding bits; shift them out
+    for (unsigned int i = 0; i < nBytes; i += 7)
+    {
+        uint64_t x = loadBigEndian(pScratch + i) << nPad;
+        storeBigEndian(pDst + i, x, std::min(7u, nBytes - i));
+    }
+}
+
+} // namespace bits
+
+// Rotates by nQuarterTurns * 90 degrees counter-clockwise; oDst must have the
+// rotated size.
+inline void rotateBitsQuarter(BitImageConstView_1u oSrc, BitImageView_1u oDst,
+                              int nQuarterTurns, unsigned int nThreads = 0)
+{
+    const unsigned int nWidth = oSrc.width();
+    const unsigned int nHeight = oSrc.height();
+    nQuarterTurns = ((nQuarterTurns % 4) + 4) % 4;
+
+    if (nQuarterTurns == 0)
+    {
+        for (unsigned int y = 0; y < nHeight; ++y)
+        {
+            memcpy(oDst.row(y), oSrc.row(y), oSrc.rowBytes());
+        }
+
+        return;
+    }
+
+    if (nQuarterTurns == 2)
+    {
+        parallelFor(nHeight, [&](size_t y)
+        {
+            std::vector<unsigned char> aScratch(oSrc.rowBytes() + 8);
+            bits::reverseRow(oSrc.row(nHeight - 1 - (unsigned int)y),
+                             oDst.row((unsigned int)y), nWidth, aScratch.data());
+        }, nThreads);
+
+        return;
+    }
+
+    // 90: dst(x, y) = src(W - 1 - y, x); 270: dst(x, y) = src(y, H - 1 - x).
+    // Each task transposes the 8x8 blocks of eight source rows, which fill
+    // one destination byte column.
+    const unsigned int nBlockRows = (nHeight + 7) / 8;
+    const unsigned int nSrcBytes = oSrc.rowBytes();
+
+    parallelFor(nBlockRows, [&](size_t iBlock)
+    {
+        unsigned int nDstByte = (unsigned int)iBlock;
+        const unsigned char *apRows[8];
+
+        for (unsigned int m = 0; m < 8; ++m)
+        {
+            unsigned int nDstX = nDstByte * 8 + m;
+            apRows[m] = 0;
+
+            if (nDstX < nHeight)
+            {
+                apRows[m] = oSrc.row(nQuarterTurns == 1 ? nDstX : nHeight - 1 - nDstX);
+            }
+        }
+
+        for (unsigned int nSrcByte = 0; nSrcByte < nSrcBytes; ++nSrcByte)
+        {
+            uint64_t x = 0;
+
+            for (unsigned int m = 0; m < 8; ++m)
+            {
+                x = (x << 8) | (apRows[m] ? apRows[m][nSrcByte] : 0);
+            }
+
+            x = bits::transpose8x8(x);
+
+            for (unsigned int k = 0; k < 8; ++k)
+            {
+                unsigned int nSrcX = nSrcByte * 8 + k;
+
+                if (nSrcX >= nWidth)
+                {
+                    break;
+                }
+
+                unsigned int nDstY = nQuarterTurns == 1 ? nWidth - 1 - nSrcX : nSrcX;
+                oDst.row(nDstY)[nDstByte] = (unsigned char)(x >> (56 - 8 * k));
+            }
+        }
+    }, nThreads);
+}
+
+// Nearest neighbour warp of a 1bpp image; destination pixel (x, y) takes the
+// source bit at oDstToSrc(x + 0.5, y + 0.5).
+inline void warpBits(BitImageConstView_1u oSrc, BitImageView_1u oDst,
+                     const AffineTransform &oDstToSrc, unsigned int nThreads = 0)
+{
+    parallelFor(oDst.height(), [&](size_t iRow)
+    {
+        unsigned int y = (unsigned int)iRow;
+        unsigned char *pDst = oDst.row(y);
+        const unsigned char *pBase = oSrc.data();
+        const std::ptrdiff_t nPitch = oSrc.pitch();
+        const int nShift = detail::kFractionBits;
+        const unsigned int nWords = (oDst.width() + 63) / 64;
+
+        // each 64 pixel word is walked from its own anchor, the way the
+        // 8-bit kernel walks its 64 pixel tiles
+        for (unsigned int w = 0; w < nWords; ++w)
+        {
+            unsigned int nCount = std::min(64u, oDst.width() - w * 64);
+            detail::RowWalk oWalk = detail::walkRow(oDstToSrc, oSrc.width(),
+                                                    oSrc.height(), w * 64, y, nCount);
+            detail::Fixed nU = oWalk.nU + (detail::Fixed)oWalk.nInsideBegin * oWalk.nDu;
+            detail::Fixed nV = oWalk.nV + (detail::Fixed)oWalk.nInsideBegin * oWalk.nDv;
+            uint64_t nWord = 0;
+
+            for (unsigned int k = oWalk.nInsideBegin; k < oWalk.nInsideEnd; ++k)
+            {
+                int64_t nX = nU >> nShift;
+                uint64_t nBit = (pBase[(nV >> nShift) * nPitch + (nX >> 3)] >>
+                                 (7 - (nX & 7))) & 1;
+                nWord |= nBit << (63 - k);
+                nU += oWalk.nDu;
+                nV += oWalk.nDv;
+            }
+
+            bits::storeBigEndian(pDst + w * 8, nWord,
+                                 std::min(8u, oDst.rowBytes() - w * 8));
+        }
+    }, nThreads);
+}
+
+// Reorients a bitonal image by rOrientation and rotates it by nAngle degrees
+// counter-clockwise into a new buffer sized like makeRotateGeometry's
+// destination.
+inline BitImageBuffer rotateBits(BitImageConstView_1u oSrc, double nAngle,
+                                 const Orientation &rOrientation = Orientation(),
+                                 unsigned int nThreads = 0)
+{
+    RotateGeometry oGeometry = makeRotateGeometry(oSrc.width(), oSrc.height(),
+                                                  nAngle, rOrientation);
+    BitImageBuffer oDst(oGeometry.nDstWidth, oGeometry.nDstHeight);
+    double nQuarterTurns = nAngle / 90.0;
+    double nRounded = std::floor(nQuarterTurns + 0.5);
+
+    if (rOrientation.isIdentity() && std::fabs(nQuarterTurns - nRounded) < 1e-12)
+    {
+        rotateBitsQuarter(oSrc, oDst.view(), (int)std::fmod(nRounded, 4.0),
+                          nThreads);
+    }
+    else
+    {
+        warpBits(oSrc, oDst.view(), oGeometry.oInverse, nThreads);
+    }
+
+    return oDst;
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_ROTATE_BITS_H
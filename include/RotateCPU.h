@@ -0,0 +1,946 @@
+/* Tiled, multithreaded host implementation of the rotation.
+ *
+ * The destination is cut into tiles that parallelForWorkers hands out to the
+ * worker threads.  Each destination row segment of a tile is produced by
+ * walking the source along the inverse-mapped line in fixed point; the range
+ * of the segment that lands inside the source is solved exactly up front, so
+ * the inner loops carry no bounds checks.
+ *
+ * Kernels take an epilogue that sees every row segment right after it has
+ * been written, while it is still in L1.  Stages fused into the rotation
+ * (statistics, thresholding, ...) are epilogues.  An epilogue provides
+ *
+ *   void prepare(unsigned int nWorkers);
+ *   void row(unsigned int nWorker, unsigned int nX, unsigned int nY,
+ *            unsigned char *pRow, unsigned int nCount);
+ *
+ * where row() may be called concurrently for different workers.
+ *
+ * By default the tiles are visited row by row and their size is a tuning
+ * parameter.  TRAVERSAL_HILBERT and TRAVERSAL_MORTON instead order small
+ * fixed blocks along a space filling curve and give each worker contiguous
+ * runs of it: any stretch of the curve covers a compact patch of the
+ * destination, and so of the source, at every scale, which keeps the reads
+ * local in every cache level without knowing their sizes.
+ *
+ * With nPrefetchDistance set, the sampling loops also prefetch the source
+ * lines the sample that far ahead along the walk reads, often enough to
+ * reach every source row the walk crosses: a steep walk changes source row
+ * every pixel or two, each row on another page, which the hardware
+ * prefetchers do not follow.
+ *
+ * A destination larger than the last level cache is written once and would
+ * only evict the source on its way through the caches.  Then (or always,
+ * with STORES_STREAMING) each row segment is produced in a per-worker
+ * scratch row, passed to the epilogue there, and copied out with
+ * non-temporal stores for the cache lines it fills completely.
+ *
+ * warpAffineOrdered() finishes the rows of tiles in order so a consumer,
+ * typically a file writer, can take each band while later ones are still
+ * being computed.  Workers run at most a few bands ahead of the last band
+ * handed over; that window is the reorder buffer.
+ */
+
+#ifndef PIPELINE_ROTATE_CPU_H
+#define PIPELINE_ROTATE_CPU_H
+
+#include "CacheInfo.h"
+#include "ImageView.h"
+#include "Parallel.h"
+#include "RotateGeometry.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PIPELINE_ROTATE_SSE2 1
+#endif
+
+namespace pipeline
+{
+
+enum Interpolation
+{
+    INTER_NN,
+    INTER_LINEAR
+};
+
+enum Traversal
+{
+    TRAVERSAL_TILES,   // row-major grid of nTileWidth x nTileHeight tiles
+    TRAVERSAL_HILBERT, // blocks along a Hilbert curve, no tile size
+    TRAVERSAL_MORTON   // blocks in Z order, no tile size
+};
+
+enum StoreMode
+{
+    STORES_AUTO,     // streaming when the destination exceeds the LLC
+    STORES_CACHED,   // ordinary stores
+    STORES_STREAMING // non-temporal stores for full destination cache lines
+};
+
+struct RotateOptions
+{
+    Interpolation eInterpolation;
+    unsigned int nTileWidth;
+    unsigned int nTileHeight;
+    // 0 selects one worker per hardware thread
+    unsigned int nThreads;
+    // value written where the destination maps outside the source
+    unsigned char nBackground;
+    Traversal eTraversal;
+    // destination pixels ahead of the current one whose source lines are
+    // prefetched, 0 for none
+    unsigned int nPrefetchDistance;
+    StoreMode eStores;
+
+    RotateOptions()
+        : eInterpolation(INTER_NN), nTileWidth(64), nTileHeight(64),
+          nThreads(0), nBackground(0), eTraversal(TRAVERSAL_TILES),
+          nPrefetchDistance(0), eStores(STORES_AUTO)
+    {
+    }
+};
+
+struct NoEpilogue
+{
+    void prepare(unsigned int)
+    {
+    }
+
+    void row(unsigned int, unsigned int, unsigned int, unsigned char *,
+             unsigned int)
+    {
+    }
+};
+
+namespace detail
+{
+
+typedef int64_t Fixed;
+static const int kFractionBits = 20;
+static const Fixed kFixedOne = (Fixed)1 << kFractionBits;
+
+inline Fixed toFixed(double nValue)
+{
+    return (Fixed)std::floor(nValue * (double)kFixedOne + 0.5);
+}
+
+inline int64_t floorDiv(int64_t nA, int64_t nB)
+{
+    int64_t nQ = nA / nB;
+    return (nA % nB != 0 && ((nA < 0) != (nB < 0))) ? nQ - 1 : nQ;
+}
+
+inline int64_t ceilDiv(int64_t nA, int64_t nB)
+{
+    return -floorDiv(-nA, nB);
+}
+
+// Narrows [rLo, rHi) to the steps k for which 0 <= nStart + k nStep < nLimit.
+inline void clipLinear(Fixed nStart, Fixed nStep, Fixed nLimit, int64_t &rLo,
+                       int64_t &rHi)
+{
+    if (nStep == 0)
+    {
+        if (nStart < 0 || nStart >= nLimit)
+        {
+            rHi = rLo;
+        }
+
+        return;
+    }
+
+    int64_t nLo, nHi;
+
+    if (nStep > 0)
+    {
+        nLo = ceilDiv(-nStart, nStep);
+        nHi = ceilDiv(nLimit - nStart, nStep);
+    }
+    else
+    {
+        nLo = floorDiv(nStart - nLimit, -nStep) + 1;
+        nHi = floorDiv(nStart, -nStep) + 1;
+    }
+
+    rLo = std::max(rLo, nLo);
+    rHi = std::min(rHi, nHi);
+}
+
+// Source walk of one destination row segment: the sample position of the
+// segment's first pixel centre, the step per pixel, and the sub-range
+// [nInsideBegin, nInsideEnd) whose samples fall inside the source.
+struct RowWalk
+{
+    Fixed nU, nV;
+    Fixed nDu, nDv;
+    unsigned int nInsideBegin, nInsideEnd;
+};
+
+inline RowWalk walkRow(const AffineTransform &oDstToSrc, unsigned int nSrcWidth,
+                       unsigned int nSrcHeight, unsigned int nX,
+                       unsigned int nY, unsigned int nCount)
+{
+    RowWalk oWalk;
+    double nU, nV;
+    oDstToSrc.apply(nX + 0.5, nY + 0.5, nU, nV);
+    oWalk.nU = toFixed(nU);
+    oWalk.nV = toFixed(nV);
+    oWalk.nDu = toFixed(oDstToSrc.a);
+    oWalk.nDv = toFixed(oDstToSrc.d);
+
+    int64_t nLo = 0, nHi = nCount;
+    clipLinear(oWalk.nU, oWalk.nDu, (Fixed)nSrcWidth << kFractionBits, nLo, nHi);
+    clipLinear(oWalk.nV, oWalk.nDv, (Fixed)nSrcHeight << kFractionBits, nLo, nHi);
+
+    if (nHi <= nLo)
+    {
+        nLo = nHi = 0;
+    }
+
+    oWalk.nInsideBegin = (unsigned int)nLo;
+    oWalk.nInsideEnd = (unsigned int)nHi;
+    return oWalk;
+}
+
+// Most samples between two prefetches of the sampling loops.
+static const unsigned int kPrefetchStride = 8;
+
+inline void prefetchRead(const unsigned char *p)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(p, 0, 3);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_prefetch((const char *)p, _MM_HINT_T0);
+#else
+    (void)p;
+#endif
+}
+
+// Prefetches the source lines sample k of rWalk reads, k inside the source;
+// linear sampling also reads the row below.
+inline void prefetchSample(ImageConstView_8u_C1 oSrc, const RowWalk &rWalk,
+                           unsigned int k, bool bLinear)
+{
+    const Fixed nHalf = bLinear ? kFixedOne / 2 : 0;
+    int nX = (int)((rWalk.nU + k * rWalk.nDu - nHalf) >> kFractionBits);
+    int nY = (int)((rWalk.nV + k * rWalk.nDv - nHalf) >> kFractionBits);
+    nX = std::min(std::max(nX, 0), (int)oSrc.width() - 1);
+    nY = std::min(std::max(nY, 0), (int)oSrc.height() - 1);
+    prefetchRead(oSrc.row(nY) + nX);
+
+    if (bLinear && nY + 1 < (int)oSrc.height())
+    {
+        prefetchRead(oSrc.row(nY + 1) + nX);
+    }
+}
+
+// Samples between two prefetches along rWalk: kPrefetchStride, or fewer
+// when the walk changes source row more often, so that every row it reads
+// is prefetched.
+inline unsigned int prefetchStride(const RowWalk &rWalk)
+{
+    Fixed nDv = rWalk.nDv < 0 ? -rWalk.nDv : rWalk.nDv;
+
+    if (nDv * kPrefetchStride <= kFixedOne)
+    {
+        return kPrefetchStride;
+    }
+
+    return (unsigned int)std::max<Fixed>(1, kFixedOne / nDv);
+}
+
+// End of the chunk of nStride samples starting at k, after prefetching for
+// the sample nDistance ahead of it.  Without prefetching the chunk is the
+// rest of the walk.
+inline unsigned int prefetchChunk(ImageConstView_8u_C1 oSrc, const RowWalk &rWalk,
+                                  unsigned int k, unsigned int nDistance,
+                                  unsigned int nStride, bool bLinear)
+{
+    if (nDistance == 0)
+    {
+        return rWalk.nInsideEnd;
+    }
+
+    if (k + nDistance < rWalk.nInsideEnd)
+    {
+        prefetchSample(oSrc, rWalk, k + nDistance, bLinear);
+    }
+
+    return std::min(rWalk.nInsideEnd, k + nStride);
+}
+
+inline void sampleNearest(ImageConstView_8u_C1 oSrc, const RowWalk &rWalk,
+                          unsigned int nPrefetchDistance, unsigned char *pDst)
+{
+    const unsigned char *pBase = oSrc.data();
+    const std::ptrdiff_t nPitch = oSrc.pitch();
+    Fixed nU = rWalk.nU + rWalk.nInsideBegin * rWalk.nDu;
+    Fixed nV = rWalk.nV + rWalk.nInsideBegin * rWalk.nDv;
+    const unsigned int nStride = prefetchStride(rWalk);
+
+    for (unsigned int k = rWalk.nInsideBegin; k < rWalk.nInsideEnd;)
+    {
+        unsigned int nEnd =
+            prefetchChunk(oSrc, rWalk, k, nPrefetchDistance, nStride, false);
+
+        for (; k < nEnd; ++k)
+        {
+            pDst[k] = pBase[(nV >> kFractionBits) * nPitch + (nU >> kFractionBits)];
+            nU += rWalk.nDu;
+            nV += rWalk.nDv;
+        }
+    }
+}
+
+inline void sampleLinear(ImageConstView_8u_C1 oSrc, const RowWalk &rWalk,
+                         unsigned int nPrefetchDistance, unsigned char *pDst)
+{
+    const int nMaxX = (int)oSrc.width() - 1;
+    const int nMaxY = (int)oSrc.height() - 1;
+    const Fixed nHalf = kFixedOne / 2;
+    Fixed nU = rWalk.nU + rWalk.nInsideBegin * rWalk.nDu - nHalf;
+    Fixed nV = rWalk.nV + rWalk.nInsideBegin * rWalk.nDv - nHalf;
+    const unsigned int nStride = prefetchStride(rWalk);
+
+    for (unsigned int k = rWalk.nInsideBegin; k < rWalk.nInsideEnd;)
+    {
+        unsigned int nEnd =
+            prefetchChunk(oSrc, rWalk, k, nPrefetchDistance, nStride, true);
+
+        for (; k < nEnd; ++k)
+        {
+            int nX0 = (int)(nU >> kFractionBits);
+            int nY0 = (int)(nV >> kFractionBits);
+            unsigned int nFx = (unsigned int)(nU >> (kFractionBits - 8)) & 0xff;
+            unsigned int nFy = (unsigned int)(nV >> (kFractionBits - 8)) & 0xff;
+            int nX1 = std::min(nX0 + 1, nMaxX);
+            int nY1 = std::min(nY0 + 1, nMaxY);
+            nX0 = std::max(nX0, 0);
+            nY0 = std::max(nY0, 0);
+
+            const unsigned char *pRow0 = oSrc.row(nY0);
+            const unsigned char *pRow1 = oSrc.row(nY1);
+            unsigned int nTop = pRow0[nX0] * (256 - nFx) + pRow0[nX1] * nFx;
+            unsigned int nBottom = pRow1[nX0] * (256 - nFx) + pRow1[nX1] * nFx;
+            pDst[k] = (unsigned char)((nTop * (256 - nFy) + nBottom * nFy + 32768) >>
+                                      16);
+
+            nU += rWalk.nDu;
+            nV += rWalk.nDv;
+        }
+    }
+}
+
+// Side of the blocks the curve traversals visit.  It only amortizes the
+// per-segment setup of warpRow, locality comes from the curve; it matches
+// the default tiles so row segments, and with them the fixed point walks,
+// start at the same columns and the output is identical.
+static const unsigned int kCurveBlock = 64;
+
+// Cell (rX, rY) at position nIndex of the Hilbert curve over a 2^nOrder
+// square.
+inline void hilbertCell(unsigned int nOrder, uint64_t nIndex, unsigned int &rX,
+                        unsigned int &rY)
+{
+    unsigned int x = 0, y = 0;
+
+    for (unsigned int nSide = 1; nSide < (1u << nOrder); nSide <<= 1)
+    {
+        unsigned int nRx = (unsigned int)(nIndex >> 1) & 1;
+        unsigned int nRy = (unsigned int)(nIndex ^ nRx) & 1;
+
+        if (nRy == 0)
+        {
+            if (nRx == 1)
+            {
+                x = nSide - 1 - x;
+                y = nSide - 1 - y;
+            }
+
+            std::swap(x, y);
+        }
+
+        x += nSide * nRx;
+        y += nSide * nRy;
+        nIndex >>= 2;
+    }
+
+    rX = x;
+    rY = y;
+}
+
+// Cell (rX, rY) at position nIndex of the Z-order curve.
+inline void mortonCell(uint64_t nIndex, unsigned int &rX, unsigned int &rY)
+{
+    unsigned int x = 0, y = 0;
+
+    for (unsigned int nBit = 0; nIndex != 0; ++nBit, nIndex >>= 2)
+    {
+        x |= (unsigned int)(nIndex & 1) << nBit;
+        y |= (unsigned int)((nIndex >> 1) & 1) << nBit;
+    }
+
+    rX = x;
+    rY = y;
+}
+
+// The nBlocksX x nBlocksY grid in curve order.  A long grid is covered by a
+// row of squares, each traversed along its own curve, so at most a few
+// cells per block fall outside.
+inline std::vector<uint32_t> curveOrder(unsigned int nBlocksX, unsigned int nBlocksY,
+                                        Traversal eTraversal)
+{
+    std::vector<uint32_t> aOrder;
+    aOrder.reserve((size_t)nBlocksX * nBlocksY);
+
+    const bool bWide = nBlocksX >= nBlocksY;
+    const unsigned int nShort = bWide ? nBlocksY : nBlocksX;
+    const unsigned int nLong = bWide ? nBlocksX : nBlocksY;
+    unsigned int nOrder = 0;
+
+    while ((1u << nOrder) < nShort)
+    {
+        ++nOrder;
+    }
+
+    const unsigned int nSide = 1u << nOrder;
+    const uint64_t nCells = (uint64_t)nSide * nSide;
+
+    for (unsigned int nBase = 0; nBase < nLong; nBase += nSide)
+    {
+        for (uint64_t i = 0; i < nCells; ++i)
+        {
+            unsigned int nU, nV;
+
+            if (eTraversal == TRAVERSAL_HILBERT)
+            {
+                hilbertCell(nOrder, i, nU, nV);
+            }
+            else
+            {
+                mortonCell(i, nU, nV);
+            }
+
+            unsigned int nX = bWide ? nBase + nU : nV;
+            unsigned int nY = bWide ? nV : nBase + nU;
+
+            if (nX < nBlocksX && nY < nBlocksY)
+            {
+                aOrder.push_back((uint32_t)nY * nBlocksX + nX);
+            }
+        }
+    }
+
+    return aOrder;
+}
+
+static const unsigned int kCacheLine = 64;
+
+// Copies nCount bytes to pDst, with non-temporal stores for the cache lines
+// of pDst they cover completely.  Needs streamFence() before other threads
+// read the result.
+inline void streamCopy(unsigned char *pDst, const unsigned char *pSrc,
+                       unsigned int nCount)
+{
+#ifdef PIPELINE_ROTATE_SSE2
+    unsigned int nHead = (unsigned int)((kCacheLine - ((uintptr_t)pDst % kCacheLine)) %
+                                        kCacheLine);
+    nHead = std::min(nHead, nCount);
+    memcpy(pDst, pSrc, nHead);
+    unsigned int i = nHead;
+
+    for (; i + kCacheLine <= nCount; i += kCacheLine)
+    {
+        for (unsigned int j = 0; j < kCacheLine; j += 16)
+        {
+            __m128i oValue = _mm_loadu_si128((const __m128i *)(pSrc + i + j));
+            _mm_stream_si128((__m128i *)(pDst + i + j), oValue);
+        }
+    }
+
+    memcpy(pDst + i, pSrc + i, nCount - i);
+#else
+    memcpy(pDst, pSrc, nCount);
+#endif
+}
+
+inline void streamFence()
+{
+#ifdef PIPELINE_ROTATE_SSE2
+    _mm_sfence();
+#endif
+}
+
+inline bool useStreamingStores(const RotateOptions &rOptions, ImageView_8u_C1 oDst)
+{
+    if (rOptions.eStores == STORES_AUTO)
+    {
+        return (size_t)oDst.width() * oDst.height() > llcBytes();
+    }
+
+    return rOptions.eStores == STORES_STREAMING;
+}
+
+// Per-worker rows of at least nWidth bytes starting on a cache line, where
+// streamed row segments are produced; empty unless bStreaming.
+class ScratchRows
+{
+public:
+    ScratchRows(bool bStreaming, unsigned int nWorkers, unsigned int nWidth)
+        : nStride_((nWidth + 2 * kCacheLine - 1) / kCacheLine * kCacheLine)
+    {
+        if (bStreaming)
+        {
+            aData_.resize((size_t)nWorkers * nStride_);
+        }
+    }
+
+    // The row of nWorker, or 0 when writing in place.
+    unsigned char *row(unsigned int nWorker)
+    {
+        if (aData_.empty())
+        {
+            return 0;
+        }
+
+        unsigned char *pRow = &aData_[(size_t)nWorker * nStride_];
+        return pRow + (kCacheLine - (uintptr_t)pRow % kCacheLine) % kCacheLine;
+    }
+
+private:
+    size_t nStride_;
+    std::vector<unsigned char> aData_;
+};
+
+} // namespace detail
+
+// Writes nCount destination pixels of row nY starting at column nX.
+inline void warpRow(ImageConstView_8u_C1 oSrc, const AffineTransform &oDstToSrc,
+                    const RotateOptions &rOptions, unsigned int nX,
+                    unsigned int nY, unsigned int nCount, unsigned char *pDst)
+{
+    detail::RowWalk oWalk = detail::walkRow(oDstToSrc, oSrc.width(),
+                                            oSrc.height(), nX, nY, nCount);
+
+    memset(pDst, rOptions.nBackground, oWalk.nInsideBegin);
+    memset(pDst + oWalk.nInsideEnd, rOptions.nBackground,
+           nCount - oWalk.nInsideEnd);
+
+    if (rOptions.eInterpolation == INTER_LINEAR)
+    {
+        detail::sampleLinear(oSrc, oWalk, rOptions.nPrefetchDistance, pDst);
+    }
+    else
+    {
+        detail::sampleNearest(oSrc, oWalk, rOptions.nPrefetchDistance, pDst);
+    }
+}
+
+namespace detail
+{
+
+// Produces the destination row segment pDst and runs the epilogue on it:
+// in place, or in pScratch and then streamed out.
+template <class Epilogue>
+void emitSegment(ImageConstView_8u_C1 oSrc, const AffineTransform &oDstToSrc,
+                 const RotateOptions &rOptions, unsigned int nWorker,
+                 unsigned int nX, unsigned int nY, unsigned int nCount,
+                 unsigned char *pDst, unsigned char *pScratch, Epilogue &rEpilogue)
+{
+    unsigned char *pRow = pScratch ? pScratch : pDst;
+    warpRow(oSrc, oDstToSrc, rOptions, nX, nY, nCount, pRow);
+    rEpilogue.row(nWorker, nX, nY, pRow, nCount);
+
+    if (pScratch)
+    {
+        streamCopy(pDst, pScratch, nCount);
+    }
+}
+
+} // namespace detail
+
+// warpAffine along a space filling curve of kCurveBlock blocks.  The curve
+// is cut into a few runs per worker, handed out in order.
+template <class Epilogue>
+void warpAffineCurve(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                     const AffineTransform &oDstToSrc,
+                     const RotateOptions &rOptions, Epilogue &rEpilogue)
+{
+    const unsigned int nBlock = detail::kCurveBlock;
+    const unsigned int nBlocksX = (oDst.width() + nBlock - 1) / nBlock;
+    const unsigned int nBlocksY = (oDst.height() + nBlock - 1) / nBlock;
+    const std::vector<uint32_t> aOrder =
+        detail::curveOrder(nBlocksX, nBlocksY, rOptions.eTraversal);
+    const size_t nRuns = std::min<size_t>(aOrder.size(),
+                                          (size_t)workerCount(aOrder.size(),
+                                                              rOptions.nThreads) * 8);
+    const size_t nPerRun = nRuns > 0 ? (aOrder.size() + nRuns - 1) / nRuns : 0;
+
+    const unsigned int nWorkers = workerCount(nRuns, rOptions.nThreads);
+    const bool bStreaming = detail::useStreamingStores(rOptions, oDst);
+    detail::ScratchRows oScratch(bStreaming, nWorkers, nBlock);
+
+    rEpilogue.prepare(nWorkers);
+
+    parallelForWorkers(nRuns, [&](size_t iRun, unsigned int nWorker)
+    {
+        size_t nEnd = std::min(aOrder.size(), (iRun + 1) * nPerRun);
+        unsigned char *pScratch = oScratch.row(nWorker);
+
+        for (size_t i = iRun * nPerRun; i < nEnd; ++i)
+        {
+            unsigned int nX0 = (aOrder[i] % nBlocksX) * nBlock;
+            unsigned int nY0 = (aOrder[i] / nBlocksX) * nBlock;
+            unsigned int nWidth = std::min(nBlock, oDst.width() - nX0);
+            unsigned int nY1 = std::min(nY0 + nBlock, oDst.height());
+
+            for (unsigned int y = nY0; y < nY1; ++y)
+            {
+                detail::emitSegment(oSrc, oDstToSrc, rOptions, nWorker, nX0, y, nWidth,
+                                    oDst.row(y) + nX0, pScratch, rEpilogue);
+            }
+        }
+
+        if (bStreaming)
+        {
+            detail::streamFence();
+        }
+    }, rOptions.nThreads);
+}
+
+// Resamples oSrc into oDst, where destination pixel (x, y) takes the source
+// value at oDstToSrc(x + 0.5, y + 0.5).
+template <class Epilogue>
+void warpAffine(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                const AffineTransform &oDstToSrc, const RotateOptions &rOptions,
+                Epilogue &rEpilogue)
+{
+    if (rOptions.eTraversal != TRAVERSAL_TILES)
+    {
+        warpAffineCurve(oSrc, oDst, oDstToSrc, rOptions, rEpilogue);
+        return;
+    }
+
+    const unsigned int nTileWidth = std::max(1u, rOptions.nTileWidth);
+    const unsigned int nTileHeight = std::max(1u, rOptions.nTileHeight);
+    const unsigned int nTilesX = (oDst.width() + nTileWidth - 1) / nTileWidth;
+    const unsigned int nTilesY = (oDst.height() + nTileHeight - 1) / nTileHeight;
+    const size_t nTiles = (size_t)nTilesX * nTilesY;
+
+    const unsigned int nWorkers = workerCount(nTiles, rOptions.nThreads);
+    const bool bStreaming = detail::useStreamingStores(rOptions, oDst);
+    detail::ScratchRows oScratch(bStreaming, nWorkers,
+                                 std::min(nTileWidth, oDst.width()));
+
+    rEpilogue.prepare(nWorkers);
+
+    parallelForWorkers(nTiles, [&](size_t iTile, unsigned int nWorker)
+    {
+        unsigned int nX0 = (unsigned int)(iTile % nTilesX) * nTileWidth;
+        unsigned int nY0 = (unsigned int)(iTile / nTilesX) * nTileHeight;
+        unsigned int nWidth = std::min(nTileWidth, oDst.width() - nX0);
+        unsigned int nY1 = std::min(nY0 + nTileHeight, oDst.height());
+        unsigned char *pScratch = oScratch.row(nWorker);
+
+        for (unsigned int y = nY0; y < nY1; ++y)
+        {
+            detail::emitSegment(oSrc, oDstToSrc, rOptions, nWorker, nX0, y, nWidth,
+                                oDst.row(y) + nX0, pScratch, rEpilogue);
+        }
+
+        if (bStreaming)
+        {
+            detail::streamFence();
+        }
+    }, rOptions.nThreads);
+}
+
+inline void warpAffine(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                       const AffineTransform &oDstToSrc,
+                       const RotateOptions &rOptions)
+{
+    NoEpilogue oNone;
+    warpAffine(oSrc, oDst, oDstToSrc, rOptions, oNone);
+}
+
+// warpAffine over the tile grid (whatever rOptions.eTraversal) that calls
+// rSink(nFirstRow, nEndRow) for each row of tiles, top to bottom, once all
+// its tiles are written.  rSink runs on a thread of its own while the
+// workers continue, at most nWindowBands bands ahead of it; 0 picks enough
+// bands to keep every worker busy.  The first exception from rSink or from
+// a tile (the epilogue, say) stops both sides and is rethrown here.
+template <class Epilogue, class Sink>
+void warpAffineOrdered(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                       const AffineTransform &oDstToSrc,
+                       const RotateOptions &rOptions, Epilogue &rEpilogue,
+                       Sink &rSink, unsigned int nWindowBands = 0)
+{
+    const unsigned int nTileWidth = std::max(1u, rOptions.nTileWidth);
+    const unsigned int nTileHeight = std::max(1u, rOptions.nTileHeight);
+    const unsigned int nTilesX = (oDst.width() + nTileWidth - 1) / nTileWidth;
+    const unsigned int nTilesY = (oDst.height() + nTileHeight - 1) / nTileHeight;
+    const size_t nTiles = (size_t)nTilesX * nTilesY;
+    const unsigned int nWorkers = workerCount(nTiles, rOptions.nThreads);
+    const bool bStreaming = detail::useStreamingStores(rOptions, oDst);
+    detail::ScratchRows oScratch(bStreaming, nWorkers,
+                                 std::min(nTileWidth, oDst.width()));
+
+    // an empty row of tiles is complete from the start; nothing for the
+    // workers or the emitter to wait for
+    if (nTiles == 0)
+    {
+        rEpilogue.prepare(nWorkers);
+
+        for (unsigned int nBand = 0; nBand < nTilesY; ++nBand)
+        {
+            rSink(nBand * nTileHeight,
+                  std::min(oDst.height(), (nBand + 1) * nTileHeight));
+        }
+
+        return;
+    }
+
+    if (nWindowBands == 0)
+    {
+        nWindowBands = std::max(2u, (2 * nWorkers + nTilesX) / (nTilesX + 1));
+    }
+
+    std::vector<std::atomic<unsigned int>> aRemaining(nTilesY);
+    std::vector<char> aDone(nTilesY, 0);
+    unsigned int nComplete = 0; // bands 0 .. nComplete - 1 are written
+    unsigned int nEmitted = 0;  // and 0 .. nEmitted - 1 handed to rSink
+    bool bAbort = false;
+    std::exception_ptr pError; // the first failure, of rSink or of a tile
+    std::mutex oMutex;
+    std::condition_variable oCompleted, oEmitted;
+
+    for (unsigned int i = 0; i < nTilesY; ++i)
+    {
+        aRemaining[i] = nTilesX;
+    }
+
+    std::thread oEmitter([&]()
+    {
+        for (unsigned int nBand = 0; nBand < nTilesY; ++nBand)
+        {
+            {
+                std::unique_lock<std::mutex> oLock(oMutex);
+                oCompleted.wait(oLock, [&]() { return nComplete > nBand || bAbort; });
+
+                if (bAbort)
+                {
+                    return;
+                }
+            }
+
+            try
+            {
+                rSink(nBand * nTileHeight,
+                      std::min(oDst.height(), (nBand + 1) * nTileHeight));
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> oLock(oMutex);
+
+                if (!pError)
+                {
+                    pError = std::current_exception();
+                }
+
+                bAbort = true;
+                oEmitted.notify_all();
+                return;
+            }
+
+            std::lock_guard<std::mutex> oLock(oMutex);
+            nEmitted = nBand + 1;
+            oEmitted.notify_all();
+        }
+    });
+
+    rEpilogue.prepare(nWorkers);
+
+    try
+    {
+        parallelForWorkers(nTiles, [&](size_t iTile, unsigned int nWorker)
+        {
+            unsigned int nBand = (unsigned int)(iTile / nTilesX);
+
+            {
+                std::unique_lock<std::mutex> oLock(oMutex);
+                oEmitted.wait(oLock, [&]()
+                              { return nBand < nEmitted + nWindowBands || bAbort; });
+
+                if (bAbort)
+                {
+                    throw npp::Exception("warpAffineOrdered: aborted");
+                }
+            }
+
+            // a failed tile never completes its band: stop the emitter and
+            // every worker waiting for it
+            try
+            {
+                unsigned int nX0 = (unsigned int)(iTile % nTilesX) * nTileWidth;
+                unsigned int nY0 = nBand * nTileHeight;
+                unsigned int nWidth = std::min(nTileWidth, oDst.width() - nX0);
+                unsigned int nY1 = std::min(nY0 + nTileHeight, oDst.height());
+                unsigned char *pScratch = oScratch.row(nWorker);
+
+                for (unsigned int y = nY0; y < nY1; ++y)
+                {
+                    detail::emitSegment(oSrc, oDstToSrc, rOptions, nWorker, nX0, y,
+                                        nWidth, oDst.row(y) + nX0, pScratch,
+                                        rEpilogue);
+                }
+
+                if (bStreaming)
+                {
+                    detail::streamFence();
+                }
+
+                if (aRemaining[nBand].fetch_sub(1) == 1)
+                {
+                    std::lock_guard<std::mutex> oLock(oMutex);
+                    aDone[nBand] = 1;
+
+                    while (nComplete < nTilesY && aDone[nComplete])
+                    {
+                        ++nComplete;
+                    }
+
+                    oCompleted.notify_one();
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> oLock(oMutex);
+
+                if (!pError)
+                {
+                    pError = std::current_exception();
+                }
+
+                bAbort = true;
+                oCompleted.notify_all();
+                oEmitted.notify_all();
+                throw;
+            }
+        }, rOptions.nThreads);
+    }
+    catch (...)
+    {
+        {
+            std::lock_guard<std::mutex> oLock(oMutex);
+            bAbort = true;
+            oCompleted.notify_one();
+        }
+
+        oEmitter.join();
+
+        if (pError)
+        {
+            std::rethrow_exception(pError);
+        }
+
+        throw;
+    }
+
+    oEmitter.join();
+
+    if (pError)
+    {
+        std::rethrow_exception(pError);
+    }
+}
+
+// Rotates oSrc into oDst, which is normally rGeometry.nDstWidth x nDstHeight.
+template <class Epilogue>
+void rotate(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+            const RotateGeometry &rGeometry, const RotateOptions &rOptions,
+            Epilogue &rEpilogue)
+{
+    warpAffine(oSrc, oDst, rGeometry.oInverse, rOptions, rEpilogue);
+}
+
+inline void rotate(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                   const RotateGeometry &rGeometry, const RotateOptions &rOptions)
+{
+    NoEpilogue oNone;
+    warpAffine(oSrc, oDst, rGeometry.oInverse, rOptions, oNone);
+}
+
+// rotate() handing finished row bands to rSink in order, see
+// warpAffineOrdered().
+template <class Epilogue, class Sink>
+void rotateOrdered(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                   const RotateGeometry &rGeometry, const RotateOptions &rOptions,
+                   Epilogue &rEpilogue, Sink &rSink)
+{
+    warpAffineOrdered(oSrc, oDst, rGeometry.oInverse, rOptions, rEpilogue, rSink);
+}
+
+// Materializes oSrc reoriented by rOrientation into oDst, which must have the
+// oriented size.  Every destination row is a source row or column read at a
+// constant stride; transposes go tile by tile so both sides stay in cache.
+inline void orient(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                   const Orientation &rOrientation, unsigned int nThreads = 0)
+{
+    const unsigned int nWidth = rOrientation.width(oSrc.width(), oSrc.height());
+    const unsigned int nHeight = rOrientation.height(oSrc.width(), oSrc.height());
+
+    if (oDst.width() != nWidth || oDst.height() != nHeight)
+    {
+        throw npp::Exception("orient: destination has the wrong size");
+    }
+
+    const unsigned int nTile = 64;
+    const unsigned int nTilesX = (nWidth + nTile - 1) / nTile;
+    const size_t nTiles = (size_t)nTilesX * ((nHeight + nTile - 1) / nTile);
+    const std::ptrdiff_t nStep = (rOrientation.bFlipX ? -1 : 1) *
+                                 (rOrientation.bTranspose ? oSrc.pitch() : 1);
+
+    parallelFor(nTiles, [&](size_t iTile)
+    {
+        unsigned int nX0 = (unsigned int)(iTile % nTilesX) * nTile;
+        unsigned int nY0 = (unsigned int)(iTile / nTilesX) * nTile;
+        unsigned int nX1 = std::min(nX0 + nTile, nWidth);
+        unsigned int nY1 = std::min(nY0 + nTile, nHeight);
+
+        for (unsigned int y = nY0; y < nY1; ++y)
+        {
+            // undo the mirrors, then the transpose, for pixel (nX0, y)
+            unsigned int nX = rOrientation.bFlipX ? nWidth - 1 - nX0 : nX0;
+            unsigned int nY = rOrientation.bFlipY ? nHeight - 1 - y : y;
+            const unsigned char *pIn = rOrientation.bTranspose
+                                           ? oSrc.row(nX) + nY
+                                           : oSrc.row(nY) + nX;
+            unsigned char *pOut = oDst.row(y);
+
+            for (unsigned int x = nX0; x < nX1; ++x, pIn += nStep)
+            {
+                pOut[x] = *pIn;
+            }
+        }
+    }, nThreads);
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_ROTATE_CPU_H
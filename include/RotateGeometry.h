@@ -0,0 +1,483 @@
+/* Geometry of the rotation pipeline.
+ *
+ * An AffineTransform maps (x, y) to (a x + b y + c, d x + e y + f).  A
+ * RotateGeometry holds the forward source-to-destination transform of a
+ * rotation together with its inverse, which is what the kernels evaluate for
+ * every destination pixel, and the destination size that exactly contains the
+ * rotated source (the same box nppiGetRotateBound reports).
+ *
+ * Angles are in degrees and rotate counter-clockwise on screen (y pointing
+ * down), as nppiRotate does.
+ *
+ * Mirroring and transposition form an Orientation.  They are not applied to
+ * the pixels on their own but folded into the warp's affine map, so they cost
+ * nothing on top of the rotation that reads the source anyway.
+ *
+ * sourceBounds() and sourceBands() give the source pixels a destination
+ * rectangle actually reads, so device and tiled paths move no more source
+ * than that.
+ */
+
+#ifndef PIPELINE_ROTATE_GEOMETRY_H
+#define PIPELINE_ROTATE_GEOMETRY_H
+
+#include <Exceptions.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace pipeline
+{
+
+struct AffineTransform
+{
+    double a, b, c;
+    double d, e, f;
+
+    static AffineTransform identity()
+    {
+        AffineTransform oT = {1.0, 0.0, 0.0, 0.0, 1.0, 0.0};
+        return oT;
+    }
+
+    static AffineTransform translation(double nX, double nY)
+    {
+        AffineTransform oT = {1.0, 0.0, nX, 0.0, 1.0, nY};
+        return oT;
+    }
+
+    // Counter-clockwise rotation on screen about the origin.  Multiples of
+    // 90 degrees produce exact coefficients.
+    static AffineTransform rotation(double nAngle)
+    {
+        double nQuarterTurns = nAngle / 90.0;
+        double nCos, nSin;
+
+        if (std::fabs(nQuarterTurns - std::floor(nQuarterTurns + 0.5)) < 1e-12)
+        {
+            static const double aCos[4] = {1.0, 0.0, -1.0, 0.0};
+            static const double aSin[4] = {0.0, 1.0, 0.0, -1.0};
+            int nQuarter = ((int)std::floor(nQuarterTurns + 0.5) % 4 + 4) % 4;
+            nCos = aCos[nQuarter];
+            nSin = aSin[nQuarter];
+        }
+        else
+        {
+            double nRadians = nAngle * 3.14159265358979323846 / 180.0;
+            nCos = std::cos(nRadians);
+            nSin = std::sin(nRadians);
+        }
+
+        AffineTransform oT = {nCos, nSin, 0.0, -nSin, nCos, 0.0};
+        return oT;
+    }
+
+    static AffineTransform scale(double nX, double nY)
+    {
+        AffineTransform oT = {nX, 0.0, 0.0, 0.0, nY, 0.0};
+        return oT;
+    }
+
+    // (*this) after rOther, i.e. x -> this(rOther(x)).
+    AffineTransform operator*(const AffineTransform &rOther) const
+    {
+        AffineTransform oT = {a * rOther.a + b * rOther.d,
+                              a * rOther.b + b * rOther.e,
+                              a * rOther.c + b * rOther.f + c,
+                              d * rOther.a + e * rOther.d,
+                              d * rOther.b + e * rOther.e,
+                              d * rOther.c + e * rOther.f + f};
+        return oT;
+    }
+
+    AffineTransform inverse() const
+    {
+        double nDet = a * e - b * d;
+
+        if (std::fabs(nDet) < 1e-300)
+        {
+            throw npp::Exception("AffineTransform: matrix is singular");
+        }
+
+        double nInv = 1.0 / nDet;
+        AffineTransform oT = {e * nInv, -b * nInv, (b * f - e * c) * nInv,
+                              -d * nInv, a * nInv, (d * c - a * f) * nInv};
+        return oT;
+    }
+
+    void apply(double nX, double nY, double &rX, double &rY) const
+    {
+        rX = a * nX + b * nY + c;
+        rY = d * nX + e * nY + f;
+    }
+};
+
+// Axis aligned rectangle in pixel units, half open: [x, x + width).
+struct PixelRect
+{
+    int x, y;
+    int width, height;
+
+    bool empty() const
+    {
+        return width <= 0 || height <= 0;
+    }
+};
+
+// Bounding box of rRect's image under oT, in continuous coordinates.
+inline void transformedBounds(const AffineTransform &oT, double nX0, double nY0,
+                              double nX1, double nY1, double &rMinX,
+                              double &rMinY, double &rMaxX, double &rMaxY)
+{
+    const double aX[4] = {nX0, nX1, nX0, nX1};
+    const double aY[4] = {nY0, nY0, nY1, nY1};
+
+    rMinX = rMinY = HUGE_VAL;
+    rMaxX = rMaxY = -HUGE_VAL;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        double nX, nY;
+        oT.apply(aX[i], aY[i], nX, nY);
+        rMinX = std::min(rMinX, nX);
+        rMaxX = std::max(rMaxX, nX);
+        rMinY = std::min(rMinY, nY);
+        rMaxY = std::max(rMaxY, nY);
+    }
+}
+
+// Bounding box of the part of the parallelogram oT([nX0, nX1] x [nY0, nY1])
+// that lies in [nLeft, nRight] x [nTop, nBottom].  False when they do not
+// meet.
+inline bool clippedBounds(const AffineTransform &oT, double nX0, double nY0,
+                          double nX1, double nY1, double nLeft, double nTop,
+                          double nRight, double nBottom, double &rMinX,
+                          double &rMinY, double &rMaxX, double &rMaxY)
+{
+    // Sutherland-Hodgman against the four sides; a convex quadrilateral cut
+    // by four half planes keeps at most eight vertices
+    double aX[16], aY[16], aOutX[16], aOutY[16];
+    int nCount = 4;
+    oT.apply(nX0, nY0, aX[0], aY[0]);
+    oT.apply(nX1, nY0, aX[1], aY[1]);
+    oT.apply(nX1, nY1, aX[2], aY[2]);
+    oT.apply(nX0, nY1, aX[3], aY[3]);
+
+    for (int nSide = 0; nSide < 4 && nCount > 0; ++nSide)
+    {
+        // signed distance inside the side, >= 0 keeps the point
+        const double nSign = nSide < 2 ? 1.0 : -1.0;
+        const double nEdge = nSide == 0 ? nLeft
+                           : nSide == 1 ? nTop
+                           : nSide == 2 ? nRight
+                                        : nBottom;
+        const double *pCoord = nSide % 2 == 0 ? aX : aY;
+        int nOut = 0;
+
+        for (int i = 0; i < nCount; ++i)
+        {
+            int j = (i + 1) % nCount;
+            double nDi = nSign * (pCoord[i] - nEdge);
+            double nDj = nSign * (pCoord[j] - nEdge);
+
+            if (nDi >= 0.0)
+            {
+                aOutX[nOut] = aX[i];
+                aOutY[nOut] = aY[i];
+                ++nOut;
+            }
+
+            if ((nDi >= 0.0) != (nDj >= 0.0))
+            {
+                double t = nDi / (nDi - nDj);
+                aOutX[nOut] = aX[i] + t * (aX[j] - aX[i]);
+                aOutY[nOut] = aY[i] + t * (aY[j] - aY[i]);
+                ++nOut;
+            }
+        }
+
+        std::copy(aOutX, aOutX + nOut, aX);
+        std::copy(aOutY, aOutY + nOut, aY);
+        nCount = nOut;
+    }
+
+    if (nCount == 0)
+    {
+        return false;
+    }
+
+    rMinX = *std::min_element(aX, aX + nCount);
+    rMaxX = *std::max_element(aX, aX + nCount);
+    rMinY = *std::min_element(aY, aY + nCount);
+    rMaxY = *std::max_element(aY, aY + nCount);
+    return true;
+}
+
+// One of the eight symmetries of the pixel grid: an optional transpose
+// (swapping x and y) followed by optional mirrors of the resulting x and y.
+struct Orientation
+{
+    bool bTranspose;
+    bool bFlipX;
+    bool bFlipY;
+
+    Orientation() : bTranspose(false), bFlipX(false), bFlipY(false)
+    {
+    }
+
+    Orientation(bool bTransposeXY, bool bMirrorX, bool bMirrorY)
+        : bTranspose(bTransposeXY), bFlipX(bMirrorX), bFlipY(bMirrorY)
+    {
+    }
+
+    static Orientation flipHorizontal()
+    {
+        return Orientation(false, true, false);
+    }
+
+    static Orientation flipVertical()
+    {
+        return Orientation(false, false, true);
+    }
+
+    static Orientation transpose()
+    {
+        return Orientation(true, false, false);
+    }
+
+    // The rotation by nQuarterTurns right angles, counter-clockwise on
+    // screen like AffineTransform::rotation().
+    static Orientation rotation(int nQuarterTurns)
+    {
+        switch ((nQuarterTurns % 4 + 4) % 4)
+        {
+        case 1:
+            return Orientation(true, false, true);
+        case 2:
+            return Orientation(false, true, true);
+        case 3:
+            return Orientation(true, true, false);
+        default:
+            return Orientation();
+        }
+    }
+
+    // The orientation that brings an image stored with the EXIF (and TIFF)
+    // orientation tag nTag upright; identity for 1 and invalid values.
+    static Orientation exif(unsigned int nTag)
+    {
+        switch (nTag)
+        {
+        case 2:
+            return flipHorizontal();
+        case 3:
+            return rotation(2);
+        case 4:
+            return flipVertical();
+        case 5:
+            return transpose();
+        case 6:
+            return rotation(3);
+        case 7:
+            return Orientation(true, true, true);
+        case 8:
+            return rotation(1);
+        default:
+            return Orientation();
+        }
+    }
+
+    bool isIdentity() const
+    {
+        return !bTranspose && !bFlipX && !bFlipY;
+    }
+
+    // This orientation followed by rNext.
+    Orientation then(const Orientation &rNext) const
+    {
+        // moving a transpose in front of mirrors swaps the mirrored axes
+        bool bX = rNext.bTranspose ? bFlipY : bFlipX;
+        bool bY = rNext.bTranspose ? bFlipX : bFlipY;
+        return Orientation(bTranspose != rNext.bTranspose, bX != rNext.bFlipX,
+                           bY != rNext.bFlipY);
+    }
+
+    unsigned int width(unsigned int nWidth, unsigned int nHeight) const
+    {
+        return bTranspose ? nHeight : nWidth;
+    }
+
+    unsigned int height(unsigned int nWidth, unsigned int nHeight) const
+    {
+        return bTranspose ? nWidth : nHeight;
+    }
+
+    // Maps a nWidth x nHeight image onto its oriented image, in continuous
+    // pixel coordinates.
+    AffineTransform transform(unsigned int nWidth, unsigned int nHeight) const
+    {
+        double nW = width(nWidth, nHeight);
+        double nH = height(nWidth, nHeight);
+        AffineTransform oT = AffineTransform::identity();
+
+        if (bTranspose)
+        {
+            AffineTransform oSwap = {0.0, 1.0, 0.0, 1.0, 0.0, 0.0};
+            oT = oSwap;
+        }
+
+        if (bFlipX)
+        {
+            AffineTransform oMirror = {-1.0, 0.0, nW, 0.0, 1.0, 0.0};
+            oT = oMirror * oT;
+        }
+
+        if (bFlipY)
+        {
+            AffineTransform oMirror = {1.0, 0.0, 0.0, 0.0, -1.0, nH};
+            oT = oMirror * oT;
+        }
+
+        return oT;
+    }
+};
+
+struct RotateGeometry
+{
+    unsigned int nSrcWidth, nSrcHeight;
+    unsigned int nDstWidth, nDstHeight;
+    // source to destination and destination to source pixel coordinates,
+    // both in continuous coordinates where pixel (i, j) covers [i, i + 1)
+    AffineTransform oForward;
+    AffineTransform oInverse;
+};
+
+// Geometry of an arbitrary affine warp of a nSrcWidth x nSrcHeight image,
+// translated so the warped image's bounding box starts at (0, 0).
+inline RotateGeometry makeWarpGeometry(unsigned int nSrcWidth,
+                                       unsigned int nSrcHeight,
+                                       const AffineTransform &oTransform)
+{
+    double nMinX, nMinY, nMaxX, nMaxY;
+    transformedBounds(oTransform, 0.0, 0.0, nSrcWidth, nSrcHeight, nMinX,
+                      nMinY, nMaxX, nMaxY);
+
+    // snap away the rounding noise of the trigonometry before rounding out
+    const double kEpsilon = 1e-9;
+    double nX0 = std::floor(nMinX + kEpsilon);
+    double nY0 = std::floor(nMinY + kEpsilon);
+    double nX1 = std::ceil(nMaxX - kEpsilon);
+    double nY1 = std::ceil(nMaxY - kEpsilon);
+
+    RotateGeometry oGeometry;
+    oGeometry.nSrcWidth = nSrcWidth;
+    oGeometry.nSrcHeight = nSrcHeight;
+    oGeometry.nDstWidth = (unsigned int)std::max(0.0, nX1 - nX0);
+    oGeometry.nDstHeight = (unsigned int)std::max(0.0, nY1 - nY0);
+    oGeometry.oForward = AffineTransform::translation(-nX0, -nY0) * oTransform;
+    oGeometry.oInverse = oGeometry.oForward.inverse();
+    return oGeometry;
+}
+
+// Source pixels in rows [nFirstRow, nEndRow) read to produce the destination
+// pixels in rDst, empty when none are.  A destination pixel samples the
+// source at the inverse image of its centre, (u, v), and reads the nTaps x
+// nTaps pixels starting at floor(u - (nTaps - 1) / 2), floor(v - (nTaps -
+// 1) / 2), clamped to the image: 1 tap for nearest neighbour, 2 for
+// bilinear.  Samples outside the source read nothing, so the sampled
+// parallelogram is clipped to the source and to the sample rows reaching
+// the band before taking its bounds; kSampleSlack covers the rounding of the
+// host kernels' fixed point walk.  Samplers with other arithmetic, such as
+// nppiRotate, need a guard of their own (DeviceShards.h).
+inline PixelRect sourceBandBounds(const RotateGeometry &rGeometry,
+                                  const PixelRect &rDst, unsigned int nTaps,
+                                  unsigned int nFirstRow, unsigned int nEndRow)
+{
+    const double kSampleSlack = 1e-3;
+    nTaps = std::max(1u, nTaps);
+    nEndRow = std::min(nEndRow, rGeometry.nSrcHeight);
+    const double nWidth = rGeometry.nSrcWidth;
+    const double nReach = (nTaps - 1) * 0.5;
+    PixelRect oBounds = {0, 0, 0, 0};
+    double nMinX, nMinY, nMaxX, nMaxY;
+
+    // row r is read by the samples with v in [r + 1 - nTaps + nReach, r + 1 + nReach)
+    double nTop = std::max(0.0, nFirstRow + 1.0 - nTaps + nReach);
+    double nBottom = std::min((double)rGeometry.nSrcHeight, nEndRow + nReach);
+
+    if (rDst.empty() || nFirstRow >= nEndRow ||
+        !clippedBounds(rGeometry.oInverse, rDst.x + 0.5, rDst.y + 0.5,
+                       rDst.x + rDst.width - 0.5, rDst.y + rDst.height - 0.5,
+                       -kSampleSlack, nTop - kSampleSlack, nWidth + kSampleSlack,
+                       nBottom + kSampleSlack, nMinX, nMinY, nMaxX, nMaxY))
+    {
+        return oBounds;
+    }
+
+    double nX0 = std::max(0.0, std::floor(nMinX - nReach - kSampleSlack));
+    double nY0 = std::max((double)nFirstRow,
+                          std::floor(nMinY - nReach - kSampleSlack));
+    double nX1 = std::min(nWidth, std::floor(nMaxX - nReach + kSampleSlack) + nTaps);
+    double nY1 = std::min((double)nEndRow,
+                          std::floor(nMaxY - nReach + kSampleSlack) + nTaps);
+
+    if (nX1 > nX0 && nY1 > nY0)
+    {
+        oBounds.x = (int)nX0;
+        oBounds.y = (int)nY0;
+        oBounds.width = (int)(nX1 - nX0);
+        oBounds.height = (int)(nY1 - nY0);
+    }
+
+    return oBounds;
+}
+
+// Source pixels read to produce the destination pixels in rDst.
+inline PixelRect sourceBounds(const RotateGeometry &rGeometry, const PixelRect &rDst,
+                              unsigned int nTaps)
+{
+    return sourceBandBounds(rGeometry, rDst, nTaps, 0, rGeometry.nSrcHeight);
+}
+
+// The source pixels rDst reads as bands of nBandRows rows, each narrowed to
+// the columns its rows need.  A rotated rectangle reads a slanted strip of
+// the source; the bands follow the slant where a single bounding box would
+// carry the empty corners along.
+inline std::vector<PixelRect> sourceBands(const RotateGeometry &rGeometry,
+                                          const PixelRect &rDst, unsigned int nTaps,
+                                          unsigned int nBandRows)
+{
+    std::vector<PixelRect> aBands;
+    PixelRect oBounds = sourceBounds(rGeometry, rDst, nTaps);
+    nBandRows = std::max(1u, nBandRows);
+
+    for (int y = oBounds.y; y < oBounds.y + oBounds.height; y += nBandRows)
+    {
+        unsigned int nEnd = std::min<unsigned int>(y + nBandRows,
+                                                   oBounds.y + oBounds.height);
+        PixelRect oBand = sourceBandBounds(rGeometry, rDst, nTaps, y, nEnd);
+
+        if (!oBand.empty())
+        {
+            aBands.push_back(oBand);
+        }
+    }
+
+    return aBands;
+}
+
+// Rotation of a nSrcWidth x nSrcHeight image by nAngle degrees, after
+// reorienting it by rOrientation.
+inline RotateGeometry makeRotateGeometry(unsigned int nSrcWidth,
+                                         unsigned int nSrcHeight, double nAngle,
+                                         const Orientation &rOrientation = Orientation())
+{
+    return makeWarpGeometry(nSrcWidth, nSrcHeight,
+                            AffineTransform::rotation(nAngle) *
+                                rOrientation.transform(nSrcWidth, nSrcHeight));
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_ROTATE_GEOMETRY_H
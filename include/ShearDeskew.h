@@ -0,0 +1,426 @@
+/* Small-angle rotation on the host as two one-dimensional shears.
+ *
+ * A rotation by a few degrees is close to a horizontal shear followed by a
+ * vertical one, x1 = x + s y and y2 = y1 - s x1 with s the sine of the
+ * angle, applied about the image centres.  Each shear moves whole rows (or
+ * columns) by a constant sub-pixel offset, so the first pass is a memcpy or
+ * a blend of two source row spans with one weight per row, and the second
+ * a blend of two intermediate rows with one weight per column.  Neither
+ * pass evaluates a 2D mapping per pixel.
+ *
+ * The shears do not make an exact rotation: the cosine terms are replaced
+ * by 1 and 1 - s^2, which displaces samples by about s^2 / 2 times their
+ * distance from the centre.  shearDeskewError() bounds the displacement
+ * over the image against the exact rotation of the same RotateGeometry;
+ * callers compare it with what they can tolerate before choosing this over
+ * rotate().  The destination is the exact rotation's, so the two are
+ * interchangeable.
+ */
+
+#ifndef PIPELINE_SHEAR_DESKEW_H
+#define PIPELINE_SHEAR_DESKEW_H
+
+#include <Exceptions.h>
+
+#include "ImageView.h"
+#include "Parallel.h"
+#include "RotateCPU.h"
+#include "RotateGeometry.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace pipeline
+{
+
+// Largest rotation, in degrees, the shear engine accepts.
+static const double kMaxShearAngle = 2.0;
+
+namespace detail
+{
+
+static const int kShearWeightBits = 8;
+static const unsigned int kShearWeightOne = 1u << kShearWeightBits;
+
+// Rows per work item of both passes.
+static const unsigned int kShearBandRows = 16;
+
+// The shear factor and centres of a small rotation, in continuous
+// coordinates: destination = cd + Sy Sx (source - cs).
+struct ShearPlan
+{
+    double nShear;
+    double nSrcCenterX, nSrcCenterY;
+    double nDstCenterX, nDstCenterY;
+};
+
+// False unless rGeometry is a rotation by at most kMaxShearAngle.
+inline bool shearPlan(const RotateGeometry &rGeometry, ShearPlan &rPlan)
+{
+    const AffineTransform &rT = rGeometry.oForward;
+    const double nTolerance = 1e-9;
+
+    if (std::fabs(rT.a - rT.e) > nTolerance || std::fabs(rT.b + rT.d) > nTolerance ||
+        std::fabs(rT.a * rT.a + rT.b * rT.b - 1.0) > nTolerance || rT.a <= 0.0 ||
+        std::fabs(rT.b) > std::sin(kMaxShearAngle * 3.14159265358979323846 / 180.0) +
+                              nTolerance)
+    {
+        return false;
+    }
+
+    rPlan.nShear = rT.b;
+    rPlan.nSrcCenterX = 0.5 * rGeometry.nSrcWidth;
+    rPlan.nSrcCenterY = 0.5 * rGeometry.nSrcHeight;
+    rT.apply(rPlan.nSrcCenterX, rPlan.nSrcCenterY, rPlan.nDstCenterX,
+             rPlan.nDstCenterY);
+    return true;
+}
+
+// Splits the sample position t into floor and a rounded weight of the
+// second tap.
+inline void shearTaps(double t, int &rFirst, unsigned int &rWeight)
+{
+    double nFloor = std::floor(t);
+    rFirst = (int)nFloor;
+    rWeight = (unsigned int)std::floor((t - nFloor) * kShearWeightOne + 0.5);
+
+    if (rWeight == kShearWeightOne)
+    {
+        ++rFirst;
+        rWeight = 0;
+    }
+}
+
+inline unsigned char shearBlend(unsigned int nA, unsigned int nB, unsigned int nWeight)
+{
+    return (unsigned char)((nA * (kShearWeightOne - nWeight) + nB * nWeight +
+                            kShearWeightOne / 2) >> kShearWeightBits);
+}
+
+// Half-open range [rBegin, rEnd) of i in [0, nCount) whose sample position
+// i + t lies in a source of nSize pixels, i.e. 0 <= i + t + 0.5 < nSize.
+inline void shearInside(double t, unsigned int nSize, unsigned int nCount,
+                        unsigned int &rBegin, unsigned int &rEnd)
+{
+    double nBegin = std::ceil(-t - 0.5);
+    double nEnd = std::ceil(nSize - t - 0.5);
+    rBegin = (unsigned int)std::min<double>(nCount, std::max(0.0, nBegin));
+    rEnd = (unsigned int)std::min<double>(nCount, std::max<double>(rBegin, nEnd));
+}
+
+// Horizontal pass: row y of oMid is source row y moved by the offset of
+// that row.
+inline void shearRow(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oMid,
+                     const ShearPlan &rPlan, const RotateOptions &rOptions,
+                     unsigned int y)
+{
+    const double t = rPlan.nSrcCenterX - rPlan.nDstCenterX -
+                     rPlan.nShear * (y + 0.5 - rPlan.nSrcCenterY);
+    const unsigned char *pSrc = oSrc.row(y);
+    unsigned char *pMid = oMid.row(y);
+    const int nLast = (int)oSrc.width() - 1;
+    unsigned int nBegin, nEnd;
+    shearInside(t, oSrc.width(), oMid.width(), nBegin, nEnd);
+
+    memset(pMid, rOptions.nBackground, nBegin);
+    memset(pMid + nEnd, rOptions.nBackground, oMid.width() - nEnd);
+
+    if (rOptions.eInterpolation == INTER_NN)
+    {
+        int k = (int)std::floor(t + 0.5);
+        memcpy(pMid + nBegin, pSrc + (int)nBegin + k, nEnd - nBegin);
+        return;
+    }
+
+    int k;
+    unsigned int nWeight;
+    shearTaps(t, k, nWeight);
+
+    // the taps of columns near the source edges are clamped
+    unsigned int nFastBegin = std::min<unsigned int>(
+        nEnd, (unsigned int)std::max<int>(nBegin, -k));
+    unsigned int nFastEnd = (unsigned int)std::max<int>(
+        nFastBegin, std::min<int>(nEnd, nLast - k));
+
+    for (unsigned int i = nBegin; i < nEnd; ++i)
+    {
+        if (i == nFastBegin)
+        {
+            const unsigned char *pA = pSrc + k;
+            const unsigned char *pB = pA + 1;
+
+            if (nWeight == 0)
+            {
+                memcpy(pMid + i, pA + i, nFastEnd - i);
+            }
+            else
+            {
+                for (unsigned int j = i; j < nFastEnd; ++j)
+                {
+                    pMid[j] = shearBlend(pA[j], pB[j], nWeight);
+                }
+            }
+
+            if (nFastEnd == nEnd)
+            {
+                break;
+            }
+
+            i = nFastEnd;
+        }
+
+        int nA = std::min(nLast, std::max(0, (int)i + k));
+        int nB = std::min(nLast, std::max(0, (int)i + k + 1));
+        pMid[i] = shearBlend(pSrc[nA], pSrc[nB], nWeight);
+    }
+}
+
+// Columns of the vertical pass that read the same pair of rows.
+struct ShearRun
+{
+    unsigned int nBegin, nEnd;
+    int nFirst;
+    // destination rows for which every column of the run is inside the
+    // source and reads unclamped rows
+    int nFastBegin, nFastEnd;
+};
+
+struct ShearColumns
+{
+    std::vector<uint16_t> aWeight;
+    std::vector<unsigned int> aBegin, aEnd; // inside rows per column
+    std::vector<int> aFirst;
+    std::vector<ShearRun> aRuns;
+};
+
+inline ShearColumns shearColumns(const ShearPlan &rPlan, Interpolation eInterpolation,
+                                 unsigned int nMidHeight, unsigned int nDstWidth,
+                                 unsigned int nDstHeight)
+{
+    ShearColumns oColumns;
+    oColumns.aWeight.resize(nDstWidth);
+    oColumns.aBegin.resize(nDstWidth);
+    oColumns.aEnd.resize(nDstWidth);
+    oColumns.aFirst.resize(nDstWidth);
+
+    for (unsigned int x = 0; x < nDstWidth; ++x)
+    {
+        const double t = rPlan.nSrcCenterY - rPlan.nDstCenterY +
+                         rPlan.nShear * (x + 0.5 - rPlan.nDstCenterX);
+        unsigned int nWeight = 0;
+
+        if (eInterpolation == INTER_NN)
+        {
+            oColumns.aFirst[x] = (int)std::floor(t + 0.5);
+        }
+        else
+        {
+            shearTaps(t, oColumns.aFirst[x], nWeight);
+        }
+
+        oColumns.aWeight[x] = (uint16_t)nWeight;
+        shearInside(t, nMidHeight, nDstHeight, oColumns.aBegin[x], oColumns.aEnd[x]);
+    }
+
+    const int nTaps = eInterpolation == INTER_NN ? 1 : 2;
+
+    for (unsigned int x = 0; x < nDstWidth;)
+    {
+        ShearRun oRun;
+        oRun.nBegin = x;
+        oRun.nFirst = oColumns.aFirst[x];
+        oRun.nFastBegin = -oRun.nFirst;
+        oRun.nFastEnd = (int)nMidHeight - oRun.nFirst - (nTaps - 1);
+
+        for (; x < nDstWidth && oColumns.aFirst[x] == oRun.nFirst; ++x)
+        {
+            oRun.nFastBegin = std::max(oRun.nFastBegin, (int)oColumns.aBegin[x]);
+            oRun.nFastEnd = std::min(oRun.nFastEnd, (int)oColumns.aEnd[x]);
+        }
+
+        oRun.nEnd = x;
+        oColumns.aRuns.push_back(oRun);
+    }
+
+    return oColumns;
+}
+
+// Vertical pass: destination row y, column x, is intermediate column x
+// moved by the offset of that column.
+inline void shearColumnsRow(ImageConstView_8u_C1 oMid, unsigned char *pDst,
+                            const ShearColumns &rColumns,
+                            const RotateOptions &rOptions, unsigned int y)
+{
+    const int nLast = (int)oMid.height() - 1;
+    const int nY = (int)y;
+
+    for (size_t r = 0; r < rColumns.aRuns.size(); ++r)
+    {
+        const ShearRun &rRun = rColumns.aRuns[r];
+        const unsigned int nCount = rRun.nEnd - rRun.nBegin;
+
+        if (nY >= rRun.nFastBegin && nY < rRun.nFastEnd)
+        {
+            const unsigned char *pA = oMid.row(nY + rRun.nFirst);
+
+            if (rOptions.eInterpolation == INTER_NN)
+            {
+                memcpy(pDst + rRun.nBegin, pA + rRun.nBegin, nCount);
+                continue;
+            }
+
+            const unsigned char *pB = oMid.row(nY + rRun.nFirst + 1);
+            const uint16_t *pWeight = &rColumns.aWeight[0];
+
+            for (unsigned int x = rRun.nBegin; x < rRun.nEnd; ++x)
+            {
+                pDst[x] = shearBlend(pA[x], pB[x], pWeight[x]);
+            }
+
+            continue;
+        }
+
+        for (unsigned int x = rRun.nBegin; x < rRun.nEnd; ++x)
+        {
+            if (y < rColumns.aBegin[x] || y >= rColumns.aEnd[x])
+            {
+                pDst[x] = rOptions.nBackground;
+                continue;
+            }
+
+            int nA = std::min(nLast, std::max(0, nY + rRun.nFirst));
+
+            if (rOptions.eInterpolation == INTER_NN)
+            {
+                pDst[x] = oMid.row(nA)[x];
+                continue;
+            }
+
+            int nB = std::min(nLast, std::max(0, nY + rRun.nFirst + 1));
+            pDst[x] = shearBlend(oMid.row(nA)[x], oMid.row(nB)[x],
+                                 rColumns.aWeight[x]);
+        }
+    }
+}
+
+} // namespace detail
+
+// Whether the shear engine can approximate the rotation of rGeometry.
+inline bool shearDeskewApplies(const RotateGeometry &rGeometry)
+{
+    detail::ShearPlan oPlan;
+    return detail::shearPlan(rGeometry, oPlan);
+}
+
+// Upper bound, in source pixels, on how far the shear engine's sample
+// positions lie from the exact rotation's over the rotated image.  The
+// geometric part peaks at a source corner; linear sampling adds the
+// rounding of the blend weights, nearest neighbour the horizontal offset of
+// the rounded intermediate row.
+inline double shearDeskewError(const RotateGeometry &rGeometry,
+                               Interpolation eInterpolation)
+{
+    detail::ShearPlan oPlan;
+
+    if (!detail::shearPlan(rGeometry, oPlan))
+    {
+        throw npp::Exception("shearDeskewError: not a small rotation");
+    }
+
+    const double s = oPlan.nShear;
+    const double aCornerX[4] = {0.0, (double)rGeometry.nSrcWidth, 0.0,
+                                (double)rGeometry.nSrcWidth};
+    const double aCornerY[4] = {0.0, 0.0, (double)rGeometry.nSrcHeight,
+                                (double)rGeometry.nSrcHeight};
+    double nError = 0.0;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        double nDstX, nDstY;
+        rGeometry.oForward.apply(aCornerX[i], aCornerY[i], nDstX, nDstY);
+
+        // invert Sy, then Sx
+        double nX1 = nDstX - oPlan.nDstCenterX;
+        double nY1 = nDstY - oPlan.nDstCenterY + s * nX1;
+        double nX = nX1 - s * nY1 + oPlan.nSrcCenterX;
+        double nY = nY1 + oPlan.nSrcCenterY;
+
+        nError = std::max(nError, std::hypot(nX - aCornerX[i], nY - aCornerY[i]));
+    }
+
+    if (eInterpolation == INTER_NN)
+    {
+        return nError + 0.5 * std::fabs(s);
+    }
+
+    return nError + std::sqrt(2.0) * 0.5 / detail::kShearWeightOne;
+}
+
+// Rotates oSrc into oDst, which is normally rGeometry.nDstWidth x nDstHeight,
+// with a horizontal and a vertical shear.  rGeometry must be a rotation by
+// at most kMaxShearAngle degrees (shearDeskewApplies()).
+template <class Epilogue>
+void shearDeskew(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                 const RotateGeometry &rGeometry, const RotateOptions &rOptions,
+                 Epilogue &rEpilogue)
+{
+    detail::ShearPlan oPlan;
+
+    if (!detail::shearPlan(rGeometry, oPlan))
+    {
+        throw npp::Exception("shearDeskew: not a small rotation");
+    }
+
+    if (oSrc.width() != rGeometry.nSrcWidth || oSrc.height() != rGeometry.nSrcHeight)
+    {
+        throw npp::Exception("shearDeskew: source does not match the geometry");
+    }
+
+    const unsigned int nBand = detail::kShearBandRows;
+    ImageBuffer_8u_C1 oMid(oDst.width(), oSrc.height());
+    ImageView_8u_C1 oMidView = oMid.view();
+
+    parallelFor((oSrc.height() + nBand - 1) / nBand, [&](size_t iBand)
+    {
+        unsigned int nEnd = std::min<unsigned int>(oSrc.height(),
+                                                   (unsigned int)(iBand + 1) * nBand);
+
+        for (unsigned int y = (unsigned int)iBand * nBand; y < nEnd; ++y)
+        {
+            detail::shearRow(oSrc, oMidView, oPlan, rOptions, y);
+        }
+    }, rOptions.nThreads);
+
+    const detail::ShearColumns oColumns = detail::shearColumns(
+        oPlan, rOptions.eInterpolation, oSrc.height(), oDst.width(), oDst.height());
+    const size_t nBands = (oDst.height() + nBand - 1) / nBand;
+
+    rEpilogue.prepare(workerCount(nBands, rOptions.nThreads));
+
+    parallelForWorkers(nBands, [&](size_t iBand, unsigned int nWorker)
+    {
+        unsigned int nEnd = std::min<unsigned int>(oDst.height(),
+                                                   (unsigned int)(iBand + 1) * nBand);
+
+        for (unsigned int y = (unsigned int)iBand * nBand; y < nEnd; ++y)
+        {
+            unsigned char *pRow = oDst.row(y);
+            detail::shearColumnsRow(oMidView, pRow, oColumns, rOptions, y);
+            rEpilogue.row(nWorker, 0, y, pRow, oDst.width());
+        }
+    }, rOptions.nThreads);
+}
+
+inline void shearDeskew(ImageConstView_8u_C1 oSrc, ImageView_8u_C1 oDst,
+                        const RotateGeometry &rGeometry, const RotateOptions &rOptions)
+{
+    NoEpilogue oNone;
+    shearDeskew(oSrc, oDst, rGeometry, rOptions, oNone);
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_SHEAR_DESKEW_H
@@ -0,0 +1,1210 @@
+/* TIFF and BigTIFF reading and writing for 8-bit gray images.
+ *
+ * Strip and tile organised files are both handled, uncompressed, PackBits
+ * or Deflate (zlib) coded.  Every strip or tile is an independent chunk, so
+ * the reader fetches and decodes chunks concurrently with pread, writing the
+ * pixels straight into the rows of the destination buffer that the tiled
+ * rotation then reads; no PGM conversion is needed.  The writer encodes
+ * batches of chunks on all cores and appends them in file order.
+ *
+ * Read: 1, 8 or 16 bits per sample; gray of either polarity, or RGB(A)
+ * reduced to luma; optional horizontal differencing predictor.  Written:
+ * 8-bit BlackIsZero gray, little endian, BigTIFF when the file may not fit
+ * 32-bit offsets.
+ */
+
+#ifndef PIPELINE_TIFF_FILE_H
+#define PIPELINE_TIFF_FILE_H
+
+#include <Exceptions.h>
+
+#include "ImageView.h"
+#include "Parallel.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if !(defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64))
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace pipeline
+{
+
+enum TiffCompression
+{
+    TIFF_UNCOMPRESSED = 1,
+    TIFF_DEFLATE = 8,
+    TIFF_PACKBITS = 32773
+};
+
+// Layout of written files.  nTileSize == 0 writes strips of about
+// tiff::kChunkBytes, otherwise square tiles of that size (a multiple of 16).
+struct TiffOptions
+{
+    TiffCompression eCompression;
+    unsigned int nTileSize;
+    bool bBigTiff; // always write BigTIFF, not only when offsets may overflow
+    unsigned int nThreads;
+
+    TiffOptions()
+        : eCompression(TIFF_UNCOMPRESSED), nTileSize(0), bBigTiff(false),
+          nThreads(0)
+    {
+    }
+};
+
+namespace tiff
+{
+
+// Target size of a written strip; keeps each encoder's working set in L2.
+static const size_t kChunkBytes = 256 * 1024;
+// Classic files are only written while the estimate stays below this.
+static const uint64_t kClassicLimit = 0xF0000000ull;
+
+enum Tag
+{
+    TAG_IMAGE_WIDTH = 256,
+    TAG_IMAGE_LENGTH = 257,
+    TAG_BITS_PER_SAMPLE = 258,
+    TAG_COMPRESSION = 259,
+    TAG_PHOTOMETRIC = 262,
+    TAG_STRIP_OFFSETS = 273,
+    TAG_ORIENTATION = 274,
+    TAG_SAMPLES_PER_PIXEL = 277,
+    TAG_ROWS_PER_STRIP = 278,
+    TAG_STRIP_BYTE_COUNTS = 279,
+    TAG_PLANAR_CONFIG = 284,
+    TAG_PREDICTOR = 317,
+    TAG_TILE_WIDTH = 322,
+    TAG_TILE_LENGTH = 323,
+    TAG_TILE_OFFSETS = 324,
+    TAG_TILE_BYTE_COUNTS = 325,
+    TAG_SAMPLE_FORMAT = 339
+};
+
+enum Type
+{
+    TYPE_SHORT = 3,
+    TYPE_LONG = 4,
+    TYPE_LONG8 = 16
+};
+
+// Old style zlib code used by some writers for Deflate.
+static const uint16_t kAdobeDeflate = 32946;
+
+// Bytes per value of a field type, 0 for unknown types.
+inline unsigned int typeSize(uint16_t nType)
+{
+    switch (nType)
+    {
+    case 1: case 2: case 6: case 7:
+        return 1;
+    case 3: case 8:
+        return 2;
+    case 4: case 9: case 11: case 13:
+        return 4;
+    case 5: case 10: case 12: case 16: case 17: case 18:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+inline uint64_t getValue(const uint8_t *p, unsigned int nBytes, bool bBigEndian)
+{
+    uint64_t nValue = 0;
+
+    for (unsigned int i = 0; i < nBytes; ++i)
+    {
+        nValue |= (uint64_t)p[bBigEndian ? nBytes - 1 - i : i] << (8 * i);
+    }
+
+    return nValue;
+}
+
+inline void putValue(std::vector<uint8_t> &rOut, uint64_t nValue, unsigned int nBytes)
+{
+    for (unsigned int i = 0; i < nBytes; ++i)
+    {
+        rOut.push_back((uint8_t)(nValue >> (8 * i)));
+    }
+}
+
+// Read-only file with positioned reads that may be issued concurrently.
+class File
+{
+public:
+    File() : nSize_(0)
+#if !(defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64))
+           , fd_(-1)
+#endif
+    {
+    }
+
+    ~File()
+    {
+#if !(defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64))
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+        }
+#endif
+    }
+
+    bool open(const std::string &fileName)
+    {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+        file_.open(fileName.c_str(), std::ios::binary);
+
+        if (!file_.is_open())
+        {
+            return false;
+        }
+
+        file_.seekg(0, std::ios::end);
+        nSize_ = (uint64_t)file_.tellg();
+#else
+        fd_ = ::open(fileName.c_str(), O_RDONLY);
+
+        if (fd_ < 0)
+        {
+            return false;
+        }
+
+        nSize_ = (uint64_t)lseek(fd_, 0, SEEK_END);
+#endif
+        return true;
+    }
+
+    uint64_t size() const
+    {
+        return nSize_;
+    }
+
+    void read(void *pDst, size_t nBytes, uint64_t nOffset) const
+    {
+        if (nOffset > nSize_ || nBytes > nSize_ - nOffset)
+        {
+            throw npp::Exception("TIFF: file is truncated");
+        }
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+        std::lock_guard<std::mutex> oLock(mutex_);
+        file_.seekg((std::streamoff)nOffset);
+        file_.read(static_cast<char *>(pDst), nBytes);
+
+        if (!file_)
+        {
+            throw npp::Exception("TIFF: read failed");
+        }
+#else
+        uint8_t *p = static_cast<uint8_t *>(pDst);
+
+        while (nBytes > 0)
+        {
+            ssize_t nRead = pread(fd_, p, nBytes, (off_t)nOffset);
+
+            if (nRead <= 0)
+            {
+                throw npp::Exception("TIFF: read failed");
+            }
+
+            p += nRead;
+            nBytes -= nRead;
+            nOffset += nRead;
+        }
+#endif
+    }
+
+private:
+    File(const File &);
+    File &operator=(const File &);
+
+    uint64_t nSize_;
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    mutable std::ifstream file_;
+    mutable std::mutex mutex_;
+#else
+    int fd_;
+#endif
+};
+
+// One image file directory, reduced to what decoding needs.
+struct Directory
+{
+    uint32_t nWidth, nHeight;
+    uint16_t nBits, nSamples, nCompression, nPhotometric;
+    uint16_t nPredictor, nPlanar, nSampleFormat, nOrientation;
+    bool bTiled;
+    // tile size, or the image width by RowsPerStrip
+    uint32_t nChunkWidth, nChunkHeight;
+    std::vector<uint64_t> aOffsets, aByteCounts;
+
+    Directory()
+        : nWidth(0), nHeight(0), nBits(1), nSamples(1), nCompression(1),
+          nPhotometric(1), nPredictor(1), nPlanar(1), nSampleFormat(1),
+          nOrientation(1), bTiled(false), nChunkWidth(0), nChunkHeight(0)
+    {
+    }
+
+    uint32_t chunksAcross() const
+    {
+        return (nWidth + nChunkWidth - 1) / nChunkWidth;
+    }
+
+    size_t chunkCount() const
+    {
+        return (size_t)chunksAcross() * ((nHeight + nChunkHeight - 1) / nChunkHeight);
+    }
+
+    // Bytes of one decoded chunk row.
+    size_t rowBytes() const
+    {
+        return ((size_t)nChunkWidth * nSamples * nBits + 7) / 8;
+    }
+};
+
+// Expands TIFF PackBits runs until nOut bytes are produced.
+inline void packBitsDecode(const uint8_t *pIn, size_t nIn, uint8_t *pOut, size_t nOut)
+{
+    const uint8_t *pEnd = pIn + nIn;
+    size_t nDone = 0;
+
+    while (nDone < nOut)
+    {
+        if (pIn >= pEnd)
+        {
+            throw npp::Exception("TIFF: PackBits data is truncated");
+        }
+
+        int nHeader = (int8_t)*pIn++;
+
+        if (nHeader >= 0)
+        {
+            size_t nCount = (size_t)nHeader + 1;
+
+            if (nCount > (size_t)(pEnd - pIn) || nCount > nOut - nDone)
+            {
+                throw npp::Exception("TIFF: PackBits literal overruns");
+            }
+
+            memcpy(pOut + nDone, pIn, nCount);
+            pIn += nCount;
+            nDone += nCount;
+        }
+        else if (nHeader != -128)
+        {
+            size_t nCount = (size_t)(1 - nHeader);
+
+            if (pIn >= pEnd || nCount > nOut - nDone)
+            {
+                throw npp::Exception("TIFF: PackBits run overruns");
+            }
+
+            memset(pOut + nDone, *pIn++, nCount);
+            nDone += nCount;
+        }
+    }
+}
+
+// Appends the PackBits coding of one row; runs never cross rows.
+inline void packBitsEncode(const uint8_t *p, size_t n, std::vector<uint8_t> &rOut)
+{
+    size_t i = 0;
+
+    while (i < n)
+    {
+        size_t nRun = 1;
+
+        while (i + nRun < n && nRun < 128 && p[i + nRun] == p[i])
+        {
+            ++nRun;
+        }
+
+        if (nRun >= 3)
+        {
+            rOut.push_back((uint8_t)(1 - (int)nRun));
+            rOut.push_back(p[i]);
+            i += nRun;
+            continue;
+        }
+
+        // literal up to the next run of three
+        size_t nStart = i;
+
+        while (i < n && i - nStart < 128 &&
+               !(i + 2 < n && p[i] == p[i + 1] && p[i] == p[i + 2]))
+        {
+            ++i;
+        }
+
+        rOut.push_back((uint8_t)(i - nStart - 1));
+        rOut.insert(rOut.end(), p + nStart, p + i);
+    }
+}
+
+// Inflates a zlib stream into exactly nOut bytes; trailing input is ignored.
+inline void inflateChunk(const uint8_t *pIn, size_t nIn, uint8_t *pOut, size_t nOut)
+{
+    z_stream oStream;
+    memset(&oStream, 0, sizeof(oStream));
+
+    if (inflateInit(&oStream) != Z_OK)
+    {
+        throw npp::Exception("TIFF: inflateInit failed");
+    }
+
+    oStream.next_in = const_cast<Bytef *>(pIn);
+    oStream.avail_in = (uInt)nIn;
+    oStream.next_out = pOut;
+    oStream.avail_out = (uInt)nOut;
+
+    int nResult = inflate(&oStream, Z_FINISH);
+    inflateEnd(&oStream);
+
+    if (oStream.avail_out != 0 || (nResult != Z_STREAM_END && nResult != Z_OK &&
+                                   nResult != Z_BUF_ERROR))
+    {
+        throw npp::Exception("TIFF: Deflate data is corrupt or truncated");
+    }
+}
+
+// Undoes horizontal differencing on nRows rows of rDir's chunk layout.
+inline void undoPredictor(const Directory &rDir, bool bBigEndian, uint8_t *pRaw,
+                          unsigned int nRows)
+{
+    const size_t nRowBytes = rDir.rowBytes();
+    const unsigned int nStride = rDir.nSamples;
+    const size_t nValues = (size_t)rDir.nChunkWidth * nStride;
+
+    for (unsigned int y = 0; y < nRows; ++y)
+    {
+        uint8_t *pRow = pRaw + y * nRowBytes;
+
+        if (rDir.nBits == 8)
+        {
+            for (size_t i = nStride; i < nValues; ++i)
+            {
+                pRow[i] = (uint8_t)(pRow[i] + pRow[i - nStride]);
+            }
+        }
+        else
+        {
+            for (size_t i = nStride; i < nValues; ++i)
+            {
+                uint16_t nValue = (uint16_t)(getValue(pRow + 2 * i, 2, bBigEndian) +
+                                             getValue(pRow + 2 * (i - nStride), 2,
+                                                      bBigEndian));
+                pRow[2 * i + (bBigEndian ? 0 : 1)] = (uint8_t)(nValue >> 8);
+                pRow[2 * i + (bBigEndian ? 1 : 0)] = (uint8_t)nValue;
+            }
+        }
+    }
+}
+
+// Converts nCount pixels of a decoded chunk row to 8-bit luma.
+inline void convertRow(const Directory &rDir, bool bBigEndian, const uint8_t *pRow,
+                       uint8_t *pDst, unsigned int nCount)
+{
+    const unsigned int nStride = rDir.nSamples;
+    const bool bInvert = rDir.nPhotometric == 0;
+
+    if (rDir.nBits == 1)
+    {
+        // BlackIsZero: a set bit is white; WhiteIsZero: a set bit is black
+        for (unsigned int x = 0; x < nCount; ++x)
+        {
+            bool bSet = ((pRow[x >> 3] >> (7 - (x & 7))) & 1) != 0;
+            pDst[x] = bSet != bInvert ? 255 : 0;
+        }
+
+        return;
+    }
+
+    // the high byte of 16-bit samples
+    const unsigned int nBytes = rDir.nBits / 8;
+    const uint8_t *pSample = pRow + (nBytes == 2 && !bBigEndian ? 1 : 0);
+
+    if (rDir.nPhotometric == 2)
+    {
+        const size_t nStep = (size_t)nStride * nBytes;
+
+        for (unsigned int x = 0; x < nCount; ++x)
+        {
+            const uint8_t *p = pSample + x * nStep;
+            pDst[x] = (uint8_t)((77 * p[0] + 150 * p[nBytes] + 29 * p[2 * nBytes] +
+                                 128) >> 8);
+        }
+    }
+    else if (nStride == 1 && nBytes == 1 && !bInvert)
+    {
+        memcpy(pDst, pRow, nCount);
+    }
+    else
+    {
+        const size_t nStep = (size_t)nStride * nBytes;
+        const uint8_t nFlip = bInvert ? 255 : 0;
+
+        for (unsigned int x = 0; x < nCount; ++x)
+        {
+            pDst[x] = pSample[x * nStep] ^ nFlip;
+        }
+    }
+}
+
+} // namespace tiff
+
+// Reads the pages of a TIFF or BigTIFF file.
+class TiffReader
+{
+public:
+    TiffReader() : bBigEndian_(false), bBigTiff_(false)
+    {
+    }
+
+    // False when the file cannot be opened; throws on a malformed header.
+    bool open(const std::string &fileName)
+    {
+        if (!file_.open(fileName))
+        {
+            return false;
+        }
+
+        uint8_t aHeader[16] = {0};
+        file_.read(aHeader, std::min<uint64_t>(16, file_.size()), 0);
+
+        if (aHeader[0] == 'I' && aHeader[1] == 'I')
+        {
+            bBigEndian_ = false;
+        }
+        else if (aHeader[0] == 'M' && aHeader[1] == 'M')
+        {
+            bBigEndian_ = true;
+        }
+        else
+        {
+            throw npp::Exception("TIFF: not a TIFF file: " + fileName);
+        }
+
+        uint64_t nMagic = get(aHeader + 2, 2);
+        uint64_t nOffset = 0;
+
+        if (nMagic == 42)
+        {
+            nOffset = get(aHeader + 4, 4);
+        }
+        else if (nMagic == 43 && get(aHeader + 4, 2) == 8)
+        {
+            bBigTiff_ = true;
+            nOffset = get(aHeader + 8, 8);
+        }
+        else
+        {
+            throw npp::Exception("TIFF: unknown version in " + fileName);
+        }
+
+        // collect the IFD chain; a repeated offset would loop forever
+        while (nOffset != 0)
+        {
+            if (std::find(aPages_.begin(), aPages_.end(), nOffset) != aPages_.end())
+            {
+                throw npp::Exception("TIFF: IFD chain loops");
+            }
+
+            aPages_.push_back(nOffset);
+
+            uint8_t aCount[8];
+            unsigned int nCountBytes = bBigTiff_ ? 8 : 2;
+            file_.read(aCount, nCountBytes, nOffset);
+            uint64_t nEntries = get(aCount, nCountBytes);
+            uint64_t nLink = nOffset + nCountBytes + nEntries * entryBytes();
+
+            uint8_t aLink[8];
+            file_.read(aLink, linkBytes(), nLink);
+            nOffset = get(aLink, linkBytes());
+        }
+
+        if (aPages_.empty())
+        {
+            throw npp::Exception("TIFF: file has no images");
+        }
+
+        return true;
+    }
+
+    size_t pages() const
+    {
+        return aPages_.size();
+    }
+
+    bool isBigTiff() const
+    {
+        return bBigTiff_;
+    }
+
+    // Parses and validates the directory of page nPage.
+    tiff::Directory directory(size_t nPage) const
+    {
+        unsigned int nCountBytes = bBigTiff_ ? 8 : 2;
+        uint8_t aCount[8];
+        file_.read(aCount, nCountBytes, aPages_[nPage]);
+        uint64_t nEntries = get(aCount, nCountBytes);
+
+        if (nEntries == 0 || nEntries > 4096)
+        {
+            throw npp::Exception("TIFF: implausible IFD entry count");
+        }
+
+        std::vector<uint8_t> aEntries(nEntries * entryBytes());
+        file_.read(aEntries.data(), aEntries.size(), aPages_[nPage] + nCountBytes);
+
+        tiff::Directory oDir;
+        uint64_t nRowsPerStrip = 0xFFFFFFFFu;
+
+        for (uint64_t i = 0; i < nEntries; ++i)
+        {
+            const uint8_t *pEntry = &aEntries[i * entryBytes()];
+            std::vector<uint64_t> aValues = values(pEntry);
+
+            if (aValues.empty())
+            {
+                continue;
+            }
+
+            switch (get(pEntry, 2))
+            {
+            case tiff::TAG_IMAGE_WIDTH: oDir.nWidth = (uint32_t)aValues[0]; break;
+            case tiff::TAG_IMAGE_LENGTH: oDir.nHeight = (uint32_t)aValues[0]; break;
+            case tiff::TAG_BITS_PER_SAMPLE: oDir.nBits = (uint16_t)aValues[0]; break;
+            case tiff::TAG_COMPRESSION: oDir.nCompression = (uint16_t)aValues[0]; break;
+            case tiff::TAG_PHOTOMETRIC: oDir.nPhotometric = (uint16_t)aValues[0]; break;
+            case tiff::TAG_ORIENTATION: oDir.nOrientation = (uint16_t)aValues[0]; break;
+            case tiff::TAG_SAMPLES_PER_PIXEL: oDir.nSamples = (uint16_t)aValues[0]; break;
+            case tiff::TAG_ROWS_PER_STRIP: nRowsPerStrip = aValues[0]; break;
+            case tiff::TAG_PLANAR_CONFIG: oDir.nPlanar = (uint16_t)aValues[0]; break;
+            case tiff::TAG_PREDICTOR: oDir.nPredictor = (uint16_t)aValues[0]; break;
+            case tiff::TAG_SAMPLE_FORMAT:
+                oDir.nSampleFormat = (uint16_t)aValues[0];
+                break;
+            case tiff::TAG_TILE_WIDTH: oDir.nChunkWidth = (uint32_t)aValues[0]; break;
+            case tiff::TAG_TILE_LENGTH: oDir.nChunkHeight = (uint32_t)aValues[0]; break;
+            case tiff::TAG_STRIP_OFFSETS:
+            case tiff::TAG_TILE_OFFSETS:
+                oDir.bTiled = get(pEntry, 2) == tiff::TAG_TILE_OFFSETS;
+                oDir.aOffsets.swap(aValues);
+                break;
+            case tiff::TAG_STRIP_BYTE_COUNTS:
+            case tiff::TAG_TILE_BYTE_COUNTS:
+                oDir.aByteCounts.swap(aValues);
+                break;
+            default:
+                break;
+            }
+        }
+
+        if (!oDir.bTiled)
+        {
+            oDir.nChunkWidth = oDir.nWidth;
+            oDir.nChunkHeight = (uint32_t)std::min<uint64_t>(nRowsPerStrip, oDir.nHeight);
+        }
+
+        validate(oDir);
+        return oDir;
+    }
+
+    // Decodes a page into oDst, which must have the page's size.  Chunks are
+    // fetched and decoded on nThreads threads (0: all hardware threads).
+    void read(const tiff::Directory &rDir, ImageView_8u_C1 oDst,
+              unsigned int nThreads = 0) const
+    {
+        if (oDst.width() != rDir.nWidth || oDst.height() != rDir.nHeight)
+        {
+            throw npp::Exception("TIFF: destination does not match the page size");
+        }
+
+        const size_t nChunks = rDir.chunkCount();
+        const uint32_t nAcross = rDir.chunksAcross();
+        const size_t nRowBytes = rDir.rowBytes();
+        const unsigned int nWorkers = workerCount(nChunks, nThreads);
+        std::vector<std::vector<uint8_t> > aPacked(nWorkers), aRaw(nWorkers);
+
+        parallelForWorkers(nChunks, [&](size_t iChunk, unsigned int nWorker)
+        {
+            const uint32_t nX0 = (uint32_t)(iChunk % nAcross) * rDir.nChunkWidth;
+            const uint32_t nY0 = (uint32_t)(iChunk / nAcross) * rDir.nChunkHeight;
+            const unsigned int nCols = std::min(rDir.nChunkWidth, rDir.nWidth - nX0);
+            const unsigned int nRows = std::min(rDir.nChunkHeight, rDir.nHeight - nY0);
+            // tiles are always stored whole, the last strip only to the bottom
+            const unsigned int nStored = rDir.bTiled ? rDir.nChunkHeight : nRows;
+            const size_t nRawBytes = nRowBytes * nStored;
+            const size_t nPackedBytes = (size_t)rDir.aByteCounts[iChunk];
+
+            std::vector<uint8_t> &rRaw = aRaw[nWorker];
+            std::vector<uint8_t> &rPacked = aPacked[nWorker];
+            rRaw.resize(nRawBytes);
+
+            if (nPackedBytes == 0)
+            {
+                // sparse files leave chunks that hold only zero samples out
+                std::fill(rRaw.begin(), rRaw.end(), 0);
+            }
+            else if (rDir.nCompression == TIFF_UNCOMPRESSED)
+            {
+                if (nPackedBytes < nRawBytes)
+                {
+                    throw npp::Exception("TIFF: uncompressed chunk is short");
+                }
+
+                file_.read(rRaw.data(), nRawBytes, rDir.aOffsets[iChunk]);
+            }
+            else
+            {
+                rPacked.resize(nPackedBytes);
+                file_.read(rPacked.data(), nPackedBytes, rDir.aOffsets[iChunk]);
+
+                if (rDir.nCompression == TIFF_PACKBITS)
+                {
+                    tiff::packBitsDecode(rPacked.data(), nPackedBytes, rRaw.data(),
+                                         nRawBytes);
+                }
+                else
+                {
+                    tiff::inflateChunk(rPacked.data(), nPackedBytes, rRaw.data(),
+                                       nRawBytes);
+                }
+            }
+
+            if (rDir.nPredictor == 2)
+            {
+                tiff::undoPredictor(rDir, bBigEndian_, rRaw.data(), nStored);
+            }
+
+            for (unsigned int y = 0; y < nRows; ++y)
+            {
+                tiff::convertRow(rDir, bBigEndian_, &rRaw[y * nRowBytes],
+                                 oDst.row(nY0 + y) + nX0, nCols);
+            }
+        }, nThreads);
+    }
+
+private:
+    TiffReader(const TiffReader &);
+    TiffReader &operator=(const TiffReader &);
+
+    uint64_t get(const uint8_t *p, unsigned int nBytes) const
+    {
+        return tiff::getValue(p, nBytes, bBigEndian_);
+    }
+
+    unsigned int entryBytes() const
+    {
+        return bBigTiff_ ? 20 : 12;
+    }
+
+    unsigned int linkBytes() const
+    {
+        return bBigTiff_ ? 8 : 4;
+    }
+
+    // The integer values of an IFD entry; empty for other field types.
+    std::vector<uint64_t> values(const uint8_t *pEntry) const
+    {
+        const uint16_t nType = (uint16_t)get(pEntry + 2, 2);
+        const uint64_t nCount = get(pEntry + 4, linkBytes());
+        const uint8_t *pField = pEntry + 4 + linkBytes();
+        const unsigned int nSize = tiff::typeSize(nType);
+        std::vector<uint64_t> aValues;
+
+        bool bInteger = nType == 1 || nType == 3 || nType == 4 || nType == 16;
+
+        if (!bInteger || nCount == 0 || nCount > (file_.size() / nSize))
+        {
+            return aValues;
+        }
+
+        std::vector<uint8_t> aData(nSize * nCount);
+
+        if (aData.size() <= linkBytes())
+        {
+            memcpy(aData.data(), pField, aData.size());
+        }
+        else
+        {
+            file_.read(aData.data(), aData.size(), get(pField, linkBytes()));
+        }
+
+        aValues.resize(nCount);
+
+        for (uint64_t i = 0; i < nCount; ++i)
+        {
+            aValues[i] = get(&aData[i * nSize], nSize);
+        }
+
+        return aValues;
+    }
+
+    static void validate(const tiff::Directory &rDir)
+    {
+        if (rDir.nWidth == 0 || rDir.nHeight == 0 || rDir.nChunkWidth == 0 ||
+            rDir.nChunkHeight == 0)
+        {
+            throw npp::Exception("TIFF: missing image or chunk dimensions");
+        }
+
+        if (rDir.nCompression != TIFF_UNCOMPRESSED && rDir.nCompression != TIFF_DEFLATE &&
+            rDir.nCompression != tiff::kAdobeDeflate &&
+            rDir.nCompression != TIFF_PACKBITS)
+        {
+            throw npp::Exception("TIFF: unsupported compression");
+        }
+
+        if (rDir.nBits != 1 && rDir.nBits != 8 && rDir.nBits != 16)
+        {
+            throw npp::Exception("TIFF: unsupported bits per sample");
+        }
+
+        bool bGray = rDir.nPhotometric <= 1 && rDir.nSamples >= 1;
+        bool bRgb = rDir.nPhotometric == 2 && rDir.nSamples >= 3 && rDir.nBits != 1;
+
+        if ((!bGray && !bRgb) || (rDir.nBits == 1 && rDir.nSamples != 1) ||
+            rDir.nSampleFormat != 1)
+        {
+            throw npp::Exception("TIFF: unsupported photometric interpretation");
+        }
+
+        if (rDir.nPlanar != 1 && rDir.nSamples != 1)
+        {
+            throw npp::Exception("TIFF: planar sample layout is not supported");
+        }
+
+        if (rDir.nPredictor != 1 && (rDir.nPredictor != 2 || rDir.nBits == 1))
+        {
+            throw npp::Exception("TIFF: unsupported predictor");
+        }
+
+        if (rDir.aOffsets.size() != rDir.chunkCount() ||
+            rDir.aByteCounts.size() != rDir.chunkCount())
+        {
+            throw npp::Exception("TIFF: chunk tables do not match the layout");
+        }
+    }
+
+    tiff::File file_;
+    bool bBigEndian_, bBigTiff_;
+    std::vector<uint64_t> aPages_;
+};
+
+// Appends 8-bit gray pages to a new little endian TIFF or BigTIFF file.
+class TiffWriter
+{
+public:
+    // nExpectedBytes estimates the whole file, pages included; BigTIFF is
+    // written when it could outgrow 32-bit offsets.
+    TiffWriter(const std::string &fileName, const TiffOptions &rOptions,
+               uint64_t nExpectedBytes)
+        : file_(fileName.c_str(), std::ios::binary), oOptions_(rOptions),
+          bBigTiff_(rOptions.bBigTiff || nExpectedBytes > tiff::kClassicLimit),
+          nPos_(0), nLink_(0)
+    {
+        if (!file_.is_open())
+        {
+            throw npp::Exception("Could not open file for writing");
+        }
+
+        if (rOptions.nTileSize % 16 != 0)
+        {
+            throw npp::Exception("TIFF: the tile size must be a multiple of 16");
+        }
+
+        std::vector<uint8_t> aHeader;
+        aHeader.push_back('I');
+        aHeader.push_back('I');
+
+        if (bBigTiff_)
+        {
+            tiff::putValue(aHeader, 43, 2);
+            tiff::putValue(aHeader, 8, 2);
+            tiff::putValue(aHeader, 0, 2);
+        }
+        else
+        {
+            tiff::putValue(aHeader, 42, 2);
+        }
+
+        nLink_ = aHeader.size();
+        tiff::putValue(aHeader, 0, linkBytes());
+        put(aHeader);
+    }
+
+    bool isBigTiff() const
+    {
+        return bBigTiff_;
+    }
+
+    // Strip or tile grid of one page.
+    struct Layout
+    {
+        unsigned int nWidth, nHeight;
+        unsigned int nChunkWidth, nChunkHeight;
+        unsigned int nAcross;
+        size_t nChunks;
+        bool bTiled;
+    };
+
+    // A page coded by encode(), ready to be appended.
+    struct Page
+    {
+        Layout oLayout;
+        std::vector<std::vector<uint8_t> > aChunks;
+    };
+
+    Layout layout(unsigned int nWidth, unsigned int nHeight) const
+    {
+        Layout oLayout;
+        oLayout.nWidth = nWidth;
+        oLayout.nHeight = nHeight;
+        oLayout.bTiled = oOptions_.nTileSize != 0;
+        oLayout.nChunkWidth = oLayout.bTiled ? oOptions_.nTileSize : nWidth;
+        oLayout.nChunkHeight = oLayout.bTiled ? oOptions_.nTileSize :
+            (unsigned int)std::max<size_t>(1, tiff::kChunkBytes / nWidth);
+        oLayout.nAcross = (nWidth + oLayout.nChunkWidth - 1) / oLayout.nChunkWidth;
+        oLayout.nChunks = (size_t)oLayout.nAcross *
+            ((nHeight + oLayout.nChunkHeight - 1) / oLayout.nChunkHeight);
+        return oLayout;
+    }
+
+    // Codes all chunks of oImage on nThreads threads without touching the
+    // file, so several pages can be encoded at once.
+    Page encode(ImageConstView_8u_C1 oImage, unsigned int nThreads = 0) const
+    {
+        Page oPage;
+        oPage.oLayout = layout(oImage.width(), oImage.height());
+        oPage.aChunks.resize(oPage.oLayout.nChunks);
+
+        parallelFor(oPage.oLayout.nChunks, [&](size_t iChunk)
+        {
+            encodeChunk(oImage, oPage.oLayout, iChunk, oPage.aChunks[iChunk]);
+        }, nThreads);
+
+        return oPage;
+    }
+
+    // Writes an encoded page as the next page.
+    void append(const Page &rPage)
+    {
+        std::vector<uint64_t> aOffsets(rPage.oLayout.nChunks);
+        std::vector<uint64_t> aByteCounts(rPage.oLayout.nChunks);
+
+        for (size_t i = 0; i < rPage.oLayout.nChunks; ++i)
+        {
+            aOffsets[i] = nPos_;
+            aByteCounts[i] = rPage.aChunks[i].size();
+            put(rPage.aChunks[i]);
+        }
+
+        writeDirectory(rPage.oLayout, aOffsets, aByteCounts);
+    }
+
+    // Writes oImage as the next page, holding only a batch of coded chunks
+    // at a time.
+    void append(ImageConstView_8u_C1 oImage)
+    {
+        const Layout oLayout = layout(oImage.width(), oImage.height());
+        const size_t nChunks = oLayout.nChunks;
+
+        std::vector<uint64_t> aOffsets(nChunks), aByteCounts(nChunks);
+        const size_t nBatch = 4 * (size_t)workerCount(nChunks, oOptions_.nThreads);
+        std::vector<std::vector<uint8_t> > aEncoded(nBatch);
+
+        // encode a batch on all cores, then write it in order
+        for (size_t iFirst = 0; iFirst < nChunks; iFirst += nBatch)
+        {
+            size_t nCount = std::min(nBatch, nChunks - iFirst);
+
+            parallelFor(nCount, [&](size_t i)
+            {
+                encodeChunk(oImage, oLayout, iFirst + i, aEncoded[i]);
+            }, oOptions_.nThreads);
+
+            for (size_t i = 0; i < nCount; ++i)
+            {
+                aOffsets[iFirst + i] = nPos_;
+                aByteCounts[iFirst + i] = aEncoded[i].size();
+                put(aEncoded[i]);
+                std::vector<uint8_t>().swap(aEncoded[i]);
+            }
+        }
+
+        writeDirectory(oLayout, aOffsets, aByteCounts);
+    }
+
+    void close()
+    {
+        file_.close();
+
+        if (file_.fail())
+        {
+            throw npp::Exception("TIFF: could not write the file");
+        }
+    }
+
+private:
+    TiffWriter(const TiffWriter &);
+    TiffWriter &operator=(const TiffWriter &);
+
+    struct Field
+    {
+        uint16_t nTag, nType;
+        std::vector<uint64_t> aValues;
+
+        Field(uint16_t nTagIn, uint16_t nTypeIn, const std::vector<uint64_t> &rValues)
+            : nTag(nTagIn), nType(nTypeIn), aValues(rValues)
+        {
+        }
+    };
+
+    static void addField(std::vector<Field> &rFields, uint16_t nTag, uint16_t nType,
+                         uint64_t nValue)
+    {
+        rFields.push_back(Field(nTag, nType, std::vector<uint64_t>(1, nValue)));
+    }
+
+    unsigned int linkBytes() const
+    {
+        return bBigTiff_ ? 8 : 4;
+    }
+
+    void put(const std::vector<uint8_t> &rBytes)
+    {
+        file_.write(reinterpret_cast<const char *>(rBytes.data()), rBytes.size());
+        nPos_ += rBytes.size();
+
+        if (!bBigTiff_ && nPos_ > 0xFFFFFFFFull)
+        {
+            throw npp::Exception("TIFF: file outgrew 32-bit offsets; write BigTIFF");
+        }
+    }
+
+    // Codes chunk iChunk of oImage; edge tiles are padded with zeros.
+    void encodeChunk(ImageConstView_8u_C1 oImage, const Layout &rLayout, size_t iChunk,
+                     std::vector<uint8_t> &rOut) const
+    {
+        const unsigned int nChunkWidth = rLayout.nChunkWidth;
+        const unsigned int nX0 = (unsigned int)(iChunk % rLayout.nAcross) * nChunkWidth;
+        const unsigned int nY0 =
+            (unsigned int)(iChunk / rLayout.nAcross) * rLayout.nChunkHeight;
+        const unsigned int nCols = std::min(nChunkWidth, oImage.width() - nX0);
+        const unsigned int nRows = std::min(rLayout.nChunkHeight, oImage.height() - nY0);
+        const unsigned int nStored = rLayout.bTiled ? rLayout.nChunkHeight : nRows;
+
+        rOut.clear();
+        std::vector<uint8_t> aRaw((size_t)nChunkWidth * nStored, 0);
+
+        for (unsigned int y = 0; y < nRows; ++y)
+        {
+            memcpy(&aRaw[(size_t)y * nChunkWidth], oImage.row(nY0 + y) + nX0, nCols);
+        }
+
+        if (oOptions_.eCompression == TIFF_PACKBITS)
+        {
+            rOut.reserve(aRaw.size() + aRaw.size() / 128 + nStored);
+
+            for (unsigned int y = 0; y < nStored; ++y)
+            {
+                tiff::packBitsEncode(&aRaw[(size_t)y * nChunkWidth], nChunkWidth, rOut);
+            }
+        }
+        else if (oOptions_.eCompression == TIFF_DEFLATE)
+        {
+            uLongf nPacked = compressBound((uLong)aRaw.size());
+            rOut.resize(nPacked);
+
+            if (compress2(rOut.data(), &nPacked, aRaw.data(), (uLong)aRaw.size(),
+                          Z_DEFAULT_COMPRESSION) != Z_OK)
+            {
+                throw npp::Exception("TIFF: Deflate encoding failed");
+            }
+
+            rOut.resize(nPacked);
+        }
+        else
+        {
+            rOut.swap(aRaw);
+        }
+    }
+
+    void writeDirectory(const Layout &rLayout, const std::vector<uint64_t> &rOffsets,
+                        const std::vector<uint64_t> &rByteCounts)
+    {
+        const uint16_t nOffsetType = bBigTiff_ ? tiff::TYPE_LONG8 : tiff::TYPE_LONG;
+        std::vector<Field> aFields;
+        addField(aFields, tiff::TAG_IMAGE_WIDTH, tiff::TYPE_LONG, rLayout.nWidth);
+        addField(aFields, tiff::TAG_IMAGE_LENGTH, tiff::TYPE_LONG, rLayout.nHeight);
+        addField(aFields, tiff::TAG_BITS_PER_SAMPLE, tiff::TYPE_SHORT, 8);
+        addField(aFields, tiff::TAG_COMPRESSION, tiff::TYPE_SHORT,
+                 oOptions_.eCompression);
+        addField(aFields, tiff::TAG_PHOTOMETRIC, tiff::TYPE_SHORT, 1);
+
+        if (rLayout.bTiled)
+        {
+            addField(aFields, tiff::TAG_SAMPLES_PER_PIXEL, tiff::TYPE_SHORT, 1);
+            addField(aFields, tiff::TAG_PLANAR_CONFIG, tiff::TYPE_SHORT, 1);
+            addField(aFields, tiff::TAG_TILE_WIDTH, tiff::TYPE_LONG, rLayout.nChunkWidth);
+            addField(aFields, tiff::TAG_TILE_LENGTH, tiff::TYPE_LONG,
+                     rLayout.nChunkHeight);
+            aFields.push_back(Field(tiff::TAG_TILE_OFFSETS, nOffsetType, rOffsets));
+            aFields.push_back(
+                Field(tiff::TAG_TILE_BYTE_COUNTS, nOffsetType, rByteCounts));
+        }
+        else
+        {
+            aFields.push_back(Field(tiff::TAG_STRIP_OFFSETS, nOffsetType, rOffsets));
+            addField(aFields, tiff::TAG_SAMPLES_PER_PIXEL, tiff::TYPE_SHORT, 1);
+            addField(aFields, tiff::TAG_ROWS_PER_STRIP, tiff::TYPE_LONG,
+                     rLayout.nChunkHeight);
+            aFields.push_back(
+                Field(tiff::TAG_STRIP_BYTE_COUNTS, nOffsetType, rByteCounts));
+            addField(aFields, tiff::TAG_PLANAR_CONFIG, tiff::TYPE_SHORT, 1);
+        }
+
+        writeFields(aFields);
+    }
+
+    // Writes the IFD for rFields (in ascending tag order) with out of line
+    // values after it, and links it from the previous page.
+    void writeFields(const std::vector<Field> &rFields)
+    {
+        if (nPos_ & 1)
+        {
+            put(std::vector<uint8_t>(1, 0));
+        }
+
+        const uint64_t nDirectory = nPos_;
+        const unsigned int nLinkBytes = linkBytes();
+        const uint64_t nDirectoryBytes = (bBigTiff_ ? 8 : 2) +
+            rFields.size() * (bBigTiff_ ? 20 : 12) + nLinkBytes;
+
+        std::vector<uint8_t> aDirectory, aExtra;
+        tiff::putValue(aDirectory, rFields.size(), bBigTiff_ ? 8 : 2);
+
+        for (size_t i = 0; i < rFields.size(); ++i)
+        {
+            const Field &rField = rFields[i];
+            const unsigned int nSize = tiff::typeSize(rField.nType);
+
+            std::vector<uint8_t> aData;
+
+            for (size_t j = 0; j < rField.aValues.size(); ++j)
+            {
+                tiff::putValue(aData, rField.aValues[j], nSize);
+            }
+
+            tiff::putValue(aDirectory, rField.nTag, 2);
+            tiff::putValue(aDirectory, rField.nType, 2);
+            tiff::putValue(aDirectory, rField.aValues.size(), nLinkBytes);
+
+            if (aData.size() <= nLinkBytes)
+            {
+                aData.resize(nLinkBytes, 0);
+                aDirectory.insert(aDirectory.end(), aData.begin(), aData.end());
+            }
+            else
+            {
+                tiff::putValue(aDirectory, nDirectory + nDirectoryBytes + aExtra.size(),
+                               nLinkBytes);
+                aExtra.insert(aExtra.end(), aData.begin(), aData.end());
+            }
+        }
+
+        const uint64_t nNextLink = nPos_ + aDirectory.size();
+        tiff::putValue(aDirectory, 0, nLinkBytes);
+        put(aDirectory);
+        put(aExtra);
+
+        // point the header or the previous page at this directory
+        std::vector<uint8_t> aLink;
+        tiff::putValue(aLink, nDirectory, nLinkBytes);
+        file_.seekp((std::streamoff)nLink_);
+        file_.write(reinterpret_cast<const char *>(aLink.data()), aLink.size());
+        file_.seekp((std::streamoff)nPos_);
+        nLink_ = nNextLink;
+
+        if (!file_)
+        {
+            throw npp::Exception("TIFF: could not write the file");
+        }
+    }
+
+    std::ofstream file_;
+    TiffOptions oOptions_;
+    bool bBigTiff_;
+    uint64_t nPos_;
+    // file position of the link to patch with the next directory offset
+    uint64_t nLink_;
+};
+
+// The orientation tag (1 to 8, as in EXIF) of the first page, 1 when it has
+// none or the file cannot be opened.
+inline unsigned int readTiffOrientation(const std::string &fileName)
+{
+    TiffReader oReader;
+
+    if (!oReader.open(fileName) || oReader.pages() == 0)
+    {
+        return 1;
+    }
+
+    unsigned int nValue = oReader.directory(0).nOrientation;
+    return nValue >= 1 && nValue <= 8 ? nValue : 1;
+}
+
+// Loads the first page of a TIFF or BigTIFF file as 8-bit gray.
+inline bool loadImageTIFF(const std::string &fileName, ImageBuffer_8u_C1 &rImage,
+                          unsigned int nThreads = 0)
+{
+    TiffReader oReader;
+
+    if (!oReader.open(fileName))
+    {
+        std::cerr << "Could not open file: " << fileName << std::endl;
+        return false;
+    }
+
+    tiff::Directory oDir = oReader.directory(0);
+    std::cout << "Loading image: " << oDir.nWidth << "x" << oDir.nHeight << " (TIFF, "
+              << (oDir.bTiled ? "tiled" : "striped") << ")" << std::endl;
+
+    rImage = ImageBuffer_8u_C1(oDir.nWidth, oDir.nHeight);
+    oReader.read(oDir, rImage.view(), nThreads);
+    return true;
+}
+
+// Estimated file size of one page, generous enough for incompressible data.
+inline uint64_t tiffPageBytes(unsigned int nWidth, unsigned int nHeight)
+{
+    uint64_t nPixels = (uint64_t)nWidth * nHeight;
+    return nPixels + nPixels / 64 + 65536;
+}
+
+inline void saveImageTIFF(const std::string &fileName, ImageConstView_8u_C1 oImage,
+                          const TiffOptions &rOptions = TiffOptions())
+{
+    TiffWriter oWriter(fileName, rOptions,
+                       tiffPageBytes(oImage.width(), oImage.height()));
+    oWriter.append(oImage);
+    oWriter.close();
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_TIFF_FILE_H
@@ -0,0 +1,182 @@
+/* Rotation of multi-page TIFF stacks (scanned documents, microscopy
+ * z-stacks) whose pages share one size.
+ *
+ * The rotation geometry is planned once for the whole stack.  Pages are the
+ * unit of parallelism: each worker decodes, rotates and encodes whole pages,
+ * which needs no coordination inside a page, and the coded pages are
+ * appended to the output in page order by a writer thread while the next
+ * pages are computed.  Stacks with fewer pages than threads split the
+ * remaining threads among the pages in flight.
+ */
+
+#ifndef PIPELINE_TIFF_STACK_H
+#define PIPELINE_TIFF_STACK_H
+
+#include <Exceptions.h>
+
+#include "ImageView.h"
+#include "Parallel.h"
+#include "RotateCPU.h"
+#include "RotateGeometry.h"
+#include "TiffFile.h"
+
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace pipeline
+{
+
+// Rotates every page of the TIFF stack inputName by nAngle degrees after
+// rOrientation and writes the results, in order, as the pages of the TIFF
+// outputName.  The pages must share one orientation tag, which rOrientation
+// is expected to include.  Returns the number of pages.
+inline size_t rotateTiffStack(const std::string &inputName,
+                              const std::string &outputName, double nAngle,
+                              const Orientation &rOrientation,
+                              const RotateOptions &rOptions,
+                              const TiffOptions &rTiffOptions)
+{
+    TiffReader oReader;
+
+    if (!oReader.open(inputName))
+    {
+        throw npp::Exception("Could not open file: " + inputName);
+    }
+
+    const size_t nPages = oReader.pages();
+    std::vector<tiff::Directory> aDirectories(nPages);
+
+    for (size_t i = 0; i < nPages; ++i)
+    {
+        aDirectories[i] = oReader.directory(i);
+
+        if (aDirectories[i].nWidth != aDirectories[0].nWidth ||
+            aDirectories[i].nHeight != aDirectories[0].nHeight)
+        {
+            throw npp::Exception("TIFF stack: pages differ in size");
+        }
+
+        // the caller folds the first page's orientation tag into rOrientation
+        if (aDirectories[i].nOrientation != aDirectories[0].nOrientation)
+        {
+            throw npp::Exception("TIFF stack: pages differ in orientation");
+        }
+    }
+
+    // a vertical flip without transpose is just the source read bottom up,
+    // as in the single image path
+    Orientation oOrientation = rOrientation;
+    const bool bReadBottomUp = !oOrientation.bTranspose && oOrientation.bFlipY;
+    oOrientation.bFlipY = oOrientation.bFlipY && oOrientation.bTranspose;
+
+    const RotateGeometry oGeometry = makeRotateGeometry(
+        aDirectories[0].nWidth, aDirectories[0].nHeight, nAngle, oOrientation);
+
+    // whole pages per worker; spare threads go to the pages themselves
+    const unsigned int nThreads = rOptions.nThreads != 0 ? rOptions.nThreads :
+                                                           hardwareThreads();
+    const unsigned int nWorkers = workerCount(nPages, nThreads);
+    RotateOptions oPageOptions = rOptions;
+    oPageOptions.nThreads = std::max(1u, nThreads / nWorkers);
+
+    TiffWriter oWriter(outputName, rTiffOptions,
+                       nPages * tiffPageBytes(oGeometry.nDstWidth,
+                                              oGeometry.nDstHeight));
+
+    std::vector<ImageBuffer_8u_C1> aSources(nWorkers), aRotated(nWorkers);
+    // windows of two pages per worker; a writer thread appends the coded
+    // pages of one window while the workers compute the next
+    const size_t nWindow = 2 * (size_t)nWorkers;
+    std::vector<TiffWriter::Page> aPages[2];
+    aPages[0].resize(nWindow);
+    aPages[1].resize(nWindow);
+    std::thread oWriterThread;
+    std::exception_ptr pWriteError;
+
+    try
+    {
+        for (size_t iFirst = 0, iBuffer = 0; iFirst < nPages;
+             iFirst += nWindow, iBuffer ^= 1)
+        {
+            size_t nCount = std::min(nWindow, nPages - iFirst);
+            std::vector<TiffWriter::Page> &rPages = aPages[iBuffer];
+
+            parallelForWorkers(nCount, [&](size_t i, unsigned int nWorker)
+            {
+                const tiff::Directory &rDir = aDirectories[iFirst + i];
+                ImageBuffer_8u_C1 &rSource = aSources[nWorker];
+                ImageBuffer_8u_C1 &rRotated = aRotated[nWorker];
+
+                if (rSource.width() == 0)
+                {
+                    rSource = ImageBuffer_8u_C1(rDir.nWidth, rDir.nHeight);
+                    rRotated =
+                        ImageBuffer_8u_C1(oGeometry.nDstWidth, oGeometry.nDstHeight);
+                }
+
+                oReader.read(rDir, rSource.view(), oPageOptions.nThreads);
+                ImageConstView_8u_C1 oSource = rSource.view();
+                rotate(bReadBottomUp ? oSource.flipVertical() : oSource,
+                       rRotated.view(), oGeometry, oPageOptions);
+                rPages[i] = oWriter.encode(rRotated.view(), oPageOptions.nThreads);
+            }, nWorkers);
+
+            // the previous window is written before this one, whose buffer
+            // the next window reuses once it is
+            if (oWriterThread.joinable())
+            {
+                oWriterThread.join();
+            }
+
+            if (pWriteError)
+            {
+                std::rethrow_exception(pWriteError);
+            }
+
+            oWriterThread = std::thread([&oWriter, &rPages, &pWriteError, nCount]()
+            {
+                try
+                {
+                    for (size_t i = 0; i < nCount; ++i)
+                    {
+                        oWriter.append(rPages[i]);
+                        rPages[i] = TiffWriter::Page();
+                    }
+                }
+                catch (...)
+                {
+                    pWriteError = std::current_exception();
+                }
+            });
+        }
+    }
+    catch (...)
+    {
+        if (oWriterThread.joinable())
+        {
+            oWriterThread.join();
+        }
+
+        throw;
+    }
+
+    if (oWriterThread.joinable())
+    {
+        oWriterThread.join();
+    }
+
+    if (pWriteError)
+    {
+        std::rethrow_exception(pWriteError);
+    }
+
+    oWriter.close();
+    return nPages;
+}
+
+} // namespace pipeline
+
+#endif // PIPELINE_TIFF_STACK_H
@@ -0,0 +1,370 @@
+/* Benchmarks of the host rotation's tuning options.
+ *
+ * --sweep=traversal (the default) rotates synthetic sources sized around the
+ * L2 and last level caches with the row-major tile grid at several tile
+ * sizes and with the Hilbert and Z-order curve traversals, and prints the
+ * best time of each.  A tile size that is right for one cache and image size
+ * is usually wrong for another; the curves should stay close to the best
+ * tile size everywhere.
+ *
+ * --sweep=prefetch rotates a source twice the size of the last level cache
+ * with a range of prefetch distances, for two tile widths since a walk never
+ * prefetches past the end of its row segment.
+ *
+ * --sweep=stores compares ordinary and non-temporal destination stores on
+ * destinations from within the L2 to twice the last level cache.
+ *
+ *   benchRotate [--sweep=traversal|prefetch|stores] [--angle=30]
+ *               [--interp=linear] [--threads=N] [--repeat=5] [--max-mb=256]
+ */
+
+#include <CacheInfo.h>
+#include <ImageView.h>
+#include <RotateCPU.h>
+#include <RotateGeometry.h>
+
+#include <helper_string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+struct Variant
+{
+    const char *pName;
+    pipeline::Traversal eTraversal;
+    unsigned int nTile;
+};
+
+// Deterministic texture, so every run reads the same pixels.
+void fillSource(pipeline::ImageView_8u_C1 oView)
+{
+    uint32_t nState = 0x9e3779b9u;
+
+    for (unsigned int y = 0; y < oView.height(); ++y)
+    {
+        unsigned char *pRow = oView.row(y);
+
+        for (unsigned int x = 0; x < oView.width(); ++x)
+        {
+            nState = nState * 1664525u + 1013904223u;
+            pRow[x] = (unsigned char)((x ^ y) + (nState >> 29));
+        }
+    }
+}
+
+uint64_t checksum(pipeline::ImageConstView_8u_C1 oView)
+{
+    uint64_t nSum = 1469598103934665603ull;
+
+    for (unsigned int y = 0; y < oView.height(); ++y)
+    {
+        const unsigned char *pRow = oView.row(y);
+
+        for (unsigned int x = 0; x < oView.width(); ++x)
+        {
+            nSum = (nSum ^ pRow[x]) * 1099511628211ull;
+        }
+    }
+
+    return nSum;
+}
+
+// Best of nRepeat runs, in milliseconds.
+double timeRotate(pipeline::ImageConstView_8u_C1 oSrc, pipeline::ImageView_8u_C1 oDst,
+                  const pipeline::RotateGeometry &rGeometry,
+                  const pipeline::RotateOptions &rOptions, unsigned int nRepeat)
+{
+    double nBest = 0.0;
+
+    for (unsigned int i = 0; i < nRepeat; ++i)
+    {
+        std::chrono::steady_clock::time_point oStart = std::chrono::steady_clock::now();
+        pipeline::rotate(oSrc, oDst, rGeometry, rOptions);
+        std::chrono::duration<double, std::milli> oElapsed =
+            std::chrono::steady_clock::now() - oStart;
+
+        if (i == 0 || oElapsed.count() < nBest)
+        {
+            nBest = oElapsed.count();
+        }
+    }
+
+    return nBest;
+}
+
+// Side of a square source of about nBytes pixels, at most nMaxBytes.
+unsigned int sourceSide(size_t nBytes, size_t nMaxBytes)
+{
+    nBytes = std::min(nBytes, nMaxBytes);
+    return std::max(64u, (unsigned int)std::sqrt((double)nBytes));
+}
+
+void traversalSweep(const pipeline::RotateOptions &rOptions, double nAngle,
+                    unsigned int nRepeat, size_t nMaxBytes)
+{
+    const size_t nL2 = pipeline::l2CacheBytes();
+    const size_t nLLC = pipeline::llcBytes();
+
+    struct Size
+    {
+        const char *pName;
+        size_t nBytes;
+    } aSizes[] = {{"L2/2", nL2 / 2}, {"L2*4", nL2 * 4}, {"LLC/2", nLLC / 2},
+                  {"LLC*4", nLLC * 4}};
+
+    const Variant aVariants[] = {
+        {"tiles 16", pipeline::TRAVERSAL_TILES, 16},
+        {"tiles 32", pipeline::TRAVERSAL_TILES, 32},
+        {"tiles 64", pipeline::TRAVERSAL_TILES, 64},
+        {"tiles 128", pipeline::TRAVERSAL_TILES, 128},
+        {"tiles 256", pipeline::TRAVERSAL_TILES, 256},
+        {"tiles 512", pipeline::TRAVERSAL_TILES, 512},
+        {"hilbert", pipeline::TRAVERSAL_HILBERT, 0},
+        {"morton", pipeline::TRAVERSAL_MORTON, 0}};
+
+    printf("%-7s %11s  %-10s %10s %10s\n", "source", "pixels", "traversal", "ms",
+           "Mpix/s");
+
+    for (size_t s = 0; s < sizeof(aSizes) / sizeof(aSizes[0]); ++s)
+    {
+        unsigned int nSide = sourceSide(aSizes[s].nBytes, nMaxBytes);
+        pipeline::ImageBuffer_8u_C1 oSrc(nSide, nSide);
+        fillSource(oSrc.view());
+        pipeline::RotateGeometry oGeometry =
+            pipeline::makeRotateGeometry(nSide, nSide, nAngle);
+        pipeline::ImageBuffer_8u_C1 oDst(oGeometry.nDstWidth, oGeometry.nDstHeight);
+        const double nPixels = (double)oGeometry.nDstWidth * oGeometry.nDstHeight;
+        uint64_t nReference = 0;
+
+        for (size_t v = 0; v < sizeof(aVariants) / sizeof(aVariants[0]); ++v)
+        {
+            pipeline::RotateOptions oRun = rOptions;
+            oRun.eTraversal = aVariants[v].eTraversal;
+
+            if (aVariants[v].nTile > 0)
+            {
+                oRun.nTileWidth = oRun.nTileHeight = aVariants[v].nTile;
+            }
+
+            double nMs = timeRotate(oSrc.view(), oDst.view(), oGeometry, oRun, nRepeat);
+            uint64_t nSum = checksum(oDst.view());
+
+            // the curves visit 64 pixel blocks and must match 64 pixel tiles
+            if (aVariants[v].nTile == 64)
+            {
+                nReference = nSum;
+            }
+
+            bool bMismatch = aVariants[v].nTile == 0 && nSum != nReference;
+            printf("%-7s %5ux%-5u  %-10s %10.2f %10.1f%s\n", aSizes[s].pName, nSide,
+                   nSide, aVariants[v].pName, nMs, nPixels / nMs / 1000.0,
+                   bMismatch ? "  (output differs from tiles 64)" : "");
+        }
+
+        printf("\n");
+    }
+}
+
+void prefetchSweep(const pipeline::RotateOptions &rOptions, double nAngle,
+                   unsigned int nRepeat, size_t nMaxBytes)
+{
+    unsigned int nSide = sourceSide(pipeline::llcBytes() * 2, nMaxBytes);
+
+    if ((size_t)nSide * nSide <= pipeline::llcBytes())
+    {
+        printf("note: --max-mb keeps the source within the last level cache\n\n");
+    }
+
+    pipeline::ImageBuffer_8u_C1 oSrc(nSide, nSide);
+    fillSource(oSrc.view());
+    pipeline::RotateGeometry oGeometry =
+        pipeline::makeRotateGeometry(nSide, nSide, nAngle);
+    pipeline::ImageBuffer_8u_C1 oDst(oGeometry.nDstWidth, oGeometry.nDstHeight);
+    const double nPixels = (double)oGeometry.nDstWidth * oGeometry.nDstHeight;
+    const unsigned int aTiles[] = {64, 256};
+    const unsigned int aDistances[] = {0, 4, 8, 16, 32, 64, 128};
+
+    printf("source %ux%u\n%-6s %9s %10s %10s\n", nSide, nSide, "tile", "distance",
+           "ms", "Mpix/s");
+
+    for (size_t t = 0; t < sizeof(aTiles) / sizeof(aTiles[0]); ++t)
+    {
+        uint64_t nReference = 0;
+
+        for (size_t d = 0; d < sizeof(aDistances) / sizeof(aDistances[0]); ++d)
+        {
+            pipeline::RotateOptions oRun = rOptions;
+            oRun.nTileWidth = oRun.nTileHeight = aTiles[t];
+            oRun.nPrefetchDistance = aDistances[d];
+
+            double nMs = timeRotate(oSrc.view(), oDst.view(), oGeometry, oRun, nRepeat);
+            uint64_t nSum = checksum(oDst.view());
+
+            if (d == 0)
+            {
+                nReference = nSum;
+            }
+
+            printf("%-6u %9u %10.2f %10.1f%s\n", aTiles[t], aDistances[d], nMs,
+                   nPixels / nMs / 1000.0,
+                   nSum != nReference ? "  (output differs)" : "");
+        }
+
+        printf("\n");
+    }
+}
+
+void storeSweep(const pipeline::RotateOptions &rOptions, double nAngle,
+                unsigned int nRepeat, size_t nMaxBytes)
+{
+    const size_t nL2 = pipeline::l2CacheBytes();
+    const size_t nLLC = pipeline::llcBytes();
+
+    struct Size
+    {
+        const char *pName;
+        size_t nBytes;
+    } aSizes[] = {{"L2/2", nL2 / 2}, {"L2*4", nL2 * 4}, {"LLC/2", nLLC / 2},
+                  {"LLC*2", nLLC * 2}};
+
+    // sources are sized so the destination has the nominal size
+    pipeline::RotateGeometry oUnit = pipeline::makeRotateGeometry(1000, 1000, nAngle);
+    const double nGrowth = (double)oUnit.nDstWidth * oUnit.nDstHeight / 1e6;
+
+    printf("%-7s %11s  %-10s %10s %10s\n", "dest", "source", "stores", "ms",
+           "Mpix/s");
+
+    for (size_t s = 0; s < sizeof(aSizes) / sizeof(aSizes[0]); ++s)
+    {
+        unsigned int nSide =
+            sourceSide((size_t)(aSizes[s].nBytes / nGrowth), nMaxBytes);
+        pipeline::ImageBuffer_8u_C1 oSrc(nSide, nSide);
+        fillSource(oSrc.view());
+        pipeline::RotateGeometry oGeometry =
+            pipeline::makeRotateGeometry(nSide, nSide, nAngle);
+        pipeline::ImageBuffer_8u_C1 oDst(oGeometry.nDstWidth, oGeometry.nDstHeight);
+        const double nPixels = (double)oGeometry.nDstWidth * oGeometry.nDstHeight;
+        uint64_t nReference = 0;
+
+        for (int i = 0; i < 2; ++i)
+        {
+            pipeline::RotateOptions oRun = rOptions;
+            oRun.eStores = i == 0 ? pipeline::STORES_CACHED : pipeline::STORES_STREAMING;
+
+            double nMs = timeRotate(oSrc.view(), oDst.view(), oGeometry, oRun, nRepeat);
+            uint64_t nSum = checksum(oDst.view());
+
+            if (i == 0)
+            {
+                nReference = nSum;
+            }
+
+            printf("%-7s %5ux%-5u  %-10s %10.2f %10.1f%s\n", aSizes[s].pName, nSide,
+                   nSide, i == 0 ? "cached" : "streaming", nMs, nPixels / nMs / 1000.0,
+                   nSum != nReference ? "  (output differs)" : "");
+        }
+
+        printf("\n");
+    }
+}
+
+void printUsage()
+{
+    fprintf(stderr,
+            "usage: benchRotate [--sweep=traversal|prefetch|stores] [--angle=30]\n"
+            "                   [--interp=linear] [--threads=N] [--repeat=5] "
+            "[--max-mb=256]\n");
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    double nAngle = 30.0;
+    unsigned int nRepeat = 5;
+    size_t nMaxBytes = (size_t)256 << 20;
+    pipeline::RotateOptions oOptions;
+    std::string sSweep = "traversal";
+
+    if (checkCmdLineFlag(argc, (const char **)argv, "sweep"))
+    {
+        char *sweepName = 0;
+        getCmdLineArgumentString(argc, (const char **)argv, "sweep", &sweepName);
+
+        if (sweepName)
+        {
+            sSweep = sweepName;
+        }
+
+        if (!sweepName ||
+            (sSweep != "traversal" && sSweep != "prefetch" && sSweep != "stores"))
+        {
+            printUsage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (checkCmdLineFlag(argc, (const char **)argv, "angle"))
+    {
+        nAngle = getCmdLineArgumentFloat(argc, (const char **)argv, "angle");
+    }
+
+    if (checkCmdLineFlag(argc, (const char **)argv, "interp"))
+    {
+        char *interpName = 0;
+        getCmdLineArgumentString(argc, (const char **)argv, "interp", &interpName);
+
+        if (interpName && strcmp(interpName, "linear") == 0)
+        {
+            oOptions.eInterpolation = pipeline::INTER_LINEAR;
+        }
+    }
+
+    if (checkCmdLineFlag(argc, (const char **)argv, "threads"))
+    {
+        oOptions.nThreads = (unsigned int)std::max(
+            0, getCmdLineArgumentInt(argc, (const char **)argv, "threads"));
+    }
+
+    if (checkCmdLineFlag(argc, (const char **)argv, "repeat"))
+    {
+        nRepeat = (unsigned int)std::max(
+            1, getCmdLineArgumentInt(argc, (const char **)argv, "repeat"));
+    }
+
+    if (checkCmdLineFlag(argc, (const char **)argv, "max-mb"))
+    {
+        nMaxBytes = (size_t)std::max(
+                        1, getCmdLineArgumentInt(argc, (const char **)argv, "max-mb"))
+                    << 20;
+    }
+
+    printf("L2 %zu KiB, last level cache %zu KiB, %u workers, angle %g, %s\n\n",
+           pipeline::l2CacheBytes() >> 10, pipeline::llcBytes() >> 10,
+           pipeline::workerCount((size_t)-1, oOptions.nThreads), nAngle,
+           oOptions.eInterpolation == pipeline::INTER_LINEAR ? "linear" : "nearest");
+
+    if (sSweep == "prefetch")
+    {
+        prefetchSweep(oOptions, nAngle, nRepeat, nMaxBytes);
+    }
+    else if (sSweep == "stores")
+    {
+        storeSweep(oOptions, nAngle, nRepeat, nMaxBytes);
+    }
+    else
+    {
+        traversalSweep(oOptions, nAngle, nRepeat, nMaxBytes);
+    }
+
+    return EXIT_SUCCESS;
+}
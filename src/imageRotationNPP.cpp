@@ -36,10 +36,26 @@
 #include <ImageIO.h>
 #include <ImagesCPU.h>
 #include <ImagesNPP.h>
+#include <Binarize.h>
+#include <DeviceShards.h>
+#include <ImageCompare.h>
+#include <ImageFile.h>
+#include <ImageStats.h>
+#include <ImageView.h>
+#include <JpegTransform.h>
+#include <OpGraph.h>
+#include <Morphology.h>
+#include <Resize.h>
+#include <RotateBits.h>
+#include <RotateCPU.h>
+#include <ShearDeskew.h>
+#include <TiffStack.h>
 
 #include <string.h>
+#include <cmath>
 #include <fstream>
 #include <iostream>
+#include <memory>
 
 #include <cuda_runtime.h>
 #include <npp.h>
@@ -68,6 +84,243 @@ bool printfNPPinfo(int argc, char *argv[])
     return bVal;
 }
 
+// Writes a host result: PGM/PPM/L4R/TIFF through the pipeline writers,
+// anything else through FreeImage.
+void saveHostImage(const std::string &rFileName,
+                   pipeline::ImageConstView_8u_C1 oImage,
+                   const pipeline::TiffOptions &rTiffOptions = pipeline::TiffOptions())
+{
+    if (pipeline::isPipelineImageFile(rFileName))
+    {
+        pipeline::saveImageFile(rFileName, oImage, rTiffOptions);
+        return;
+    }
+
+    npp::ImageCPU_8u_C1 oFreeImage(oImage.width(), oImage.height());
+    pipeline::ImageView_8u_C1 oFreeImageView = pipeline::viewOf(oFreeImage);
+
+    for (unsigned int y = 0; y < oImage.height(); ++y)
+    {
+        memcpy(oFreeImageView.row(y), oImage.row(y), oImage.width());
+    }
+
+    saveImage(rFileName, oFreeImage);
+}
+
+// Loads a gray-scale image into host memory through the pipeline readers,
+// libjpeg or FreeImage.
+bool loadHostImage(const std::string &rFileName,
+                   pipeline::ImageBuffer_8u_C1 &rImage)
+{
+    if (pipeline::isPipelineImageFile(rFileName))
+    {
+        return pipeline::loadImageFile(rFileName, rImage);
+    }
+
+    if (pipeline::isJpegFile(rFileName))
+    {
+        return pipeline::loadImageJPEG(rFileName, rImage);
+    }
+
+    npp::ImageCPU_8u_C1 oFreeImage;
+    npp::loadImage(rFileName, oFreeImage);
+    pipeline::ImageConstView_8u_C1 oFreeImageView = pipeline::viewOf(oFreeImage);
+    rImage = pipeline::ImageBuffer_8u_C1(oFreeImage.width(), oFreeImage.height());
+
+    for (unsigned int y = 0; y < rImage.height(); ++y)
+    {
+        memcpy(rImage.view().row(y), oFreeImageView.row(y), rImage.width());
+    }
+
+    return true;
+}
+
+// --compare mode: reports the differences between --input and rReference and
+// fails when they exceed --max-error or fall below --min-psnr.
+int compareMode(int argc, char *argv[], const std::string &rInput,
+                const std::string &rReference)
+{
+    pipeline::ImageBuffer_8u_C1 oA, oB;
+
+    if (!loadHostImage(rInput, oA) || !loadHostImage(rReference, oB))
+    {
+        return EXIT_FAILURE;
+    }
+
+    // --diff=<file> also writes the absolute difference image
+    bool bDiff = checkCmdLineFlag(argc, (const char **)argv, "diff");
+    char *diffFilePath = 0;
+    pipeline::ImageBuffer_8u_C1 oDiff;
+    pipeline::ImageView_8u_C1 oDiffView;
+
+    if (bDiff)
+    {
+        getCmdLineArgumentString(argc, (const char **)argv, "diff", &diffFilePath);
+
+        if (!diffFilePath)
+        {
+            throw npp::Exception("--diff expects a file name");
+        }
+
+        oDiff = pipeline::ImageBuffer_8u_C1(oA.width(), oA.height());
+        oDiffView = oDiff.view();
+    }
+
+    pipeline::CompareResult oResult =
+        pipeline::compareImages(oA.view(), oB.view(), bDiff ? &oDiffView : 0);
+
+    printf("Compare %s with %s: %llu of %llu pixels differ\n", rInput.c_str(),
+           rReference.c_str(), (unsigned long long)oResult.nDiffPixels,
+           (unsigned long long)oResult.nPixels);
+    printf("  max error %d, mean abs error %.4f, MSE %.4f, PSNR %.2f dB, SSIM %.5f\n",
+           oResult.nMaxError, oResult.nMeanAbsError, oResult.nMse, oResult.nPsnr,
+           oResult.nSsim);
+
+    if (bDiff)
+    {
+        saveHostImage(diffFilePath, oDiff.view());
+        std::cout << "Saved difference image: " << diffFilePath << std::endl;
+    }
+
+    bool bPass = true;
+
+    if (checkCmdLineFlag(argc, (const char **)argv, "max-error"))
+    {
+        bPass &= oResult.nMaxError <=
+                 getCmdLineArgumentInt(argc, (const char **)argv, "max-error");
+    }
+
+    if (checkCmdLineFlag(argc, (const char **)argv, "min-psnr"))
+    {
+        bPass &= oResult.nPsnr >=
+                 getCmdLineArgumentFloat(argc, (const char **)argv, "min-psnr");
+    }
+
+    printf("%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Rotates oSrc by nAngle degrees, placed by rGeometry, with nppiRotate split
+// over nDevices shards (DeviceShards.h).  Shard i runs on CUDA device i
+// modulo the device count, from its own host thread, and uploads only the
+// source pixels it reads.  Prints the bytes each device moved.
+pipeline::ImageBuffer_8u_C1 rotateOnDevices(pipeline::ImageConstView_8u_C1 oSrc,
+                                            double nAngle,
+                                            const pipeline::RotateGeometry &rGeometry,
+                                            const pipeline::RotateOptions &rOptions,
+                                            unsigned int nDevices)
+{
+    int nDeviceCount = 0;
+    checkCudaErrors(cudaGetDeviceCount(&nDeviceCount));
+
+    std::vector<pipeline::DeviceShard> aShards =
+        pipeline::planDeviceShards(rGeometry, nDevices, rOptions.eInterpolation);
+    pipeline::ImageBuffer_8u_C1 oDst(rGeometry.nDstWidth, rGeometry.nDstHeight);
+    pipeline::ImageView_8u_C1 oDstView = oDst.view();
+
+    pipeline::parallelFor(aShards.size(), [&](size_t i)
+    {
+        const pipeline::DeviceShard &rShard = aShards[i];
+
+        if (rShard.oDst.empty())
+        {
+            return;
+        }
+
+        const NppiRect oDstROI = {0, 0, rShard.oDst.width, rShard.oDst.height};
+        pipeline::ImageView_8u_C1 oOut = oDstView.crop(
+            rShard.oDst.x, rShard.oDst.y, rShard.oDst.width, rShard.oDst.height);
+
+        if (rShard.oSrc.empty())
+        {
+            for (unsigned int y = 0; y < oOut.height(); ++y)
+            {
+                memset(oOut.row(y), rOptions.nBackground, oOut.width());
+            }
+
+            return;
+        }
+
+        checkCudaErrors(cudaSetDevice((int)(rShard.nDevice % nDeviceCount)));
+
+        // allocate the source box, but upload only the bands that are read;
+        // the rest is set rather than left uninitialised
+        npp::ImageNPP_8u_C1 oDeviceSrc(rShard.oSrc.width, rShard.oSrc.height);
+        checkCudaErrors(cudaMemset2D(oDeviceSrc.data(), oDeviceSrc.pitch(),
+                                     rOptions.nBackground, rShard.oSrc.width,
+                                     rShard.oSrc.height));
+
+        for (size_t iBand = 0; iBand < rShard.aSrcBands.size(); ++iBand)
+        {
+            const pipeline::PixelRect &rBand = rShard.aSrcBands[iBand];
+            pipeline::ImageConstView_8u_C1 oIn =
+                oSrc.crop(rBand.x, rBand.y, rBand.width, rBand.height);
+            Npp8u *pDeviceBand = oDeviceSrc.data() +
+                                 (size_t)(rBand.y - rShard.oSrc.y) * oDeviceSrc.pitch() +
+                                 (rBand.x - rShard.oSrc.x);
+            checkCudaErrors(cudaMemcpy2D(pDeviceBand, oDeviceSrc.pitch(), oIn.data(),
+                                         oIn.pitch(), oIn.width(), oIn.height(),
+                                         cudaMemcpyHostToDevice));
+        }
+
+        // nppiRotate leaves the pixels outside the rotated source untouched
+        npp::ImageNPP_8u_C1 oDeviceDst(oOut.width(), oOut.height());
+        const NppiSize oDstSize = {rShard.oDst.width, rShard.oDst.height};
+        NPP_CHECK_NPP(nppiSet_8u_C1R(rOptions.nBackground, oDeviceDst.data(),
+                                     oDeviceDst.pitch(), oDstSize));
+
+        // both rectangles' offsets fold into the shift; NPP centres pixels on
+        // integer coordinates
+        pipeline::AffineTransform oLocal =
+            pipeline::AffineTransform::translation(-rShard.oDst.x, -rShard.oDst.y) *
+            rGeometry.oForward *
+            pipeline::AffineTransform::translation(rShard.oSrc.x, rShard.oSrc.y);
+        double nShiftX, nShiftY;
+        oLocal.apply(0.5, 0.5, nShiftX, nShiftY);
+
+        NppiSize oSrcSize = {rShard.oSrc.width, rShard.oSrc.height};
+        NppiRect oSrcROI = {0, 0, rShard.oSrc.width, rShard.oSrc.height};
+        NPP_CHECK_NPP(nppiRotate_8u_C1R(
+            oDeviceSrc.data(), oSrcSize, oDeviceSrc.pitch(), oSrcROI,
+            oDeviceDst.data(), oDeviceDst.pitch(), oDstROI,
+            nAngle, nShiftX - 0.5, nShiftY - 0.5,
+            rOptions.eInterpolation == pipeline::INTER_LINEAR ? NPPI_INTER_LINEAR
+                                                              : NPPI_INTER_NN));
+
+        oDeviceDst.copyTo(oOut.data(), (unsigned int)oOut.pitch());
+    }, (unsigned int)aShards.size());
+
+    size_t nUploaded = 0;
+
+    for (size_t i = 0; i < aShards.size(); ++i)
+    {
+        const pipeline::DeviceShard &rShard = aShards[i];
+        size_t nUp = pipeline::sourcePixels(rShard);
+        nUploaded += nUp;
+        printf("Shard %u on device %d: destination %dx%d at (%d,%d), "
+               "source %dx%d at (%d,%d), %llu bytes up, %llu bytes down\n",
+               rShard.nDevice, (int)(rShard.nDevice % nDeviceCount),
+               rShard.oDst.width, rShard.oDst.height, rShard.oDst.x,
+               rShard.oDst.y, rShard.oSrc.width, rShard.oSrc.height,
+               rShard.oSrc.x, rShard.oSrc.y, (unsigned long long)nUp,
+               (unsigned long long)rShard.oDst.width * rShard.oDst.height);
+    }
+
+    printf("Uploaded %llu bytes for a %llu byte source (%.1f%%)\n",
+           (unsigned long long)nUploaded,
+           (unsigned long long)oSrc.width() * oSrc.height(),
+           100.0 * nUploaded / ((double)oSrc.width() * oSrc.height()));
+    return oDst;
+}
+
+// Prints the QA statistics of the rotated image.
+void printImageStats(const pipeline::ImageStats &rStats)
+{
+    printf("Output stats: %llu pixels, min %d, max %d, mean %.3f, stddev %.3f\n",
+           (unsigned long long)rStats.count(), rStats.minimum(),
+           rStats.maximum(), rStats.mean(), rStats.stddev());
+}
+
 int main(int argc, char *argv[])
 {
     printf("%s Starting...\n\n", argv[0]);
@@ -77,13 +330,157 @@ int main(int argc, char *argv[])
         std::string sFilename;
         char *filePath;
 
-        findCudaDevice(argc, (const char **)argv);
+        // --backend=cpu runs the tiled host rotation and needs no GPU
+        bool bCpuBackend = false;
 
-        if (printfNPPinfo(argc, argv) == false)
+        if (checkCmdLineFlag(argc, (const char **)argv, "backend"))
         {
-            exit(EXIT_SUCCESS);
+            char *backendName = 0;
+            getCmdLineArgumentString(argc, (const char **)argv, "backend",
+                                     &backendName);
+
+            if (backendName && strcmp(backendName, "cpu") == 0)
+            {
+                bCpuBackend = true;
+            }
+            else if (!backendName || strcmp(backendName, "npp") != 0)
+            {
+                throw npp::Exception("--backend expects npp or cpu");
+            }
+        }
+
+        double angle = 45.0; // Rotation angle in degrees
+
+        if (checkCmdLineFlag(argc, (const char **)argv, "angle"))
+        {
+            angle = getCmdLineArgumentFloat(argc, (const char **)argv, "angle");
+        }
+
+        // --stats reports min/max/mean/stddev of the rotated image; on the
+        // cpu backend they are accumulated while the tiles are written
+        bool bStats = checkCmdLineFlag(argc, (const char **)argv, "stats");
+
+        // --interp=linear samples the host warps (and nppiRotate) bilinearly
+        // instead of taking the nearest neighbour
+        pipeline::RotateOptions oRotateOptions;
+
+        if (checkCmdLineFlag(argc, (const char **)argv, "interp"))
+        {
+            char *interpName = 0;
+            getCmdLineArgumentString(argc, (const char **)argv, "interp",
+                                     &interpName);
+
+            if (interpName && strcmp(interpName, "linear") == 0)
+            {
+                oRotateOptions.eInterpolation = pipeline::INTER_LINEAR;
+            }
+            else if (!interpName || strcmp(interpName, "nearest") != 0)
+            {
+                throw npp::Exception("--interp expects nearest or linear");
+            }
+        }
+
+        // --traversal=hilbert|morton orders the cpu backend's destination
+        // blocks along a space filling curve instead of the tile grid
+        if (checkCmdLineFlag(argc, (const char **)argv, "traversal"))
+        {
+            char *traversalName = 0;
+            getCmdLineArgumentString(argc, (const char **)argv, "traversal",
+                                     &traversalName);
+
+            if (traversalName && strcmp(traversalName, "tiles") == 0)
+            {
+                oRotateOptions.eTraversal = pipeline::TRAVERSAL_TILES;
+            }
+            else if (traversalName && strcmp(traversalName, "hilbert") == 0)
+            {
+                oRotateOptions.eTraversal = pipeline::TRAVERSAL_HILBERT;
+            }
+            else if (traversalName && strcmp(traversalName, "morton") == 0)
+            {
+                oRotateOptions.eTraversal = pipeline::TRAVERSAL_MORTON;
+            }
+            else
+            {
+                throw npp::Exception("--traversal expects tiles, hilbert or morton");
+            }
+        }
+
+        // --prefetch=N has the cpu backend prefetch the source lines read N
+        // destination pixels ahead along each walk
+        if (checkCmdLineFlag(argc, (const char **)argv, "prefetch"))
+        {
+            oRotateOptions.nPrefetchDistance = (unsigned int)std::max(
+                0, getCmdLineArgumentInt(argc, (const char **)argv, "prefetch"));
         }
 
+        // --stores=cached|streaming overrides the cpu backend's choice of
+        // non-temporal destination stores, made by the destination size
+        if (checkCmdLineFlag(argc, (const char **)argv, "stores"))
+        {
+            char *storesName = 0;
+            getCmdLineArgumentString(argc, (const char **)argv, "stores",
+                                     &storesName);
+
+            if (storesName && strcmp(storesName, "cached") == 0)
+            {
+                oRotateOptions.eStores = pipeline::STORES_CACHED;
+            }
+            else if (storesName && strcmp(storesName, "streaming") == 0)
+            {
+                oRotateOptions.eStores = pipeline::STORES_STREAMING;
+            }
+            else
+            {
+                throw npp::Exception("--stores expects cached or streaming");
+            }
+        }
+
+        // --deskew[=px] lets the cpu backend rotate by at most 2 degrees with
+        // two shears when their samples stay within px (0.5 by default) of
+        // the exact rotation's
+        bool bDeskew = checkCmdLineFlag(argc, (const char **)argv, "deskew");
+        double nDeskewTolerance = 0.5;
+
+        if (bDeskew)
+        {
+            float nValue = getCmdLineArgumentFloat(argc, (const char **)argv, "deskew");
+
+            if (nValue > 0.0f)
+            {
+                nDeskewTolerance = nValue;
+            }
+        }
+
+        // --ops="op:args;op:args;..." runs a chain of crops, rotations, flips,
+        // scales and point operations on the host, fused into as few passes
+        // as possible, instead of the --angle rotation; --explain prints the
+        // fused plan
+        bool bOps = checkCmdLineFlag(argc, (const char **)argv, "ops");
+        bool bExplain = checkCmdLineFlag(argc, (const char **)argv, "explain");
+        std::string sOps;
+
+        if (bOps)
+        {
+            char *opsList = 0;
+            getCmdLineArgumentString(argc, (const char **)argv, "ops", &opsList);
+
+            if (!opsList)
+            {
+                throw npp::Exception("--ops expects a list of operations");
+            }
+
+            sOps = opsList;
+        }
+        else if (bExplain)
+        {
+            throw npp::Exception("--explain needs --ops");
+        }
+
+        // --stack rotates every page of a multi-page TIFF input on the host,
+        // whole pages in parallel, into a multi-page TIFF output
+        bool bStack = checkCmdLineFlag(argc, (const char **)argv, "stack");
+
         if (checkCmdLineFlag(argc, (const char **)argv, "input"))
         {
             getCmdLineArgumentString(argc, (const char **)argv, "input", &filePath);
@@ -102,6 +499,38 @@ int main(int argc, char *argv[])
             sFilename = "Lena.pgm";
         }
 
+        // --compare=<reference> checks --input against a reference image on
+        // the host and exits; no rotation and no GPU
+        if (checkCmdLineFlag(argc, (const char **)argv, "compare"))
+        {
+            char *referenceFilePath;
+            getCmdLineArgumentString(argc, (const char **)argv, "compare",
+                                     &referenceFilePath);
+            exit(compareMode(argc, argv, sFilename, referenceFilePath));
+        }
+
+        // bitonal PBM input is rotated on packed bits by the host engine;
+        // NPP has no 1bpp rotation
+        bool bBitonal = pipeline::fileExtension(sFilename) == ".pbm";
+
+        // NPP rotates in its own order; only the host engine walks blocks
+        // along a curve
+        if (!bCpuBackend && !bBitonal && !bOps && !bStack &&
+            checkCmdLineFlag(argc, (const char **)argv, "traversal"))
+        {
+            throw npp::Exception("--traversal needs --backend=cpu");
+        }
+
+        if (!bCpuBackend && !bBitonal && !bOps && !bStack)
+        {
+            findCudaDevice(argc, (const char **)argv);
+
+            if (printfNPPinfo(argc, argv) == false)
+            {
+                exit(EXIT_SUCCESS);
+            }
+        }
+
         // if we specify the filename at the command line, then we only test
         // sFilename[0].
         int file_errors = 0;
@@ -136,7 +565,295 @@ int main(int argc, char *argv[])
             sResultFilename = sResultFilename.substr(0, dot);
         }
 
-        sResultFilename += "_rotate.pgm";
+        // --format picks the default output container: pgm, l4r (lossless
+        // LZ4 bands for fast hand-off between pipeline stages), tif or png
+        std::string sFormat = bBitonal ? "pbm" : bStack ? "tif" : "pgm";
+
+        if (checkCmdLineFlag(argc, (const char **)argv, "format"))
+        {
+            char *formatName;
+            getCmdLineArgumentString(argc, (const char **)argv, "format",
+                                     &formatName);
+            sFormat = formatName;
+        }
+
+        // TIFF output: --tiff-compression=none|packbits|deflate, --tiff-tile=N
+        // writes N x N tiles instead of strips, --bigtiff forces 64-bit offsets
+        // (otherwise only used when the file could outgrow 4 GiB)
+        pipeline::TiffOptions oTiffOptions;
+
+        if (checkCmdLineFlag(argc, (const char **)argv, "tiff-compression"))
+        {
+            char *compressionName;
+            getCmdLineArgumentString(argc, (const char **)argv, "tiff-compression",
+                                     &compressionName);
+            std::string sCompression = compressionName;
+
+            if (sCompression == "none")
+            {
+                oTiffOptions.eCompression = pipeline::TIFF_UNCOMPRESSED;
+            }
+            else if (sCompression == "packbits")
+            {
+                oTiffOptions.eCompression = pipeline::TIFF_PACKBITS;
+            }
+            else if (sCompression == "deflate")
+            {
+                oTiffOptions.eCompression = pipeline::TIFF_DEFLATE;
+            }
+            else
+            {
+                throw npp::Exception(
+                    "--tiff-compression must be none, packbits or deflate");
+            }
+        }
+
+        if (checkCmdLineFlag(argc, (const char **)argv, "tiff-tile"))
+        {
+            oTiffOptions.nTileSize = (unsigned int)std::max(
+                0, getCmdLineArgumentInt(argc, (const char **)argv, "tiff-tile"));
+        }
+
+        oTiffOptions.bBigTiff = checkCmdLineFlag(argc, (const char **)argv, "bigtiff");
+
+        // --binarize=global|otsu|sauvola appends a binarization stage and
+        // writes 1bpp PBM; --threshold sets the global level and --window the
+        // Sauvola window size
+        bool bBinarize = checkCmdLineFlag(argc, (const char **)argv, "binarize");
+        pipeline::BinarizeOptions oBinarizeOptions;
+
+        if (bBinarize)
+        {
+            char *methodName = 0;
+            getCmdLineArgumentString(argc, (const char **)argv, "binarize",
+                                     &methodName);
+
+            if (methodName && strcmp(methodName, "global") == 0)
+            {
+                oBinarizeOptions.eMethod = pipeline::BINARIZE_GLOBAL;
+            }
+            else if (methodName && strcmp(methodName, "otsu") == 0)
+            {
+                oBinarizeOptions.eMethod = pipeline::BINARIZE_OTSU;
+            }
+            else if (methodName && strcmp(methodName, "sauvola") == 0)
+            {
+                oBinarizeOptions.eMethod = pipeline::BINARIZE_SAUVOLA;
+            }
+            else
+            {
+                throw npp::Exception("--binarize expects global, otsu or sauvola");
+            }
+
+            if (checkCmdLineFlag(argc, (const char **)argv, "threshold"))
+            {
+                oBinarizeOptions.nThreshold =
+                    getCmdLineArgumentInt(argc, (const char **)argv, "threshold");
+            }
+
+            if (checkCmdLineFlag(argc, (const char **)argv, "window"))
+            {
+                oBinarizeOptions.nWindow =
+                    getCmdLineArgumentInt(argc, (const char **)argv, "window");
+            }
+
+            sFormat = "pbm";
+        }
+
+        // --morph=erode|dilate|open|close filters the rotated image with a
+        // rectangle of --element=WxH pixels (3x3 by default) before it is
+        // binarized or written
+        bool bMorph = checkCmdLineFlag(argc, (const char **)argv, "morph");
+        pipeline::MorphOperation eMorph = pipeline::MORPH_ERODE;
+        unsigned int nElementWidth = 3;
+        unsigned int nElementHeight = 3;
+
+        if (bMorph)
+        {
+            char *morphName = 0;
+            getCmdLineArgumentString(argc, (const char **)argv, "morph",
+                                     &morphName);
+
+            if (morphName && strcmp(morphName, "erode") == 0)
+            {
+                eMorph = pipeline::MORPH_ERODE;
+            }
+            else if (morphName && strcmp(morphName, "dilate") == 0)
+            {
+                eMorph = pipeline::MORPH_DILATE;
+            }
+            else if (morphName && strcmp(morphName, "open") == 0)
+            {
+                eMorph = pipeline::MORPH_OPEN;
+            }
+            else if (morphName && strcmp(morphName, "close") == 0)
+            {
+                eMorph = pipeline::MORPH_CLOSE;
+            }
+            else
+            {
+                throw npp::Exception("--morph expects erode, dilate, open or close");
+            }
+
+            if (checkCmdLineFlag(argc, (const char **)argv, "element"))
+            {
+                char *elementSize = 0;
+                getCmdLineArgumentString(argc, (const char **)argv, "element",
+                                         &elementSize);
+                int nFields = elementSize ? sscanf(elementSize, "%ux%u", &nElementWidth,
+                                                   &nElementHeight)
+                                          : 0;
+
+                if (nFields == 1)
+                {
+                    nElementHeight = nElementWidth;
+                }
+
+                if (nFields < 1 || nElementWidth == 0 || nElementHeight == 0)
+                {
+                    throw npp::Exception("--element expects WxH or N");
+                }
+            }
+        }
+
+        // --resize=WxH resamples the rotated image to W x H pixels with the
+        // --resample=area|bilinear|bicubic|lanczos filter (bicubic default)
+        bool bResize = checkCmdLineFlag(argc, (const char **)argv, "resize");
+        pipeline::ResizeOptions oResizeOptions;
+        unsigned int nResizeWidth = 0;
+        unsigned int nResizeHeight = 0;
+
+        if (bResize)
+        {
+            char *resizeSize = 0;
+            getCmdLineArgumentString(argc, (const char **)argv, "resize",
+                                     &resizeSize);
+
+            if (!resizeSize ||
+                sscanf(resizeSize, "%ux%u", &nResizeWidth, &nResizeHeight) != 2 ||
+                nResizeWidth == 0 || nResizeHeight == 0)
+            {
+                throw npp::Exception("--resize expects WxH");
+            }
+
+            if (checkCmdLineFlag(argc, (const char **)argv, "resample"))
+            {
+                char *filterName = 0;
+                getCmdLineArgumentString(argc, (const char **)argv, "resample",
+                                         &filterName);
+
+                if (filterName && strcmp(filterName, "area") == 0)
+                {
+                    oResizeOptions.eFilter = pipeline::RESIZE_AREA;
+                }
+                else if (filterName && strcmp(filterName, "bilinear") == 0)
+                {
+                    oResizeOptions.eFilter = pipeline::RESIZE_BILINEAR;
+                }
+                else if (filterName && strcmp(filterName, "bicubic") == 0)
+                {
+                    oResizeOptions.eFilter = pipeline::RESIZE_BICUBIC;
+                }
+                else if (filterName && strcmp(filterName, "lanczos") == 0)
+                {
+                    oResizeOptions.eFilter = pipeline::RESIZE_LANCZOS;
+                }
+                else
+                {
+                    throw npp::Exception(
+                        "--resample expects area, bilinear, bicubic or lanczos");
+                }
+            }
+        }
+
+        // --jpeg-scale=1|2|4|8 decodes a JPEG source at that fraction of its
+        // size; by default a --resize job picks the smallest one that still
+        // covers the requested size
+        unsigned int nJpegScale = 0;
+
+        if (checkCmdLineFlag(argc, (const char **)argv, "jpeg-scale"))
+        {
+            nJpegScale =
+                getCmdLineArgumentInt(argc, (const char **)argv, "jpeg-scale");
+
+            if (nJpegScale != 1 && nJpegScale != 2 && nJpegScale != 4 &&
+                nJpegScale != 8)
+            {
+                throw npp::Exception("--jpeg-scale expects 1, 2, 4 or 8");
+            }
+        }
+
+        // --crop=x,y,w,h, --transpose and --flip=h|v|hv prepare the source
+        // without touching its pixels: the crop and a vertical flip are views,
+        // mirrors and transposes fold into the rotation's affine map
+        bool bCrop = checkCmdLineFlag(argc, (const char **)argv, "crop");
+        unsigned int aCrop[4] = {0, 0, 0, 0};
+        pipeline::Orientation oOrientation;
+
+        if (bCrop)
+        {
+            char *cropRect = 0;
+            getCmdLineArgumentString(argc, (const char **)argv, "crop", &cropRect);
+
+            if (!cropRect || sscanf(cropRect, "%u,%u,%u,%u", &aCrop[0], &aCrop[1],
+                                    &aCrop[2], &aCrop[3]) != 4)
+            {
+                throw npp::Exception("--crop expects x,y,w,h");
+            }
+
+            if (aCrop[2] == 0 || aCrop[3] == 0)
+            {
+                throw npp::Exception("--crop expects a non-empty rectangle");
+            }
+        }
+
+        oOrientation.bTranspose =
+            checkCmdLineFlag(argc, (const char **)argv, "transpose");
+
+        if (checkCmdLineFlag(argc, (const char **)argv, "flip"))
+        {
+            char *flipAxes = 0;
+            getCmdLineArgumentString(argc, (const char **)argv, "flip", &flipAxes);
+
+            if (!flipAxes ||
+                (strcmp(flipAxes, "h") != 0 && strcmp(flipAxes, "v") != 0 &&
+                 strcmp(flipAxes, "hv") != 0))
+            {
+                throw npp::Exception("--flip expects h, v or hv");
+            }
+
+            oOrientation.bFlipX = strchr(flipAxes, 'h') != 0;
+            oOrientation.bFlipY = strchr(flipAxes, 'v') != 0;
+        }
+
+        // the orientation tag of a camera JPEG (EXIF) or a TIFF goes in front
+        // of --transpose and --flip, so the same single pass also turns the
+        // image upright; --ignore-orientation keeps the stored layout
+        pipeline::Orientation oSourceOrientation;
+
+        if (!checkCmdLineFlag(argc, (const char **)argv, "ignore-orientation"))
+        {
+            unsigned int nTag = pipeline::readImageOrientation(sFilename);
+            oSourceOrientation = pipeline::Orientation::exif(nTag);
+            oOrientation = oSourceOrientation.then(oOrientation);
+
+            if (nTag != 1)
+            {
+                std::cout << "Applying orientation tag " << nTag << std::endl;
+            }
+        }
+
+        // --devices=N splits the npp rotation over N devices, each uploading
+        // only the source region its part of the destination reads
+        unsigned int nDevices = 1;
+
+        if (checkCmdLineFlag(argc, (const char **)argv, "devices"))
+        {
+            nDevices = (unsigned int)std::max(
+                1, getCmdLineArgumentInt(argc, (const char **)argv, "devices"));
+        }
+
+        sResultFilename += "_rotate." + sFormat;
 
         if (checkCmdLineFlag(argc, (const char **)argv, "output"))
         {
@@ -146,42 +863,583 @@ int main(int argc, char *argv[])
             sResultFilename = outputFilePath;
         }
 
-        // declare a host image object for an 8-bit grayscale image
-        npp::ImageCPU_8u_C1 oHostSrc;
-        // load gray-scale image from disk
-        npp::loadImage(sFilename, oHostSrc);
-        // declare a device image and copy construct from the host image,
-        // i.e. upload host to device
-        npp::ImageNPP_8u_C1 oDeviceSrc(oHostSrc);
+        // --mmap-output creates the output PGM at its final size and maps
+        // it, so the last kernel (or the device download) writes the file
+        bool bMappedPgm =
+            checkCmdLineFlag(argc, (const char **)argv, "mmap-output") &&
+            !bBinarize && pipeline::fileExtension(sResultFilename) == ".pgm";
+
+        if (bStack)
+        {
+            std::string sInExtension = pipeline::fileExtension(sFilename);
+            std::string sOutExtension = pipeline::fileExtension(sResultFilename);
+
+            if ((sInExtension != ".tif" && sInExtension != ".tiff") ||
+                (sOutExtension != ".tif" && sOutExtension != ".tiff"))
+            {
+                throw npp::Exception("--stack reads and writes .tif or .tiff files");
+            }
+
+            if (bMorph || bResize || bCrop || bOps || bBinarize || bDeskew)
+            {
+                throw npp::Exception(
+                    "--stack only rotates; drop --morph, --resize, --crop, --ops, "
+                    "--binarize and --deskew");
+            }
+
+            size_t nPages = pipeline::rotateTiffStack(sFilename, sResultFilename, angle,
+                                                      oOrientation, oRotateOptions,
+                                                      oTiffOptions);
+
+            std::cout << "Saved " << nPages << " pages: " << sResultFilename
+                      << std::endl;
+
+            exit(EXIT_SUCCESS);
+        }
+
+        // JPEG to JPEG by a multiple of 90 degrees, with any --flip or
+        // --transpose, is done losslessly on the DCT coefficients; --stats
+        // needs the pixels and takes the decoding path instead
+        double nQuarterTurns = std::floor(angle / 90.0 + 0.5);
+        bool bJpegLossless =
+            std::fabs(angle - 90.0 * nQuarterTurns) < 1e-9 &&
+            pipeline::isJpegFile(sFilename) && pipeline::isJpegFile(sResultFilename) &&
+            !bMorph && !bResize && !bCrop && !bOps && !bBinarize && !bStats;
+
+        if (bJpegLossless)
+        {
+            // the coefficients are moved, not sampled: nothing to choose
+            static const char *const aPixelFlags[] = {
+                "backend", "devices", "interp", "traversal", "prefetch", "stores",
+                "deskew", "jpeg-scale"};
+
+            for (size_t i = 0; i < sizeof(aPixelFlags) / sizeof(aPixelFlags[0]); ++i)
+            {
+                if (checkCmdLineFlag(argc, (const char **)argv, aPixelFlags[i]))
+                {
+                    std::cout << "Ignoring --" << aPixelFlags[i]
+                              << ": the lossless DCT transform does not decode"
+                              << std::endl;
+                }
+            }
+
+            pipeline::JpegTrim oTrim = pipeline::transformJpeg(
+                sFilename, sResultFilename,
+                oOrientation.then(pipeline::Orientation::rotation((int)nQuarterTurns)),
+                !oSourceOrientation.isIdentity());
+
+            if (oTrim.nColumns != 0 || oTrim.nRows != 0)
+            {
+                std::cout << "Trimmed " << oTrim.nColumns << " columns and "
+                          << oTrim.nRows
+                          << " rows of the source to whole MCUs, as jpegtran -trim"
+                          << std::endl;
+            }
+
+            std::cout << "Saved image: " << sResultFilename << " (lossless DCT transform)"
+                      << std::endl;
+
+            exit(EXIT_SUCCESS);
+        }
+
+        // the op chain replaces the --angle rotation and everything around it
+        if (bOps && (bMorph || bResize || bCrop || bDeskew ||
+                     checkCmdLineFlag(argc, (const char **)argv, "flip") ||
+                     checkCmdLineFlag(argc, (const char **)argv, "transpose")))
+        {
+            throw npp::Exception(
+                "--ops takes crop, flip, transpose, scale and morph as operations; "
+                "drop --crop, --flip, --transpose, --resize, --morph and --deskew");
+        }
+
+        // the chain runs on the host and writes its result in one piece
+        if (bOps && (checkCmdLineFlag(argc, (const char **)argv, "devices") ||
+                     checkCmdLineFlag(argc, (const char **)argv, "mmap-output")))
+        {
+            throw npp::Exception("--ops runs on the host; drop --devices and "
+                                 "--mmap-output");
+        }
+
+        if (bBitonal)
+        {
+            if (bMorph || bResize || bCrop || bOps || bStats)
+            {
+                throw npp::Exception("--morph, --resize, --crop, --ops and --stats "
+                                     "need an 8-bit input image");
+            }
+
+            // the packed-bit rotation has one host engine, nearest sampling
+            // and its own writer, and the input is already binary
+            static const char *const aGrayFlags[] = {
+                "backend", "devices", "interp", "traversal", "prefetch", "stores",
+                "deskew", "mmap-output", "binarize"};
+
+            for (size_t i = 0; i < sizeof(aGrayFlags) / sizeof(aGrayFlags[0]); ++i)
+            {
+                if (checkCmdLineFlag(argc, (const char **)argv, aGrayFlags[i]))
+                {
+                    std::cout << "Ignoring --" << aGrayFlags[i]
+                              << ": bitonal PBM input is rotated on packed bits"
+                              << std::endl;
+                }
+            }
+
+            pipeline::BitImageBuffer oBitSrc;
+
+            if (!pipeline::loadImagePBM(sFilename, oBitSrc))
+            {
+                exit(EXIT_FAILURE);
+            }
+
+            pipeline::BitImageBuffer oBitDst =
+                pipeline::rotateBits(oBitSrc.view(), angle, oOrientation);
+
+            pipeline::saveImagePBM(sResultFilename, oBitDst.view());
+            std::cout << "Saved image: " << sResultFilename << std::endl;
+
+            exit(EXIT_SUCCESS);
+        }
+
+        // load gray-scale image from disk; PGM, L4R and TIFF go through the
+        // pipeline readers, JPEG through libjpeg, anything else through
+        // FreeImage
+        pipeline::ImageBuffer_8u_C1 oHostSrc;
+        npp::ImageCPU_8u_C1 oFreeImageSrc;
+        pipeline::ImageConstView_8u_C1 oSrcView;
+
+        // a JPEG that is only needed at a fraction of its size is decoded at
+        // that size, see JpegFile.h; crops and op graphs address source
+        // pixels, so they always decode it whole
+        if (nJpegScale != 0 && (bCrop || bOps))
+        {
+            throw npp::Exception("--jpeg-scale cannot be combined with --crop or --ops");
+        }
+
+        if (pipeline::isJpegFile(sFilename))
+        {
+            if (nJpegScale == 0 && (!bResize || bCrop || bOps))
+            {
+                nJpegScale = 1;
+            }
+            else if (nJpegScale == 0)
+            {
+                unsigned int nWidth, nHeight;
+
+                if (!pipeline::readJpegSize(sFilename, nWidth, nHeight))
+                {
+                    exit(EXIT_FAILURE);
+                }
+
+                pipeline::RotateGeometry oFullGeometry = pipeline::makeRotateGeometry(
+                    nWidth, nHeight, angle, oOrientation);
+                nJpegScale = pipeline::jpegScaleFor(oFullGeometry.nDstWidth,
+                                                    oFullGeometry.nDstHeight,
+                                                    nResizeWidth, nResizeHeight);
+            }
+
+            if (!pipeline::loadImageJPEG(sFilename, oHostSrc, nJpegScale))
+            {
+                exit(EXIT_FAILURE);
+            }
+
+            oSrcView = oHostSrc.view();
+        }
+        else if (pipeline::isPipelineImageFile(sFilename))
+        {
+            if (!pipeline::loadImageFile(sFilename, oHostSrc))
+            {
+                exit(EXIT_FAILURE);
+            }
+
+            oSrcView = oHostSrc.view();
+        }
+        else
+        {
+            npp::loadImage(sFilename, oFreeImageSrc);
+            oSrcView = pipeline::viewOf(oFreeImageSrc);
+        }
+
+        if (bOps)
+        {
+            pipeline::OpGraph oGraph(oSrcView, oRotateOptions);
+
+            if (!oSourceOrientation.isIdentity())
+            {
+                oGraph.orient(oSourceOrientation);
+            }
+
+            oGraph.parse(sOps);
+
+            if (bExplain)
+            {
+                std::cout << oGraph.explain();
+            }
+
+            pipeline::ImageStats oStats;
+            pipeline::ImageBuffer_8u_C1 oResult =
+                oGraph.execute(bStats ? &oStats : 0);
+
+            if (bStats)
+            {
+                printImageStats(oStats);
+            }
+
+            if (bBinarize)
+            {
+                pipeline::saveImagePBM(
+                    sResultFilename,
+                    pipeline::binarize(oResult.view(), oBinarizeOptions).view());
+            }
+            else
+            {
+                saveHostImage(sResultFilename, oResult.view(), oTiffOptions);
+            }
+
+            std::cout << "Saved image: " << sResultFilename << std::endl;
+
+            exit(EXIT_SUCCESS);
+        }
+
+        if (bCrop)
+        {
+            oSrcView = oSrcView.crop(aCrop[0], aCrop[1], aCrop[2], aCrop[3]);
+        }
+
+        if (!oOrientation.bTranspose && oOrientation.bFlipY)
+        {
+            oSrcView = oSrcView.flipVertical();
+            oOrientation.bFlipY = false;
+        }
+
+        // --stats needs the 8-bit rotated image, so it takes the unfused path
+        if (bCpuBackend && bBinarize && !bMorph && !bResize && !bStats)
+        {
+            pipeline::RotateGeometry oGeometry = pipeline::makeRotateGeometry(
+                oSrcView.width(), oSrcView.height(), angle, oOrientation);
+
+            // rotation and thresholding share the tiles, the 8-bit rotated
+            // image is never stored
+            pipeline::BitImageBuffer oBits = pipeline::rotateBinarize(
+                oSrcView, oGeometry, oRotateOptions, oBinarizeOptions);
+
+            pipeline::saveImagePBM(sResultFilename, oBits.view());
+            std::cout << "Saved image: " << sResultFilename << std::endl;
+
+            exit(EXIT_SUCCESS);
+        }
+
+        if (bCpuBackend)
+        {
+            pipeline::RotateGeometry oGeometry = pipeline::makeRotateGeometry(
+                oSrcView.width(), oSrcView.height(), angle, oOrientation);
+            pipeline::StatsEpilogue oStats;
+            bool bShear = false;
+
+            if (bDeskew && pipeline::shearDeskewApplies(oGeometry))
+            {
+                double nError = pipeline::shearDeskewError(
+                    oGeometry, oRotateOptions.eInterpolation);
+                bShear = nError <= nDeskewTolerance;
+                printf("Shear deskew: samples within %.3f px of the exact rotation%s\n",
+                       nError, bShear ? "" : ", above --deskew, rotating exactly");
+            }
+            else if (bDeskew)
+            {
+                printf("Shear deskew: only for rotations up to %g degrees, "
+                       "rotating exactly\n",
+                       pipeline::kMaxShearAngle);
+            }
+
+            unsigned int nOutWidth = bResize ? nResizeWidth : oGeometry.nDstWidth;
+            unsigned int nOutHeight = bResize ? nResizeHeight : oGeometry.nDstHeight;
+
+            // the last kernel writes straight into the storage the chosen
+            // writer consumes
+            pipeline::ImageBuffer_8u_C1 oHostDst;
+            std::unique_ptr<npp::ImageCPU_8u_C1> pFreeImageDst;
+            std::unique_ptr<pipeline::MappedPgmFile> pMappedDst;
+            pipeline::ImageView_8u_C1 oDstView;
+
+            if (bMappedPgm)
+            {
+                pMappedDst.reset(
+                    new pipeline::MappedPgmFile(sResultFilename, nOutWidth, nOutHeight));
+                oDstView = pMappedDst->view();
+            }
+            else if (bBinarize || pipeline::isPipelineImageFile(sResultFilename))
+            {
+                oHostDst = pipeline::ImageBuffer_8u_C1(nOutWidth, nOutHeight);
+                oDstView = oHostDst.view();
+            }
+            else
+            {
+                pFreeImageDst.reset(new npp::ImageCPU_8u_C1(nOutWidth, nOutHeight));
+                oDstView = pipeline::viewOf(*pFreeImageDst);
+            }
+
+            // statistics ride on that last kernel unless morphology follows
+            bool bFusedStats = bStats && !bMorph;
+
+            // a rotation straight to PGM hands the writer each row band as
+            // soon as it is complete, so writing overlaps the rotation
+            bool bBandedPgm = !bResize && !bMorph && !bBinarize && !bShear &&
+                              !bMappedPgm &&
+                              pipeline::fileExtension(sResultFilename) == ".pgm";
+
+            if (bResize)
+            {
+                pipeline::ImageBuffer_8u_C1 oRotated(oGeometry.nDstWidth,
+                                                     oGeometry.nDstHeight);
+                if (bShear)
+                {
+                    pipeline::shearDeskew(oSrcView, oRotated.view(), oGeometry,
+                                          oRotateOptions);
+                }
+                else
+                {
+                    pipeline::rotate(oSrcView, oRotated.view(), oGeometry,
+                                     oRotateOptions);
+                }
+
+                if (bFusedStats)
+                {
+                    pipeline::resize(oRotated.view(), oDstView, oResizeOptions,
+                                     oStats);
+                }
+                else
+                {
+                    pipeline::resize(oRotated.view(), oDstView, oResizeOptions);
+                }
+            }
+            else if (bBandedPgm)
+            {
+                pipeline::PgmWriter oWriter(sResultFilename, oDstView.width(),
+                                            oDstView.height());
+                auto writeBand = [&](unsigned int nFirstRow, unsigned int nEndRow)
+                {
+                    oWriter.write(oDstView.crop(0, nFirstRow, oDstView.width(),
+                                                nEndRow - nFirstRow));
+                };
+                pipeline::NoEpilogue oNone;
+
+                if (bFusedStats)
+                {
+                    pipeline::rotateOrdered(oSrcView, oDstView, oGeometry,
+                                            oRotateOptions, oStats, writeBand);
+                }
+                else
+                {
+                    pipeline::rotateOrdered(oSrcView, oDstView, oGeometry,
+                                            oRotateOptions, oNone, writeBand);
+                }
+
+                oWriter.close();
+            }
+            else if (bShear && bFusedStats)
+            {
+                pipeline::shearDeskew(oSrcView, oDstView, oGeometry, oRotateOptions,
+                                      oStats);
+            }
+            else if (bShear)
+            {
+                pipeline::shearDeskew(oSrcView, oDstView, oGeometry, oRotateOptions);
+            }
+            else if (bFusedStats)
+            {
+                pipeline::rotate(oSrcView, oDstView, oGeometry, oRotateOptions,
+                                 oStats);
+            }
+            else
+            {
+                pipeline::rotate(oSrcView, oDstView, oGeometry, oRotateOptions);
+            }
+
+            if (bFusedStats)
+            {
+                printImageStats(oStats.result());
+            }
+
+            if (bMorph)
+            {
+                pipeline::morphology(oDstView, oDstView, eMorph, nElementWidth,
+                                     nElementHeight);
+
+                if (bStats)
+                {
+                    printImageStats(pipeline::computeStats(oDstView));
+                }
+            }
+
+            if (bBinarize)
+            {
+                pipeline::saveImagePBM(
+                    sResultFilename,
+                    pipeline::binarize(oDstView, oBinarizeOptions).view());
+            }
+            else if (bMappedPgm)
+            {
+                pMappedDst->close();
+            }
+            else if (bBandedPgm)
+            {
+                // written while rotating
+            }
+            else if (pipeline::isPipelineImageFile(sResultFilename))
+            {
+                pipeline::saveImageFile(sResultFilename, oDstView, oTiffOptions);
+            }
+            else
+            {
+                saveImage(sResultFilename, *pFreeImageDst);
+            }
+
+            std::cout << "Saved image: " << sResultFilename << std::endl;
+
+            exit(EXIT_SUCCESS);
+        }
+
+        // NPP only rotates, and device copies need a positive pitch: apply
+        // the orientation while staging the source on the host
+        pipeline::ImageBuffer_8u_C1 oOrientedSrc;
+
+        if (!oOrientation.isIdentity() || oSrcView.pitch() < 0)
+        {
+            oOrientedSrc = pipeline::ImageBuffer_8u_C1(
+                oOrientation.width(oSrcView.width(), oSrcView.height()),
+                oOrientation.height(oSrcView.width(), oSrcView.height()));
+            pipeline::orient(oSrcView, oOrientedSrc.view(), oOrientation);
+            oSrcView = oOrientedSrc.view();
+        }
+
+        // the same box and placement as the host backend: the orientation is
+        // already applied, so rotate about the origin and shift the result
+        // into the bounding box
+        pipeline::RotateGeometry oGeometry = pipeline::makeRotateGeometry(
+            oSrcView.width(), oSrcView.height(), angle);
+
+        // resize, morphology, stats and binarization of a host result
+        auto finishHostResult = [&](pipeline::ImageBuffer_8u_C1 &rHostDst)
+        {
+            if (bResize)
+            {
+                pipeline::ImageBuffer_8u_C1 oResized(nResizeWidth, nResizeHeight);
+                pipeline::resize(rHostDst.view(), oResized.view(), oResizeOptions);
+                rHostDst = std::move(oResized);
+            }
+
+            if (bMorph)
+            {
+                pipeline::morphology(rHostDst.view(), rHostDst.view(), eMorph,
+                                     nElementWidth, nElementHeight);
+            }
+
+            if (bStats)
+            {
+                printImageStats(pipeline::computeStats(rHostDst.view()));
+            }
+
+            if (bBinarize)
+            {
+                pipeline::saveImagePBM(
+                    sResultFilename,
+                    pipeline::binarize(rHostDst.view(), oBinarizeOptions).view());
+            }
+            else
+            {
+                saveHostImage(sResultFilename, rHostDst.view(), oTiffOptions);
+            }
+        };
+
+        if (nDevices > 1)
+        {
+            pipeline::ImageBuffer_8u_C1 oHostDst =
+                rotateOnDevices(oSrcView, angle, oGeometry, oRotateOptions, nDevices);
+            finishHostResult(oHostDst);
+            std::cout << "Saved image: " << sResultFilename << std::endl;
+
+            exit(EXIT_SUCCESS);
+        }
+
+        // declare a device image and upload the host pixels into it
+        npp::ImageNPP_8u_C1 oDeviceSrc(oSrcView.width(), oSrcView.height());
+        oDeviceSrc.copyFrom(const_cast<Npp8u *>(oSrcView.data()),
+                            (unsigned int)oSrcView.pitch());
 
         // create struct with the ROI size
         NppiSize oSrcSize = {(int)oDeviceSrc.width(), (int)oDeviceSrc.height()};
-        NppiPoint oSrcOffset = {0, 0};
-        NppiSize oSizeROI = {(int)oDeviceSrc.width(), (int)oDeviceSrc.height()};
+        NppiRect oSrcROI = {0, 0, oSrcSize.width, oSrcSize.height};
 
-        // Calculate the bounding box of the rotated image
-        NppiRect oBoundingBox;
-        double angle = 45.0; // Rotation angle in degrees
-        NPP_CHECK_NPP(nppiGetRotateBound(oSrcSize, angle, &oBoundingBox));
-
-        // allocate device image for the rotated image
-        npp::ImageNPP_8u_C1 oDeviceDst(oBoundingBox.width, oBoundingBox.height);
+        // nppiRotate leaves the pixels outside the rotated source untouched
+        npp::ImageNPP_8u_C1 oDeviceDst(oGeometry.nDstWidth, oGeometry.nDstHeight);
+        NppiRect oDstROI = {0, 0, (int)oDeviceDst.width(), (int)oDeviceDst.height()};
+        NppiSize oDstSize = {oDstROI.width, oDstROI.height};
+        NPP_CHECK_NPP(nppiSet_8u_C1R(oRotateOptions.nBackground, oDeviceDst.data(),
+                                     oDeviceDst.pitch(), oDstSize));
 
-        // Set the rotation point (center of the image)
-        NppiPoint oRotationCenter = {(int)(oSrcSize.width / 2), (int)(oSrcSize.height / 2)};
+        // NPP centres pixel (x, y) on the integer point, the geometry on
+        // (x + 0.5, y + 0.5)
+        double nShiftX, nShiftY;
+        oGeometry.oForward.apply(0.5, 0.5, nShiftX, nShiftY);
 
         // run the rotation
         NPP_CHECK_NPP(nppiRotate_8u_C1R(
-            oDeviceSrc.data(), oSrcSize, oDeviceSrc.pitch(), oSrcOffset,
-            oDeviceDst.data(), oDeviceDst.pitch(), oBoundingBox, angle, oRotationCenter,
-            NPPI_INTER_NN));
+            oDeviceSrc.data(), oSrcSize, oDeviceSrc.pitch(), oSrcROI,
+            oDeviceDst.data(), oDeviceDst.pitch(), oDstROI, angle,
+            nShiftX - 0.5, nShiftY - 0.5,
+            oRotateOptions.eInterpolation == pipeline::INTER_LINEAR
+                ? NPPI_INTER_LINEAR
+                : NPPI_INTER_NN));
+
+        if (bMappedPgm && !bResize)
+        {
+            // download straight into the mapped output file
+            pipeline::MappedPgmFile oMappedDst(sResultFilename, oDeviceDst.width(),
+                                               oDeviceDst.height());
+            pipeline::ImageView_8u_C1 oMappedView = oMappedDst.view();
+            oDeviceDst.copyTo(oMappedView.data(), (unsigned int)oMappedView.pitch());
+
+            if (bMorph)
+            {
+                pipeline::morphology(oMappedView, oMappedView, eMorph, nElementWidth,
+                                     nElementHeight);
+            }
 
-        // declare a host image for the result
-        npp::ImageCPU_8u_C1 oHostDst(oDeviceDst.size());
-        // and copy the device result data into it
-        oDeviceDst.copyTo(oHostDst.data(), oHostDst.pitch());
+            if (bStats)
+            {
+                printImageStats(pipeline::computeStats(oMappedView));
+            }
+
+            oMappedDst.close();
+        }
+        else if (bBinarize || bResize || pipeline::isPipelineImageFile(sResultFilename))
+        {
+            // declare a host image for the result
+            pipeline::ImageBuffer_8u_C1 oHostDst(oDeviceDst.width(),
+                                                 oDeviceDst.height());
+            // and copy the device result data into it
+            oDeviceDst.copyTo(oHostDst.data(), (unsigned int)oHostDst.pitch());
+            finishHostResult(oHostDst);
+        }
+        else
+        {
+            npp::ImageCPU_8u_C1 oHostDst(oDeviceDst.size());
+            oDeviceDst.copyTo(oHostDst.data(), oHostDst.pitch());
+
+            if (bMorph)
+            {
+                pipeline::morphology(pipeline::viewOf(oHostDst),
+                                     pipeline::viewOf(oHostDst), eMorph,
+                                     nElementWidth, nElementHeight);
+            }
+
+            if (bStats)
+            {
+                printImageStats(pipeline::computeStats(pipeline::viewOf(oHostDst)));
+            }
+
+            saveImage(sResultFilename, oHostDst);
+        }
 
-        saveImage(sResultFilename, oHostDst);
         std::cout << "Saved image: " << sResultFilename << std::endl;
 
         nppiFree(oDeviceSrc.data());
@@ -12,6 +12,8 @@
 #include <Exceptions.h>
 #include <ImagesCPU.h>
 #include <ImagesNPP.h>
+#include <ImageFile.h>
+#include <ImageView.h>
 
 #include <string.h>
 #include <fstream>
@@ -45,69 +47,6 @@ bool printfNPPinfo(int argc, char *argv[])
     return bVal;
 }
 
-// Load PGM image
-bool loadImagePGM(const std::string &fileName, npp::ImageCPU_8u_C1 &rImage)
-{
-    std::ifstream file(fileName, std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "Could not open file: " << fileName << std::endl;
-        return false;
-    }
-    
-    std::string line;
-    
-    // Read magic number
-    std::getline(file, line);
-    if (line != "P5") {
-        std::cerr << "Unsupported PGM format: " << line << std::endl;
-        return false;
-    }
-    
-    // Skip comments
-    while (std::getline(file, line) && line[0] == '#') {}
-    
-    // Parse dimensions
-    std::istringstream iss(line);
-    int width, height;
-    iss >> width >> height;
-    
-    // Read max value
-    std::getline(file, line);
-    int maxVal = std::stoi(line);
-    
-    std::cout << "Loading image: " << width << "x" << height << " (max: " << maxVal << ")" << std::endl;
-    
-    // Create image
-    rImage = npp::ImageCPU_8u_C1(width, height);
-    
-    // Read pixel data
-    file.read(reinterpret_cast<char*>(rImage.data()), width * height);
-    
-    file.close();
-    return true;
-}
-
-// Simple PGM format saver
-void saveImagePGM(const std::string &fileName, const npp::ImageCPU_8u_C1 &rImage)
-{
-    std::ofstream file(fileName, std::ios::binary);
-    if (!file.is_open()) {
-        throw npp::Exception("Could not open file for writing");
-    }
-    
-    // Write PGM header
-    file << "P5\n";
-    file << rImage.width() << " " << rImage.height() << "\n";
-    file << "255\n";
-    
-    // Write image data
-    for (int y = 0; y < rImage.height(); ++y) {
-        file.write(reinterpret_cast<const char*>(rImage.data() + y * rImage.pitch()), rImage.width());
-    }
-    
-    file.close();
-}
-
 int main(int argc, char *argv[])
 {
     printf("%s Starting...\n\n", argv[0]);
@@ -125,24 +64,25 @@ int main(int argc, char *argv[])
         std::string inputFile = "data\\Lena_gray.pgm";
         std::cout << "Loading actual Lena image from: " << inputFile << std::endl;
         
-        npp::ImageCPU_8u_C1 oHostSrc;
-        if (!loadImagePGM(inputFile, oHostSrc)) {
+        pipeline::ImageBuffer_8u_C1 oHostSrc;
+        if (!pipeline::loadImagePNM(inputFile, oHostSrc)) {
             std::cerr << "Failed to load image. Creating test pattern instead." << std::endl;
             
             // Fallback to test pattern if image loading fails
-            oHostSrc = npp::ImageCPU_8u_C1(512, 512);
+            oHostSrc = pipeline::ImageBuffer_8u_C1(512, 512);
+            pipeline::ImageView_8u_C1 oView = oHostSrc.view();
             for (int y = 0; y < 512; ++y) {
                 for (int x = 0; x < 512; ++x) {
                     int checkSize = 32;
                     bool isWhite = ((x / checkSize) + (y / checkSize)) % 2 == 0;
-                    oHostSrc.data()[y * oHostSrc.pitch() + x] = isWhite ? 255 : 64;
+                    oView.row(y)[x] = isWhite ? 255 : 64;
                 }
             }
         }
         
-        // declare a device image and copy construct from the host image,
-        // i.e. upload host to device
-        npp::ImageNPP_8u_C1 oDeviceSrc(oHostSrc);
+        // declare a device image and upload the host pixels into it
+        npp::ImageNPP_8u_C1 oDeviceSrc(oHostSrc.width(), oHostSrc.height());
+        oDeviceSrc.copyFrom(oHostSrc.data(), (unsigned int)oHostSrc.pitch());
 
         // create struct with the ROI size
         NppiSize oSrcSize = {(int)oDeviceSrc.width(), (int)oDeviceSrc.height()};
@@ -182,12 +122,12 @@ int main(int argc, char *argv[])
             angle, oRotationCenter.x, oRotationCenter.y, NPPI_INTER_NN) );
         
         // declare a host image for the result
-        npp::ImageCPU_8u_C1 oHostDst(oDeviceDst.size());
+        pipeline::ImageBuffer_8u_C1 oHostDst(oDeviceDst.width(), oDeviceDst.height());
         // and copy the device result data into it
-        oDeviceDst.copyTo(oHostDst.data(), oHostDst.pitch());
+        oDeviceDst.copyTo(oHostDst.data(), (unsigned int)oHostDst.pitch());
 
         std::string outputFile = "data\\Lena_rotated.pgm";
-        saveImagePGM(outputFile, oHostDst);
+        pipeline::saveImagePGM(outputFile, oHostDst.view());
         std::cout << "Saved rotated image: " << outputFile << std::endl;
         
         // Also create PNG version for easy viewing
@@ -12,6 +12,8 @@
 #include <Exceptions.h>
 #include <ImagesCPU.h>
 #include <ImagesNPP.h>
+#include <ImageFile.h>
+#include <ImageView.h>
 
 #include <string.h>
 #include <fstream>
@@ -45,40 +47,22 @@ bool printfNPPinfo(int argc, char *argv[])
 }
 
 // Create a simple test pattern image
-void createTestImage(npp::ImageCPU_8u_C1 &rImage, int width, int height)
+pipeline::ImageBuffer_8u_C1 createTestImage(int width, int height)
 {
     // Create an image with a simple pattern
-    rImage = npp::ImageCPU_8u_C1(width, height);
+    pipeline::ImageBuffer_8u_C1 oImage(width, height);
+    pipeline::ImageView_8u_C1 oView = oImage.view();
     
     // Fill with a checkerboard pattern
     for (int y = 0; y < height; ++y) {
         for (int x = 0; x < width; ++x) {
             int checkSize = 32;
             bool isWhite = ((x / checkSize) + (y / checkSize)) % 2 == 0;
-            rImage.data()[y * rImage.pitch() + x] = isWhite ? 255 : 64;
+            oView.row(y)[x] = isWhite ? 255 : 64;
         }
     }
-}
 
-// Simple PGM format saver (no external dependencies)
-void saveImagePGM(const std::string &fileName, const npp::ImageCPU_8u_C1 &rImage)
-{
-    std::ofstream file(fileName, std::ios::binary);
-    if (!file.is_open()) {
-        throw npp::Exception("Could not open file for writing");
-    }
-    
-    // Write PGM header
-    file << "P5\n";
-    file << rImage.width() << " " << rImage.height() << "\n";
-    file << "255\n";
-    
-    // Write image data
-    for (int y = 0; y < rImage.height(); ++y) {
-        file.write(reinterpret_cast<const char*>(rImage.data() + y * rImage.pitch()), rImage.width());
-    }
-    
-    file.close();
+    return oImage;
 }
 
 int main(int argc, char *argv[])
@@ -97,12 +81,11 @@ int main(int argc, char *argv[])
         std::cout << "Creating test image (512x512 checkerboard pattern)..." << std::endl;
         
         // Create a test image instead of loading from file
-        npp::ImageCPU_8u_C1 oHostSrc;
-        createTestImage(oHostSrc, 512, 512);
+        pipeline::ImageBuffer_8u_C1 oHostSrc = createTestImage(512, 512);
         
-        // declare a device image and copy construct from the host image,
-        // i.e. upload host to device
-        npp::ImageNPP_8u_C1 oDeviceSrc(oHostSrc);
+        // declare a device image and upload the host pixels into it
+        npp::ImageNPP_8u_C1 oDeviceSrc(oHostSrc.width(), oHostSrc.height());
+        oDeviceSrc.copyFrom(oHostSrc.data(), (unsigned int)oHostSrc.pitch());
 
         // create struct with the ROI size
         NppiSize oSrcSize = {(int)oDeviceSrc.width(), (int)oDeviceSrc.height()};
@@ -143,12 +126,12 @@ int main(int argc, char *argv[])
             angle, oRotationCenter.x, oRotationCenter.y, NPPI_INTER_NN) );
         
         // declare a host image for the result
-        npp::ImageCPU_8u_C1 oHostDst(oDeviceDst.size());
+        pipeline::ImageBuffer_8u_C1 oHostDst(oDeviceDst.width(), oDeviceDst.height());
         // and copy the device result data into it
-        oDeviceDst.copyTo(oHostDst.data(), oHostDst.pitch());
+        oDeviceDst.copyTo(oHostDst.data(), (unsigned int)oHostDst.pitch());
 
         std::string outputFile = "data\\test_rotated.pgm";
-        saveImagePGM(outputFile, oHostDst);
+        pipeline::saveImagePGM(outputFile, oHostDst.view());
         std::cout << "Saved rotated image: " << outputFile << std::endl;
         std::cout << "Note: Output is in PGM format. You can view it with image viewers that support PGM files." << std::endl;
 